@@ -6,10 +6,12 @@ TEMPLATE = app
 TARGET = evdev_trace
 INCLUDEPATH += .
 
-DEFINES += _XOPEN_SOURCE=700
+DEFINES += _XOPEN_SOURCE=700 _DEFAULT_SOURCE
 
 QMAKE_CFLAGS += -std=c99
 
 # Input
+HEADERS += evshm.h
 SOURCES += main.c
 
+LIBS += -lpthread -lm -lrt
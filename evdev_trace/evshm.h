@@ -0,0 +1,452 @@
+/* ------------------------------------------------------------------------- *
+ * Client interface to the evdev_trace shared memory event ring
+ * License: GPLv2
+ * ------------------------------------------------------------------------- */
+
+/* ------------------------------------------------------------------------- *
+ * Shared memory event ring
+ *
+ * In publish mode evdev_trace is the only process reading the input
+ * devices; it copies the events into a ring buffer in POSIX shared
+ * memory, from where any number of local clients can follow them.
+ *
+ * The ring has a single writer. Every entry is guarded by its own
+ * sequence number: while entry for stream position P is being written
+ * the sequence is 2P+1, and 2P+2 once it is complete. The writer then
+ * advances the ring head. Clients map the ring read-only and copy out
+ * entries between head and their own position, re-checking the sequence
+ * afterwards; an entry that changed under them was overwritten because
+ * the client fell more than a full ring behind, and is counted as lost.
+ *
+ * Reading does not need system calls. Clients that want to sleep while
+ * there is nothing to read wait on a futex word in a separate, small
+ * control object "NAME.ctl" that clients can write to. A waiting client
+ * announces itself in the waiter count there, and the writer bumps the
+ * futex word and makes the wake up system call only while the count is
+ * nonzero. Clients without write access to the control object fall
+ * back to polling the ring head.
+ *
+ * A client killed while waiting leaves the count raised for good, as
+ * does any group member writing to it. The writer notices when a wake
+ * up reaches nobody and then wakes at most every 10 ms until one
+ * reaches a waiter again, so a stale count costs waiting clients up to
+ * 10 ms of latency rather than costing the writer a system call per
+ * batch.
+ *
+ * The ring itself is readable only by the publisher, or by the group it
+ * was published for, since it carries every keystroke.
+ *
+ * The header builds as C99 and as C++. It needs syscall() and struct
+ * timespec, so under strict standard modes such as -std=c99 it has to be
+ * included before any system header, or _DEFAULT_SOURCE has to be
+ * defined on the command line.
+ *
+ * This header is all a client needs:
+ *
+ *   evshm_client_t cl;
+ *   evshm_event_t  eve[64];
+ *
+ *   if( evshm_attach(&cl, "evdev_trace") == 0 )
+ *   {
+ *     for( ;; )
+ *     {
+ *       int n = evshm_read(&cl, eve, 64);
+ *       if( n == 0 ) evshm_wait(&cl, -1);
+ *       ...
+ *     }
+ *   }
+ * ------------------------------------------------------------------------- */
+
+#ifndef EVSHM_H_
+# define EVSHM_H_
+
+# if !defined _DEFAULT_SOURCE && !defined _GNU_SOURCE
+#  define _DEFAULT_SOURCE
+# endif
+
+# include <linux/input.h>
+# include <linux/futex.h>
+
+# include <errno.h>
+# include <sched.h>
+# include <stddef.h>
+# include <stdint.h>
+# include <stdio.h>
+# include <string.h>
+# include <unistd.h>
+# include <fcntl.h>
+# include <time.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/syscall.h>
+
+/** Magic number at the start of the shared memory object */
+# define EVSHM_MAGIC 0x4d485345u // "ESHM"
+
+/** Layout version, bumped on incompatible changes */
+# define EVSHM_VERSION 2
+
+/** Number of device slots with names in the ring header */
+# define EVSHM_DEVICES 64
+
+/** Default shared memory object name */
+# define EVSHM_DEFAULT_NAME "evdev_trace"
+
+/** Suffix of the control object name */
+# define EVSHM_CTL_SUFFIX ".ctl"
+
+/** Attempts at reading a device slot before evshm_device() gives up */
+# define EVSHM_DEVICE_RETRIES 100000
+
+/** Device slot description */
+typedef struct
+{
+  uint32_t seq;       // odd while being updated
+  uint32_t attached;  // nonzero while device is being traced
+  char     path[128];
+  char     name[128];
+} evshm_dev_t;
+
+/** Ring entry, one input event */
+typedef struct
+{
+  uint64_t seq;    // 2P+1 while writing position P, 2P+2 when done
+  int64_t  sec;    // event time stamp
+  int32_t  usec;
+  uint16_t type;
+  uint16_t code;
+  int32_t  value;
+  uint32_t device; // device slot
+} evshm_entry_t;
+
+/** Shared memory object layout
+ *
+ * The ring has "entries" elements; it is declared with one so that the
+ * header stays valid C++.
+ */
+typedef struct
+{
+  uint32_t      magic;   // written last by the publisher
+  uint32_t      version;
+  uint32_t      entries; // ring size, power of two
+  uint32_t      reserved;
+  uint64_t      head;    // number of events published so far
+  evshm_dev_t   dev[EVSHM_DEVICES];
+  evshm_entry_t ring[1];
+} evshm_ring_t;
+
+/** Control object layout, writable by clients */
+typedef struct
+{
+  uint32_t futex;   // bumped after published batches while waiters > 0
+  uint32_t waiters; // clients blocked in evshm_wait()
+} evshm_ctl_t;
+
+/** Event as seen by clients */
+typedef struct
+{
+  uint32_t           device; // device slot
+  struct input_event ev;
+} evshm_event_t;
+
+/** Client state */
+typedef struct
+{
+  const evshm_ring_t *ring;
+  size_t              size;
+  evshm_ctl_t        *ctl;  // NULL if the control object is not writable
+  uint64_t            pos;  // next stream position to read
+  uint64_t            lost; // events overwritten before they were read
+} evshm_client_t;
+
+/** Get size of shared memory object for a ring
+ *
+ * @param entries number of ring entries
+ */
+static inline size_t evshm_size(uint32_t entries)
+{
+  return offsetof(evshm_ring_t, ring) + entries * sizeof (evshm_entry_t);
+}
+
+/** Make shared memory object path from name
+ *
+ * @param name object name, with or without leading slash
+ * @param buf  buffer for the path
+ * @param size size of buf
+ */
+static inline const char *evshm_path(const char *name, char *buf, size_t size)
+{
+  snprintf(buf, size, "%s%s", (*name == '/') ? "" : "/", name);
+  return buf;
+}
+
+/** Make control object path from name
+ *
+ * @param name shared memory object name, with or without leading slash
+ * @param buf  buffer for the path
+ * @param size size of buf
+ */
+static inline const char *evshm_ctl_path(const char *name, char *buf,
+                                         size_t size)
+{
+  snprintf(buf, size, "%s%s" EVSHM_CTL_SUFFIX, (*name == '/') ? "" : "/",
+           name);
+  return buf;
+}
+
+/** Start following a ring published by evdev_trace
+ *
+ * Reading starts from the events published after attaching.
+ *
+ * @param cl   client state to initialize
+ * @param name shared memory object name, e.g. EVSHM_DEFAULT_NAME
+ *
+ * @return 0 on success, or -1 with errno set
+ */
+static inline int evshm_attach(evshm_client_t *cl, const char *name)
+{
+  char                path[256];
+  struct stat         st;
+  int                 fd;
+  const evshm_ring_t *ring;
+
+  memset(cl, 0, sizeof *cl);
+
+  evshm_path(name, path, sizeof path);
+  if( (fd = shm_open(path, O_RDONLY, 0)) == -1 )
+  {
+    return -1;
+  }
+
+  if( fstat(fd, &st) == -1 || (size_t)st.st_size < evshm_size(0) )
+  {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  ring = (const evshm_ring_t *)mmap(0, st.st_size, PROT_READ, MAP_SHARED,
+                                    fd, 0);
+  close(fd);
+
+  if( ring == (const evshm_ring_t *)MAP_FAILED )
+  {
+    return -1;
+  }
+
+  if( __atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != EVSHM_MAGIC ||
+      ring->version != EVSHM_VERSION ||
+      (ring->entries & (ring->entries - 1)) ||
+      (size_t)st.st_size < evshm_size(ring->entries) )
+  {
+    munmap((void *)ring, st.st_size);
+    errno = EPROTO;
+    return -1;
+  }
+
+  cl->ring = ring;
+  cl->size = st.st_size;
+  cl->pos  = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+  // without the control object evshm_wait() polls instead
+  evshm_ctl_path(name, path, sizeof path);
+  if( (fd = shm_open(path, O_RDWR, 0)) != -1 )
+  {
+    void *ctl = MAP_FAILED;
+
+    if( fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof *cl->ctl )
+    {
+      ctl = mmap(0, sizeof *cl->ctl, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, 0);
+    }
+    close(fd);
+    if( ctl != MAP_FAILED )
+    {
+      cl->ctl = (evshm_ctl_t *)ctl;
+    }
+  }
+  return 0;
+}
+
+/** Stop following ring
+ */
+static inline void evshm_detach(evshm_client_t *cl)
+{
+  if( cl->ring )
+  {
+    munmap((void *)cl->ring, cl->size);
+  }
+  if( cl->ctl )
+  {
+    munmap(cl->ctl, sizeof *cl->ctl);
+  }
+  memset(cl, 0, sizeof *cl);
+}
+
+/** Copy out events published since previous call
+ *
+ * Does not block and does not make system calls.
+ *
+ * @param cl  client state
+ * @param eve array to fill
+ * @param max number of elements in eve
+ *
+ * @return number of events stored in eve
+ */
+static inline int evshm_read(evshm_client_t *cl, evshm_event_t *eve, int max)
+{
+  const evshm_ring_t *ring = cl->ring;
+  uint64_t            head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint32_t            mask = ring->entries - 1;
+  int                 n    = 0;
+
+  if( head - cl->pos > ring->entries )
+  {
+    // fell behind more than a full ring
+    cl->lost += head - cl->pos - ring->entries;
+    cl->pos   = head - ring->entries;
+  }
+
+  for( ; n < max && cl->pos < head; ++cl->pos )
+  {
+    const evshm_entry_t *e    = &ring->ring[cl->pos & mask];
+    uint64_t             want = 2 * cl->pos + 2;
+    evshm_event_t       *out  = &eve[n];
+
+    if( __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != want )
+    {
+      ++cl->lost;
+      continue;
+    }
+
+    out->device          = __atomic_load_n(&e->device, __ATOMIC_RELAXED);
+    out->ev.time.tv_sec  = __atomic_load_n(&e->sec, __ATOMIC_RELAXED);
+    out->ev.time.tv_usec = __atomic_load_n(&e->usec, __ATOMIC_RELAXED);
+    out->ev.type         = __atomic_load_n(&e->type, __ATOMIC_RELAXED);
+    out->ev.code         = __atomic_load_n(&e->code, __ATOMIC_RELAXED);
+    out->ev.value        = __atomic_load_n(&e->value, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if( __atomic_load_n(&e->seq, __ATOMIC_RELAXED) != want )
+    {
+      // overwritten while copying
+      ++cl->lost;
+      continue;
+    }
+    ++n;
+  }
+  return n;
+}
+
+/** Wait until new events are published
+ *
+ * @param cl         client state
+ * @param timeout_ms maximum time to wait, or -1 for no limit
+ *
+ * @return 1 if there are events to read, 0 on timeout
+ */
+static inline int evshm_wait(evshm_client_t *cl, int timeout_ms)
+{
+  const evshm_ring_t *ring = cl->ring;
+  evshm_ctl_t        *ctl  = cl->ctl;
+  struct timespec     ts;
+  uint32_t            seen;
+
+  if( !ctl )
+  {
+    // poll the head every millisecond
+    ts.tv_sec  = 0;
+    ts.tv_nsec = 1000000L;
+    for( int ms = 0; timeout_ms < 0 || ms < timeout_ms; ++ms )
+    {
+      if( __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != cl->pos )
+      {
+        return 1;
+      }
+      nanosleep(&ts, NULL);
+    }
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != cl->pos;
+  }
+
+  ts.tv_sec  = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+  // Announce the waiter before checking the head; the writer publishes
+  // the head before checking the count, so one of them sees the other
+  seen = __atomic_load_n(&ctl->futex, __ATOMIC_ACQUIRE);
+  __atomic_add_fetch(&ctl->waiters, 1, __ATOMIC_SEQ_CST);
+
+  if( __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == cl->pos )
+  {
+    syscall(SYS_futex, &ctl->futex, FUTEX_WAIT, seen,
+            (timeout_ms < 0) ? NULL : &ts, NULL, 0);
+  }
+
+  __atomic_sub_fetch(&ctl->waiters, 1, __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != cl->pos;
+}
+
+/** Get path and name of the device in a slot
+ *
+ * @param cl   client state
+ * @param slot device slot from evshm_event_t
+ * @param path buffer for device path, or NULL
+ * @param name buffer for device name, or NULL
+ *
+ * @return 1 if the slot has a device, 0 otherwise; path and name are
+ *         empty strings if the slot is out of range, or if the slot
+ *         stays busy for EVSHM_DEVICE_RETRIES attempts, e.g. because
+ *         the publisher died while updating it
+ */
+static inline int evshm_device(const evshm_client_t *cl, uint32_t slot,
+                               char *path, char *name)
+{
+  const evshm_dev_t *dev;
+  uint32_t           seq;
+  int                attached;
+  long               tries = 0;
+
+  if( path ) *path = 0;
+  if( name ) *name = 0;
+
+  if( slot >= EVSHM_DEVICES )
+  {
+    return 0;
+  }
+
+  dev = &cl->ring->dev[slot];
+  do
+  {
+    while( (seq = __atomic_load_n(&dev->seq, __ATOMIC_ACQUIRE)) & 1 )
+    {
+      // publisher is updating the slot, or was preempted doing so
+      if( ++tries >= EVSHM_DEVICE_RETRIES )
+      {
+        goto busy;
+      }
+      if( tries > 1000 )
+      {
+        sched_yield();
+      }
+    }
+    if( ++tries >= EVSHM_DEVICE_RETRIES )
+    {
+      goto busy;
+    }
+    attached = __atomic_load_n(&dev->attached, __ATOMIC_RELAXED) != 0;
+    if( path ) memcpy(path, dev->path, sizeof dev->path);
+    if( name ) memcpy(name, dev->name, sizeof dev->name);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while( __atomic_load_n(&dev->seq, __ATOMIC_RELAXED) != seq );
+
+  if( path ) path[sizeof dev->path - 1] = 0;
+  if( name ) name[sizeof dev->name - 1] = 0;
+  return attached;
+
+busy:
+  if( path ) *path = 0;
+  if( name ) *name = 0;
+  return 0;
+}
+
+#endif // EVSHM_H_
@@ -15,9 +15,29 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
-#include <poll.h>
 #include <glob.h>
 #include <getopt.h>
+#include <grp.h>
+#include <math.h>
+#include <fnmatch.h>
+#include <libgen.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+
+#include "evshm.h"
 
 #define loglevel_t int
 #define LL_CRIT 1
@@ -27,7 +47,12 @@
 #define LL_INFO 5
 #define LL_DEBUG 6
 
-#define mce_log(x, y, ...) printf(y,__VA_ARGS__)
+void mce_log_file(loglevel_t loglevel,
+                  const char *const file,
+                  const char *const function,
+                  const char *const fmt, ...);
+
+#define mce_log(x, y, ...) mce_log_file(x, __FILE__, __func__, y, __VA_ARGS__)
 
 
 /* ------------------------------------------------------------------------- *
@@ -797,6 +822,9 @@ static const char * pwr_name(int ecode)
 /** How many "unsigned long" elements bitmap needs to cover bc bits */
 #define BMAP_SIZE(bc) (((bc)+LONG_BIT-1)/LONG_BIT)
 
+/** Maximum number of multitouch slots tracked per device */
+#define MT_SLOTS_MAX 64
+
 /** Test a bit in array of unsigned longs
  *
  * @param bmap array of longs
@@ -804,7 +832,7 @@ static const char * pwr_name(int ecode)
  *
  * @return 1 if bit is set, 0 if not
  */
-static int bit_is_set(unsigned long *bmap, size_t bi)
+static int bit_is_set(const unsigned long *bmap, size_t bi)
 {
   size_t        i = bi / LONG_BIT;
   unsigned long m = 1ul << (bi % LONG_BIT);
@@ -908,157 +936,84 @@ int evdev_open_device(const char *path)
   return fd;
 }
 
-/** Write input device information to stdout
+/** Static capabilities of an input device
  *
- * @param fd file descriptor
+ * Everything evdev_identify_device() reports apart from the current
+ * key/led/switch state, laid out so that it can be stored as is in
+ * capture files.
+ */
+typedef struct
+{
+  char                 path[256];
+  char                 name[256];
+  unsigned short       id[4];
+  unsigned long        bmap_type[BMAP_SIZE(EV_CNT)];
+  unsigned long        bmap_code[EV_CNT][BMAP_SIZE(KEY_CNT)];
+  struct input_absinfo absinfo[ABS_CNT];
+} evdev_caps_t;
+
+/** Query static input device capabilities
+ *
+ * @param fd   file descriptor
+ * @param path device path to store in caps
+ * @param caps where to store the capabilities
  *
  * @return 0 on success, or -1 in case of errors
  */
-int evdev_identify_device(int fd)
+int evdev_query_caps(int fd, const char *path, evdev_caps_t *caps)
 {
-  int err = -1;
-  int vers;
-  int cols;
-  unsigned long bmap_type[BMAP_SIZE(EV_CNT)];
-  unsigned long bmap_code[BMAP_SIZE(KEY_CNT)];
-  unsigned long bmap_stat[BMAP_SIZE(KEY_CNT)];
-  char path[256];
-  int n;
-
-  if( fd < 0 )
-  {
-    goto cleanup;
-  }
-
-  snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
-  if( (n = readlink(path, path, sizeof path - 1)) <= 0 )
-  {
-    strcpy(path, "unknown");
-  }
-  else
-  {
-    path[n] = 0;
-  }
-
-  // is it evdev file descriptor?
-  if( ioctl(fd, EVIOCGVERSION, &vers) == -1)
-  {
-    goto cleanup;
-  }
+  memset(caps, 0, sizeof *caps);
+  snprintf(caps->path, sizeof caps->path, "%s", path);
 
-  // device name
+  if( ioctl(fd, EVIOCGNAME(sizeof caps->name), caps->name) == -1 )
   {
-    char name[256];;
-    if( ioctl(fd, EVIOCGNAME(sizeof(name)), name) == -1 )
-    {
-      mce_log(LL_WARN, "%s: EVIOCGNAME: %m", path);
-      strcpy(name, "Unknown");
-    }
-    printf("Name: \"%s\"\n", name);
+    mce_log(LL_WARN, "%s: EVIOCGNAME: %m", path);
+    strcpy(caps->name, "Unknown");
   }
 
-  // device id
+  if( ioctl(fd, EVIOCGID, caps->id) == -1 )
   {
-    unsigned short id[4];
-    if( ioctl(fd, EVIOCGID, id) == -1 )
-    {
-      mce_log(LL_WARN, "%s: EVIOCGID: %m", path);
-      memset(id, 0, sizeof id);
-    }
-    printf("ID: bus 0x%x, vendor, 0x%x, product 0x%x, version 0x%x\n",
-           id[ID_BUS], id[ID_VENDOR], id[ID_PRODUCT], id[ID_VERSION]);
+    mce_log(LL_WARN, "%s: EVIOCGID: %m", path);
   }
 
-  // get bitmask of supported event types
-  memset(bmap_type, 0, sizeof(bmap_type));
-  if( ioctl(fd, EVIOCGBIT(0, EV_CNT), bmap_type) == -1 )
+  if( ioctl(fd, EVIOCGBIT(0, EV_CNT), caps->bmap_type) == -1 )
   {
     mce_log(LL_WARN, "%s: EVIOCGBIT(0): %m", path );
-    goto cleanup;
+    return -1;
   }
 
-  // guestimate how wide event code listing we can make
-  cols = get_terminal_width() - 10;
-  if( cols < 32 ) cols = 72;
-
-  // list supported event types and codes
-  for( int etype = 0; etype < EV_CNT; ++etype )
+  for( int etype = 1; etype < EV_CNT; ++etype )
   {
-    if( !bit_is_set(bmap_type, etype) )
-    {
-      continue;
-    }
-
-    printf("Type 0x%02x (%s)\n", etype, evdev_get_event_type_name(etype));
-
-    if( etype == EV_SYN || etype == EV_REP )
+    if( etype == EV_REP || !bit_is_set(caps->bmap_type, etype) )
     {
-      // EVIOCGBIT(0, n) returns event types supported, not
-      // what SYN_xxx codes are supported ... skip it
       continue;
     }
 
-    memset(bmap_code, 0, sizeof(bmap_code));
-    if( ioctl(fd, EVIOCGBIT(etype, KEY_CNT), bmap_code) == -1 )
+    if( ioctl(fd, EVIOCGBIT(etype, KEY_CNT), caps->bmap_code[etype]) == -1 )
     {
       mce_log(LL_WARN, "%s: EVIOCGBIT(%s): %m", path,
               evdev_get_event_type_name(etype));
-      continue;
-    }
-
-    memset(bmap_stat, 0, sizeof(bmap_stat));
-    switch( etype )
-    {
-    case EV_KEY: ioctl(fd, EVIOCGKEY(KEY_CNT), bmap_stat); break;
-    case EV_LED: ioctl(fd, EVIOCGLED(LED_CNT), bmap_stat); break;
-    case EV_SND: ioctl(fd, EVIOCGSND(SND_CNT), bmap_stat); break;
-    case EV_SW:  ioctl(fd, EVIOCGSW(SW_CNT),   bmap_stat); break;
-    default: break;
     }
+  }
 
-    int len = 0;
-    for( int ecode = 0; ecode < KEY_CNT; ++ecode )
+  if( bit_is_set(caps->bmap_type, EV_ABS) )
+  {
+    for( int ecode = 0; ecode < ABS_CNT; ++ecode )
     {
-      if( bit_is_set(bmap_code, ecode) )
+      if( bit_is_set(caps->bmap_code[EV_ABS], ecode) )
       {
-        const char *tag = evdev_get_event_code_name(etype, ecode);
-        int set = bit_is_set(bmap_stat, ecode);
-        int add = strlen(tag) + 1 + set;
-        char val[32] = "";
-
-        if( etype == EV_ABS )
-        {
-          struct input_absinfo info;
-          memset(&info, 0, sizeof info);
-
-          if( ioctl(fd, EVIOCGABS(ecode), &info) == -1 )
-          {
-            mce_log(LL_ERR, "EVIOCGABS(%s): %m", tag);
-          }
-          else
-          {
-            snprintf(val, sizeof val, "=%d [%d,%d]", info.value, info.minimum, info.maximum);
-            add += strlen(val);
-          }
-        }
-
-        if( len == 0 ) printf("\t");
-        else if( len+add > cols ) printf("\n\t"), len = 0;
-
-        len += add, printf(" %s%s%s", tag, set ? "*" : "", val);
-
+        ioctl(fd, EVIOCGABS(ecode), &caps->absinfo[ecode]);
       }
     }
-    if( len ) printf("\n");
   }
 
-  err = 0;
-
-cleanup:
-
-  return err;
+  return 0;
 }
 
+/** Name to number lookup with linear scan
+ *
+ * Kept as reference implementation for the lookup benchmark.
+ */
 static int rlookup(const char * const *lut, size_t cnt, const char *name)
 {
   int val = -1;
@@ -1073,61 +1028,106 @@ static int rlookup(const char * const *lut, size_t cnt, const char *name)
   return val;
 }
 
-/* Internal helper functions for looking up event codes by type */
-static int syn_code(const char *ename)
-{
-  return rlookup(lut_syn, numof(lut_syn), ename);
-}
-
-static int key_code(const char *ename)
+/** Event code name tables by event type */
+static const struct
 {
-  return rlookup(lut_key, numof(lut_key), ename);
-}
-
-static int rel_code(const char *ename)
+  const char * const *lut;
+  size_t              cnt;
+} rlookup_lut[] =
 {
-  return rlookup(lut_rel, numof(lut_rel), ename);
-}
+  [EV_SYN] = { lut_syn, numof(lut_syn) },
+  [EV_KEY] = { lut_key, numof(lut_key) },
+  [EV_REL] = { lut_rel, numof(lut_rel) },
+  [EV_ABS] = { lut_abs, numof(lut_abs) },
+  [EV_MSC] = { lut_msc, numof(lut_msc) },
+  [EV_SW]  = { lut_sw,  numof(lut_sw)  },
+  [EV_LED] = { lut_led, numof(lut_led) },
+  [EV_SND] = { lut_snd, numof(lut_snd) },
+  [EV_REP] = { lut_rep, numof(lut_rep) },
+  [EV_FF]  = { lut_ff,  numof(lut_ff)  },
+};
 
-static int abs_code(const char *ename)
-{
-  return rlookup(lut_abs, numof(lut_abs), ename);
-}
+/** Number of slots in the reverse lookup hash table
+ *
+ * Must be a power of two and comfortably larger than the total
+ * number of names in the lut_xxx tables.
+ */
+#define RLOOKUP_SLOTS 4096
 
-static int msc_code(const char *ename)
+/** Reverse lookup hash table slot */
+typedef struct
 {
-  return rlookup(lut_msc, numof(lut_msc), ename);
-}
+  const char *name;
+  short       type;
+  short       code;
+} rlookup_slot_t;
 
-static int led_code(const char *ename)
-{
-  return rlookup(lut_led, numof(lut_led), ename);
-}
+/** Open addressing hash table for name to event code lookups */
+static rlookup_slot_t rlookup_tab[RLOOKUP_SLOTS];
 
-static int rep_code(const char *ename)
+/** Hash event type + code name (FNV-1a)
+ */
+static unsigned rlookup_hash(int etype, const char *name)
 {
-  return rlookup(lut_rep, numof(lut_rep), ename);
+  unsigned hash = 2166136261u ^ (unsigned)etype;
+  while( *name )
+  {
+    hash ^= (unsigned char)*name++;
+    hash *= 16777619u;
+  }
+  return hash;
 }
 
-static int snd_code(const char *ename)
+/** Find hash table slot for event type + code name
+ *
+ * @return matching slot, or the empty slot where it should be inserted
+ */
+static rlookup_slot_t *rlookup_find(int etype, const char *name)
 {
-  return rlookup(lut_snd, numof(lut_snd), ename);
+  unsigned i = rlookup_hash(etype, name);
+  for( ;; ++i )
+  {
+    rlookup_slot_t *slot = &rlookup_tab[i & (RLOOKUP_SLOTS - 1)];
+    if( !slot->name ||
+        (slot->type == etype && !strcmp(slot->name, name)) )
+    {
+      return slot;
+    }
+  }
 }
 
-static int sw_code(const char *ename)
+/** Populate reverse lookup hash table from the lut_xxx tables
+ *
+ * The lowest code wins if a name occurs more than once, same as
+ * with a linear scan.
+ */
+static void rlookup_init(void)
 {
-  return rlookup(lut_sw, numof(lut_sw), ename);
-}
+  static bool done = false;
 
-static int ff_code(const char *ename)
-{
-  return rlookup(lut_ff, numof(lut_ff), ename);
-}
+  if( done )
+  {
+    return;
+  }
+  done = true;
 
-static int pwr_code(const char *ename)
-{
-  (void)ename; // not used
-  return -1;
+  for( size_t etype = 0; etype < numof(rlookup_lut); ++etype )
+  {
+    for( size_t ecode = 0; ecode < rlookup_lut[etype].cnt; ++ecode )
+    {
+      const char *name = rlookup_lut[etype].lut[ecode];
+      if( name )
+      {
+        rlookup_slot_t *slot = rlookup_find(etype, name);
+        if( !slot->name )
+        {
+          slot->name = name;
+          slot->type = etype;
+          slot->code = ecode;
+        }
+      }
+    }
+  }
 }
 
 /** Lookup input event code by name
@@ -1139,28 +1139,11 @@ static int pwr_code(const char *ename)
  */
 int evdev_lookup_event_code(int etype, const char *ename)
 {
-  typedef int (*lookup_fn)(const char *);
+  rlookup_slot_t *slot;
 
-  static const lookup_fn lut[] =
-  {
-    [EV_SYN] = syn_code,
-    [EV_KEY] = key_code,
-    [EV_REL] = rel_code,
-    [EV_ABS] = abs_code,
-    [EV_MSC] = msc_code,
-    [EV_SW]  = sw_code,
-    [EV_LED] = led_code,
-    [EV_SND] = snd_code,
-    [EV_REP] = rep_code,
-    [EV_FF]  = ff_code,
-    [EV_PWR] = pwr_code,
-  };
-
-  if( (size_t)etype < numof(lut) && lut[etype] )
-  {
-    return lut[etype](ename);
-  }
-  return -1;
+  rlookup_init();
+  slot = rlookup_find(etype, ename);
+  return slot->name ? slot->code : -1;
 }
 
 
@@ -1171,172 +1154,6280 @@ int evdev_lookup_event_code(int etype, const char *ename)
 
 
 
-/** Flag for: emit event time stamps */
-static bool emit_event_time  = true;
+/* ------------------------------------------------------------------------- *
+ * Capability cache
+ *
+ * Identifying a device takes EVIOCGNAME, EVIOCGID and one EVIOCGBIT per
+ * supported event type. The answers do not change while the same device
+ * stays behind the same node, so they are kept in a cache file between
+ * runs. Entries are keyed by the device path, input id, name, physical
+ * location and unique id, which tell apart the interfaces of one USB
+ * receiver, and by the sysfs inputN instance and boot id, which change
+ * whenever a device is plugged in again. A cache hit costs a few cheap
+ * ioctls and a readlink(); only the live key/led/switch state and axis
+ * values are then queried from the device.
+ *
+ * The cache file is an evcache_file_t header followed by an array of
+ * evcache_entry_t. It is loaded on first use and rewritten at exit if
+ * anything changed. Lookups are serialized so that devices can be
+ * probed from several threads.
+ * ------------------------------------------------------------------------- */
 
-/** Flag for: emit time of day (of event read time) */
-static bool emit_time_of_day = false;
+/** Magic bytes at the start of cache files */
+#define EVCACHE_MAGIC "EVCAPS02"
 
-/** Read and show input events
+/** Maximum number of device paths remembered */
+#define EVCACHE_MAX 256
+
+/** Cache file header */
+typedef struct
+{
+  char     magic[8];
+  uint32_t entry_size; // sizeof (evcache_entry_t) of the writer
+  uint32_t count;      // number of entries that follow
+} evcache_file_t;
+
+/** What has to match for a cache hit */
+typedef struct
+{
+  char           path[256];
+  unsigned short id[4];
+  char           name[256];
+  char           phys[64];
+  char           uniq[64];
+  char           instance[32]; // sysfs inputN, empty if unknown
+  char           boot_id[40];  // boot the instance is from
+} evcache_key_t;
+
+/** Cache file entry */
+typedef struct
+{
+  evcache_key_t key;
+  evdev_caps_t  caps;
+} evcache_entry_t;
+
+/** Whether the capability cache is used at all */
+static bool evcache_enabled = true;
+
+/** Lock for the cache state below */
+static pthread_mutex_t evcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Cached entries, oldest first */
+static evcache_entry_t *evcache_lut = 0;
+
+/** Number of entries in evcache_lut */
+static int evcache_cnt = 0;
+
+/** Whether the cache file has been read */
+static bool evcache_loaded = false;
+
+/** Whether the cache needs to be written back */
+static bool evcache_dirty = false;
+
+/** Get cache file path
  *
- * @param fd   input device file descriptor to read from
- * @param title text to print before event details
+ * @param buf  buffer for the path
+ * @param size size of buf
+ * @param dir  if true, leave out the file name
  *
- * @return positive value on success, 0 on eof, -1 on errors
+ * @return buf, or NULL if neither XDG_CACHE_HOME nor HOME is set
  */
-static
-int
-process_events(int fd, const char *title)
+static const char *evcache_path(char *buf, size_t size, bool dir)
 {
-  struct input_event eve[256];
-  char tod[64], toe[64];
+  const char *env;
 
-  errno = 0;
-  int n = read(fd, eve, sizeof eve);
-  if( n < 0 )
+  if( (env = getenv("XDG_CACHE_HOME")) && *env )
   {
-    mce_log(LL_ERR, "%s: %m", title);
-    return -1;
+    snprintf(buf, size, "%s", env);
   }
-
-  if( n == 0 )
+  else if( (env = getenv("HOME")) && *env )
+  {
+    snprintf(buf, size, "%s/.cache", env);
+  }
+  else
   {
-    mce_log(LL_ERR, "%s: EOF", title);
     return 0;
   }
 
-  n /= sizeof *eve;
-
-  *tod = 0;
-  if( emit_time_of_day )
+  if( !dir )
   {
-    struct timeval tv;
-    struct tm tm;
-    memset(&tv, 0, sizeof tv);
-    memset(&tm, 0, sizeof tm);
+    size_t len = strlen(buf);
+    snprintf(buf + len, size - len, "/evdev_trace.caps");
+  }
+  return buf;
+}
 
-    /* Caveat emptor: time of day = event read time ... */
-    gettimeofday(&tv, 0);
-    localtime_r(&tv.tv_sec, &tm);
+/** Read cache file, called with evcache_mutex held
+ */
+static void evcache_load(void)
+{
+  char           path[256];
+  evcache_file_t hdr;
+  int            fd = -1;
+
+  evcache_loaded = true;
 
-    snprintf(tod, sizeof tod, "%04d-%02d-%02d %02d:%02d:%02d.%03ld - ",
-             tm.tm_year + 1900,
-             tm.tm_mon + 1,
-             tm.tm_mday,
-             tm.tm_hour,
-             tm.tm_min,
-             tm.tm_sec,
-             (long)(tv.tv_usec / 1000));
+  if( !evcache_path(path, sizeof path, false) ||
+      (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 )
+  {
+    goto cleanup;
   }
 
-  for( int i = 0; i < n; ++i )
+  if( read(fd, &hdr, sizeof hdr) != sizeof hdr ||
+      memcmp(hdr.magic, EVCACHE_MAGIC, sizeof hdr.magic) ||
+      hdr.entry_size != sizeof (evcache_entry_t) ||
+      hdr.count > EVCACHE_MAX )
   {
-    struct input_event *e = &eve[i];
+    mce_log(LL_NOTICE, "%s: ignoring incompatible cache file", path);
+    goto cleanup;
+  }
 
-    *toe = 0;
-    if( emit_event_time )
-    {
-      snprintf(toe, sizeof toe, "%ld.%03ld - ",
-               (long)e->time.tv_sec,
-               (long)e->time.tv_usec / 1000);
-    }
+  if( !(evcache_lut = calloc(EVCACHE_MAX, sizeof *evcache_lut)) )
+  {
+    goto cleanup;
+  }
+
+  size_t want = hdr.count * sizeof *evcache_lut;
+  if( read(fd, evcache_lut, want) != (ssize_t)want )
+  {
+    mce_log(LL_NOTICE, "%s: ignoring truncated cache file", path);
+    goto cleanup;
+  }
 
-    printf("%s: %s%s0x%02x/%s - 0x%03x/%s - %d\n",
-           title, tod, toe,
-           e->type,
-           evdev_get_event_type_name(e->type),
-           e->code,
-           evdev_get_event_code_name(e->type, e->code),
-           e->value);
+  for( uint32_t i = 0; i < hdr.count; ++i )
+  {
+    evcache_entry_t *ent = &evcache_lut[i];
+    ent->key.path[sizeof ent->key.path - 1] = 0;
+    ent->caps.path[sizeof ent->caps.path - 1] = 0;
+    ent->caps.name[sizeof ent->caps.name - 1] = 0;
   }
-  return 1;
+  evcache_cnt = hdr.count;
+
+cleanup:
+  if( fd != -1 ) close(fd);
 }
 
-/** Mainloop for processing event input devices
+/** Boot id, empty if not available */
+static char evcache_boot_id[40];
+
+/** Read boot id, via pthread_once()
+ */
+static void evcache_boot_id_once(void)
+{
+  int     fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+  ssize_t n  = (fd == -1) ? -1 : read(fd, evcache_boot_id,
+                                      sizeof evcache_boot_id - 1);
+
+  evcache_boot_id[n > 0 ? n : 0] = 0;
+  evcache_boot_id[strcspn(evcache_boot_id, "\n")] = 0;
+  if( fd != -1 ) close(fd);
+}
+
+/** Collect what identifies a device instance
  *
- * @param path  vector of input device paths
- * @param count number of paths in the path
- * @param identify if nonzero print input device information
- * @param trace stay in loop and print out events as they arrive
+ * @param fd   file descriptor
+ * @param path device path
+ * @param key  where to store the key
  */
-static
-void
-mainloop(char **path, int count, int identify, int trace)
+static void evcache_make_key(int fd, const char *path, evcache_key_t *key)
 {
-  struct pollfd pfd[count];
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
 
-  int closed = 0;
+  struct stat st;
+  char        link[64];
+  char        target[256];
+  const char *base;
+  ssize_t     n;
 
-  for( int i = 0; i < count; ++i )
-  {
-    if( (pfd[i].fd = evdev_open_device(path[i])) == -1 )
-    {
-      ++closed;
-      continue;
-    }
+  memset(key, 0, sizeof *key);
+  snprintf(key->path, sizeof key->path, "%s", path);
 
-    if( identify )
+  // missing ids, phys or uniq just stay empty and still have to match
+  ioctl(fd, EVIOCGID, key->id);
+  ioctl(fd, EVIOCGNAME(sizeof key->name - 1), key->name);
+  ioctl(fd, EVIOCGPHYS(sizeof key->phys - 1), key->phys);
+  ioctl(fd, EVIOCGUNIQ(sizeof key->uniq - 1), key->uniq);
+
+  // e.g. /sys/dev/char/13:65/device -> ../../devices/.../input/input17
+  if( fstat(fd, &st) == 0 && S_ISCHR(st.st_mode) )
+  {
+    snprintf(link, sizeof link, "/sys/dev/char/%u:%u/device",
+             major(st.st_rdev), minor(st.st_rdev));
+    if( (n = readlink(link, target, sizeof target - 1)) > 0 )
     {
-      printf("----====( %s )====----\n", path[i]);
-      evdev_identify_device(pfd[i].fd);
-      printf("\n");
+      target[n] = 0;
+      base = strrchr(target, '/') ? strrchr(target, '/') + 1 : target;
+      snprintf(key->instance, sizeof key->instance, "%.*s",
+               (int)sizeof key->instance - 1, base);
     }
   }
 
-  if( !trace )
+  pthread_once(&once, evcache_boot_id_once);
+  memcpy(key->boot_id, evcache_boot_id, sizeof key->boot_id);
+}
+
+/** Look up capabilities from cache
+ *
+ * @param key  device instance to look up
+ * @param caps where to store the capabilities
+ *
+ * @return true on cache hit, false otherwise
+ */
+static bool evcache_lookup(const evcache_key_t *key, evdev_caps_t *caps)
+{
+  bool hit = false;
+
+  pthread_mutex_lock(&evcache_mutex);
+
+  if( !evcache_loaded )
   {
-    goto cleanup;
+    evcache_load();
   }
 
-  while( closed < count )
+  for( int i = 0; i < evcache_cnt; ++i )
   {
-    for( int i = 0; i < count; ++i )
-    {
-      pfd[i].events = (pfd[i].fd < 0) ? 0 : POLLIN;
-    }
+    const evcache_entry_t *ent = &evcache_lut[i];
 
-    poll(pfd, count, -1);
-
-    for( int i = 0; i < count; ++i )
+    if( !strcmp(ent->key.path, key->path) )
     {
-      if( pfd[i].revents )
+      if( !memcmp(&ent->key, key, sizeof *key) )
       {
-        if( process_events(pfd[i].fd, path[i]) <= 0 )
-        {
-          close(pfd[i].fd);
-          pfd[i].fd = -1;
-          ++closed;
-        }
+        *caps = ent->caps;
+        hit   = true;
       }
+      break;
     }
   }
 
-cleanup:
+  pthread_mutex_unlock(&evcache_mutex);
 
-  for( int i = 0; i < count; ++i )
-  {
-    if( pfd[i].fd != -1 ) close(pfd[i].fd);
-  }
+  return hit;
 }
 
-/** Configuration table for long command line options */
-static struct option optL[] =
+/** Add or replace cache entry for a device path
+ *
+ * @param key  device instance the capabilities belong to
+ * @param caps capabilities to remember
+ */
+static void evcache_store(const evcache_key_t *key, const evdev_caps_t *caps)
 {
-  { "help",          0, 0, 'h' },
-  { "trace",         0, 0, 't' },
-  { "identify",      0, 0, 'i' },
-  { "emit-also-tod", 0, 0, 'e' },
-  { "emit-only-tod", 0, 0, 'E' },
-  { 0,0,0,0 }
-};
+  int i;
 
-/** Configuration string for short command line options */
+  pthread_mutex_lock(&evcache_mutex);
+
+  if( !evcache_lut && !(evcache_lut = calloc(EVCACHE_MAX,
+                                             sizeof *evcache_lut)) )
+  {
+    goto cleanup;
+  }
+
+  for( i = 0; i < evcache_cnt; ++i )
+  {
+    if( !strcmp(evcache_lut[i].key.path, key->path) ) break;
+  }
+
+  if( i == EVCACHE_MAX )
+  {
+    // forget the oldest entry
+    memmove(evcache_lut, evcache_lut + 1,
+            (EVCACHE_MAX - 1) * sizeof *evcache_lut);
+    i = --evcache_cnt;
+  }
+  if( i == evcache_cnt )
+  {
+    ++evcache_cnt;
+  }
+
+  evcache_lut[i].key  = *key;
+  evcache_lut[i].caps = *caps;
+  evcache_dirty       = true;
+
+cleanup:
+  pthread_mutex_unlock(&evcache_mutex);
+}
+
+/** Write cache file if needed and release cache
+ *
+ * The file is replaced atomically, so that concurrent tracer runs
+ * never see a partially written cache.
+ */
+static void evcache_save(void)
+{
+  char           dir[256];
+  char           path[256];
+  char           temp[280];
+  evcache_file_t hdr;
+  int            fd = -1;
+
+  if( !evcache_dirty ||
+      !evcache_path(dir, sizeof dir, true) ||
+      !evcache_path(path, sizeof path, false) )
+  {
+    goto cleanup;
+  }
+
+  if( mkdir(dir, 0755) == -1 && errno != EEXIST )
+  {
+    mce_log(LL_WARN, "%s: mkdir: %m", dir);
+    goto cleanup;
+  }
+
+  snprintf(temp, sizeof temp, "%s.XXXXXX", path);
+  if( (fd = mkstemp(temp)) == -1 )
+  {
+    mce_log(LL_WARN, "%s: mkstemp: %m", temp);
+    goto cleanup;
+  }
+
+  memset(&hdr, 0, sizeof hdr);
+  memcpy(hdr.magic, EVCACHE_MAGIC, sizeof hdr.magic);
+  hdr.entry_size = sizeof (evcache_entry_t);
+  hdr.count      = evcache_cnt;
+
+  struct iovec iov[2] =
+  {
+    { &hdr, sizeof hdr },
+    { evcache_lut, evcache_cnt * sizeof *evcache_lut },
+  };
+  ssize_t want = iov[0].iov_len + iov[1].iov_len;
+
+  if( writev(fd, iov, numof(iov)) != want || rename(temp, path) == -1 )
+  {
+    mce_log(LL_WARN, "%s: %m", path);
+    unlink(temp);
+  }
+
+cleanup:
+  if( fd != -1 ) close(fd);
+  free(evcache_lut), evcache_lut = 0;
+  evcache_cnt    = 0;
+  evcache_loaded = false;
+  evcache_dirty  = false;
+}
+
+/** Get static input device capabilities, from cache if possible
+ *
+ * On cache hit only the axis information is refreshed from the device,
+ * since it holds the current axis values too.
+ *
+ * @param fd   file descriptor
+ * @param path device path to store in caps
+ * @param caps where to store the capabilities
+ *
+ * @return 0 on success, or -1 in case of errors
+ */
+int evdev_lookup_caps(int fd, const char *path, evdev_caps_t *caps)
+{
+  int           vers = 0;
+  evcache_key_t key;
+
+  // not part of the key, just rules out fds that are not evdev devices
+  if( ioctl(fd, EVIOCGVERSION, &vers) == -1 )
+  {
+    return -1;
+  }
+
+  if( evcache_enabled )
+  {
+    evcache_make_key(fd, path, &key);
+  }
+
+  if( !evcache_enabled || !evcache_lookup(&key, caps) )
+  {
+    if( evdev_query_caps(fd, path, caps) == -1 )
+    {
+      return -1;
+    }
+    if( evcache_enabled )
+    {
+      evcache_store(&key, caps);
+    }
+    return 0;
+  }
+
+  if( bit_is_set(caps->bmap_type, EV_ABS) )
+  {
+    for( int ecode = 0; ecode < ABS_CNT; ++ecode )
+    {
+      if( bit_is_set(caps->bmap_code[EV_ABS], ecode) )
+      {
+        ioctl(fd, EVIOCGABS(ecode), &caps->absinfo[ecode]);
+      }
+    }
+  }
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Device identification
+ * ------------------------------------------------------------------------- */
+
+/** Maximum number of threads used for probing devices */
+#define IDENTIFY_THREADS 16
+
+/** Input device capabilities and current state */
+typedef struct
+{
+  evdev_caps_t  caps;
+  unsigned long bmap_stat[EV_CNT][BMAP_SIZE(KEY_CNT)];
+} evdev_info_t;
+
+/** Query everything evdev_print_device() shows
+ *
+ * @param fd   file descriptor
+ * @param path device path
+ * @param info where to store the information
+ *
+ * @return 0 on success, or -1 in case of errors
+ */
+static int evdev_probe_device(int fd, const char *path, evdev_info_t *info)
+{
+  memset(info->bmap_stat, 0, sizeof info->bmap_stat);
+
+  if( evdev_lookup_caps(fd, path, &info->caps) == -1 )
+  {
+    return -1;
+  }
+
+  for( int etype = 0; etype < EV_CNT; ++etype )
+  {
+    unsigned long *stat = info->bmap_stat[etype];
+
+    if( !bit_is_set(info->caps.bmap_type, etype) )
+    {
+      continue;
+    }
+
+    switch( etype )
+    {
+    case EV_KEY: ioctl(fd, EVIOCGKEY(KEY_CNT), stat); break;
+    case EV_LED: ioctl(fd, EVIOCGLED(LED_CNT), stat); break;
+    case EV_SND: ioctl(fd, EVIOCGSND(SND_CNT), stat); break;
+    case EV_SW:  ioctl(fd, EVIOCGSW(SW_CNT),   stat); break;
+    default: break;
+    }
+  }
+  return 0;
+}
+
+/** Write probed input device information to stdout
+ *
+ * @param info device information from evdev_probe_device()
+ */
+static void evdev_print_device(const evdev_info_t *info)
+{
+  const evdev_caps_t *caps = &info->caps;
+  int                 cols;
+
+  printf("Name: \"%s\"\n", caps->name);
+  printf("ID: bus 0x%x, vendor, 0x%x, product 0x%x, version 0x%x\n",
+         caps->id[ID_BUS], caps->id[ID_VENDOR], caps->id[ID_PRODUCT],
+         caps->id[ID_VERSION]);
+
+  // guestimate how wide event code listing we can make
+  cols = get_terminal_width() - 10;
+  if( cols < 32 ) cols = 72;
+
+  // list supported event types and codes
+  for( int etype = 0; etype < EV_CNT; ++etype )
+  {
+    if( !bit_is_set(caps->bmap_type, etype) )
+    {
+      continue;
+    }
+
+    printf("Type 0x%02x (%s)\n", etype, evdev_get_event_type_name(etype));
+
+    if( etype == EV_SYN || etype == EV_REP )
+    {
+      // EVIOCGBIT(0, n) returns event types supported, not
+      // what SYN_xxx codes are supported ... skip it
+      continue;
+    }
+
+    int len = 0;
+    for( int ecode = 0; ecode < KEY_CNT; ++ecode )
+    {
+      if( bit_is_set(caps->bmap_code[etype], ecode) )
+      {
+        const char *tag = evdev_get_event_code_name(etype, ecode);
+        int set = bit_is_set(info->bmap_stat[etype], ecode);
+        int add = strlen(tag) + 1 + set;
+        char val[32] = "";
+
+        if( etype == EV_ABS && ecode < ABS_CNT )
+        {
+          const struct input_absinfo *abs = &caps->absinfo[ecode];
+          snprintf(val, sizeof val, "=%d [%d,%d]",
+                   abs->value, abs->minimum, abs->maximum);
+          add += strlen(val);
+        }
+
+        if( len == 0 ) printf("\t");
+        else if( len+add > cols ) printf("\n\t"), len = 0;
+
+        len += add, printf(" %s%s%s", tag, set ? "*" : "", val);
+      }
+    }
+    if( len ) printf("\n");
+  }
+}
+
+/** Write input device information to stdout
+ *
+ * @param fd file descriptor
+ *
+ * @return 0 on success, or -1 in case of errors
+ */
+int evdev_identify_device(int fd)
+{
+  int           err  = -1;
+  evdev_info_t *info = 0;
+  char          path[256];
+  int           n;
+
+  if( fd < 0 )
+  {
+    goto cleanup;
+  }
+
+  snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+  if( (n = readlink(path, path, sizeof path - 1)) <= 0 )
+  {
+    strcpy(path, "unknown");
+  }
+  else
+  {
+    path[n] = 0;
+  }
+
+  if( !(info = malloc(sizeof *info)) ||
+      evdev_probe_device(fd, path, info) == -1 )
+  {
+    goto cleanup;
+  }
+
+  evdev_print_device(info);
+  err = 0;
+
+cleanup:
+  free(info);
+  return err;
+}
+
+/** Identify state for one device */
+typedef struct
+{
+  const char  *path;
+  bool         opened;
+  bool         probed;
+  evdev_info_t info;
+} identify_t;
+
+/** Work shared by identify threads */
+typedef struct
+{
+  identify_t *dev;
+  int         count;
+  int         next;  // next device to claim
+} identify_job_t;
+
+/** Identify thread: probe devices until there are none left
+ */
+static void *identify_worker(void *aptr)
+{
+  identify_job_t *job = aptr;
+  int             i;
+
+  while( (i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+         job->count )
+  {
+    identify_t *dev = &job->dev[i];
+    int         fd  = evdev_open_device(dev->path);
+
+    if( fd != -1 )
+    {
+      dev->opened = true;
+      dev->probed = evdev_probe_device(fd, dev->path, &dev->info) == 0;
+      close(fd);
+    }
+  }
+  return 0;
+}
+
+/** Probe input devices concurrently and print their information
+ *
+ * Output is identical to identifying the devices one by one in
+ * device_attach(), in the given order.
+ *
+ * @param path  vector of input device paths
+ * @param count number of paths in the path
+ */
+static void identify_devices(char **path, int count)
+{
+  identify_job_t job = { .count = count, .next = 0 };
+  pthread_t      tid[IDENTIFY_THREADS];
+  int            threads = 0;
+
+  if( !(job.dev = calloc(count, sizeof *job.dev)) )
+  {
+    mce_log(LL_ERR, "%s: %m", "calloc");
+    return;
+  }
+
+  for( int i = 0; i < count; ++i )
+  {
+    job.dev[i].path = path[i];
+  }
+
+  // the calling thread takes part too
+  while( threads < IDENTIFY_THREADS - 1 && threads < count - 1 &&
+         pthread_create(&tid[threads], 0, identify_worker, &job) == 0 )
+  {
+    ++threads;
+  }
+  identify_worker(&job);
+
+  while( threads > 0 )
+  {
+    pthread_join(tid[--threads], 0);
+  }
+
+  for( int i = 0; i < count; ++i )
+  {
+    if( job.dev[i].opened )
+    {
+      printf("----====( %s )====----\n", path[i]);
+      if( job.dev[i].probed ) evdev_print_device(&job.dev[i].info);
+      printf("\n");
+    }
+  }
+
+  free(job.dev);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Event filtering
+ *
+ * Filter expressions select event types and codes to trace. Selected
+ * codes are kept in per type bitmaps that are pushed to the kernel
+ * with EVIOCSMASK, so that filtered events never reach userspace. If
+ * some device does not support event masks, the same bitmaps are used
+ * for filtering events after read(). EV_SYN events are always passed
+ * through, same as the kernel does.
+ * ------------------------------------------------------------------------- */
+
+/** Flag for: event filter has been set up */
+static bool filter_active = false;
+
+/** Flag for: some device needs filtering in userspace */
+static bool filter_in_userspace = false;
+
+/** Selected event codes, per event type */
+static unsigned long filter_code[EV_CNT][BMAP_SIZE(KEY_CNT)];
+
+/** Set bit in array of unsigned longs
+ */
+static void bit_set(unsigned long *bmap, size_t bi)
+{
+  bmap[bi / LONG_BIT] |= 1ul << (bi % LONG_BIT);
+}
+
+/** Parse event type or code number
+ *
+ * @return value, or -1 if text is not a number
+ */
+static int filter_parse_number(const char *text)
+{
+  char *end = 0;
+  long  val = strtol(text, &end, 0);
+  return (end > text && !*end && val >= 0 && val < KEY_CNT) ? (int)val : -1;
+}
+
+/** Select event codes matching a name, glob pattern or number
+ *
+ * @return number of codes selected
+ */
+static int filter_add_codes(int etype, const char *name)
+{
+  int cnt = 0;
+  int ecode;
+
+  if( strpbrk(name, "*?[") )
+  {
+    if( (size_t)etype < numof(rlookup_lut) )
+    {
+      for( size_t i = 0; i < rlookup_lut[etype].cnt; ++i )
+      {
+        const char *tag = rlookup_lut[etype].lut[i];
+        if( tag && i < KEY_CNT && !fnmatch(name, tag, 0) )
+        {
+          bit_set(filter_code[etype], i), ++cnt;
+        }
+      }
+    }
+  }
+  else if( (ecode = evdev_lookup_event_code(etype, name)) != -1 ||
+           (ecode = filter_parse_number(name)) != -1 )
+  {
+    bit_set(filter_code[etype], ecode), ++cnt;
+  }
+  return cnt;
+}
+
+/** Parse filter expression
+ *
+ * The expression is a comma separated list of TYPE or TYPE:CODE terms,
+ * for example "EV_ABS:ABS_MT_*,EV_KEY". Codes can be given as names,
+ * glob patterns or numbers. A term without type that is not a type
+ * name applies to the type of the previous term, i.e. "EV_ABS:ABS_X,
+ * ABS_Y" selects both axes.
+ *
+ * @param expr filter expression
+ *
+ * @return 0 on success, or -1 in case of errors
+ */
+static int filter_parse(const char *expr)
+{
+  int   err   = -1;
+  char *work  = strdup(expr);
+  char *save  = 0;
+  int   etype = -1;
+
+  for( char *term = strtok_r(work, ",", &save); term;
+       term = strtok_r(0, ",", &save) )
+  {
+    char *code = strchr(term, ':');
+    int   type;
+
+    if( code )
+    {
+      *code++ = 0;
+    }
+
+    if( (type = rlookup(lut_ev, numof(lut_ev), term)) == -1 &&
+        (type = filter_parse_number(term)) == -1 )
+    {
+      if( code || etype == -1 )
+      {
+        mce_log(LL_ERR, "%s: unknown event type", term);
+        goto cleanup;
+      }
+      // code name following a TYPE:CODE term
+      code = term;
+    }
+    else if( type >= EV_CNT )
+    {
+      mce_log(LL_ERR, "%s: unknown event type", term);
+      goto cleanup;
+    }
+    else
+    {
+      etype = type;
+    }
+
+    if( !code )
+    {
+      for( int ecode = 0; ecode < KEY_CNT; ++ecode )
+      {
+        bit_set(filter_code[etype], ecode);
+      }
+    }
+    else if( !filter_add_codes(etype, code) )
+    {
+      mce_log(LL_ERR, "%s: no matching %s codes", code,
+              evdev_get_event_type_name(etype));
+      goto cleanup;
+    }
+  }
+
+  filter_active = true;
+  err = 0;
+
+cleanup:
+  free(work);
+  return err;
+}
+
+/** Push event filter to the kernel
+ *
+ * @param fd   input device file descriptor
+ * @param path input device path
+ */
+static void filter_apply(int fd, const char *path)
+{
+  if( !filter_active )
+  {
+    return;
+  }
+
+  for( int etype = EV_SYN + 1; etype < EV_CNT; ++etype )
+  {
+    struct input_mask mask =
+    {
+      .type       = etype,
+      .codes_size = sizeof filter_code[etype],
+      .codes_ptr  = (uintptr_t)filter_code[etype],
+    };
+
+    if( ioctl(fd, EVIOCSMASK, &mask) == -1 )
+    {
+      mce_log(LL_NOTICE, "%s: EVIOCSMASK: %m; filtering in userspace", path);
+      __atomic_store_n(&filter_in_userspace, true, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+}
+
+/** Drop events not selected by event filter
+ *
+ * @param eve array of input events
+ * @param n   number of events in eve
+ *
+ * @return number of events left in eve
+ */
+static int filter_events(struct input_event *eve, int n)
+{
+  int k = 0;
+
+  if( !__atomic_load_n(&filter_in_userspace, __ATOMIC_RELAXED) )
+  {
+    return n;
+  }
+
+  for( int i = 0; i < n; ++i )
+  {
+    unsigned etype = eve[i].type;
+    unsigned ecode = eve[i].code;
+
+    if( etype == EV_SYN ||
+        (etype < EV_CNT && ecode < KEY_CNT &&
+         bit_is_set(filter_code[etype], ecode)) )
+    {
+      eve[k++] = eve[i];
+    }
+  }
+  return k;
+}
+
+/** Flag for: emit event time stamps */
+static bool emit_event_time  = true;
+
+/** Flag for: emit time of day (of event read time) */
+static bool emit_time_of_day = false;
+
+/** Formatted output waiting to be written to stdout */
+static struct
+{
+  int    fd;
+  size_t len;
+  char   buf[64 * 1024];
+} outbuf = { .fd = STDOUT_FILENO };
+
+/** Write out formatted output
+ */
+static void outbuf_flush(void)
+{
+  const char *pos = outbuf.buf;
+  size_t      len = outbuf.len;
+
+  // anything printf()ed must come out first
+  fflush(stdout);
+
+  while( len > 0 )
+  {
+    ssize_t rc = write(outbuf.fd, pos, len);
+    if( rc < 0 )
+    {
+      if( errno == EINTR ) continue;
+      break;
+    }
+    pos += rc, len -= rc;
+  }
+  outbuf.len = 0;
+}
+
+/** Make room for at least size bytes in output buffer
+ *
+ * @return pointer to the first free byte in the output buffer
+ */
+static char *outbuf_reserve(size_t size)
+{
+  if( outbuf.len + size > sizeof outbuf.buf )
+  {
+    outbuf_flush();
+  }
+  return outbuf.buf + outbuf.len;
+}
+
+/** Mark output buffer as filled up to pos
+ */
+static void outbuf_commit(const char *pos)
+{
+  outbuf.len = pos - outbuf.buf;
+}
+
+/** Copy string without terminator, return position after it
+ */
+static char *fmt_str(char *pos, const char *str, size_t len)
+{
+  memcpy(pos, str, len);
+  return pos + len;
+}
+
+/** Format signed value as decimal, zero padded to width digits
+ */
+static char *fmt_dec(char *pos, long val, int width)
+{
+  char          tmp[32];
+  int           n = 0;
+  unsigned long u = (val < 0) ? -(unsigned long)val : (unsigned long)val;
+
+  do tmp[n++] = '0' + u % 10; while( u /= 10 );
+  while( n < width ) tmp[n++] = '0';
+  if( val < 0 ) *pos++ = '-';
+  while( n > 0 ) *pos++ = tmp[--n];
+  return pos;
+}
+
+/** Get the "0xTT/EV_XXX - 0xCCC/XXX_YYY - " part of an event line
+ *
+ * Formatted only once for each type + code pair and then cached.
+ *
+ * @param etype input event type
+ * @param ecode input event code
+ * @param len   where to store string length
+ *
+ * @return formatted string
+ */
+static const char *fmt_type_code(unsigned etype, unsigned ecode, size_t *len)
+{
+  static char   *cache[EV_CNT][KEY_CNT];
+  static uint8_t cache_len[EV_CNT][KEY_CNT];
+  static char    tmp[128];
+
+  bool cacheable = (etype < EV_CNT && ecode < KEY_CNT);
+  int  n;
+
+  if( cacheable && cache[etype][ecode] )
+  {
+    *len = cache_len[etype][ecode];
+    return cache[etype][ecode];
+  }
+
+  n = snprintf(tmp, sizeof tmp, "0x%02x/%s - 0x%03x/%s - ",
+               etype, evdev_get_event_type_name(etype),
+               ecode, evdev_get_event_code_name(etype, ecode));
+  *len = ((size_t)n < sizeof tmp) ? (size_t)n : sizeof tmp - 1;
+
+  if( cacheable && (cache[etype][ecode] = strdup(tmp)) )
+  {
+    cache_len[etype][ecode] = *len;
+    return cache[etype][ecode];
+  }
+  return tmp;
+}
+
+/** Format "YYYY-MM-DD hh:mm:ss.mmm - " time of day prefix
+ *
+ * The localtime_r() conversion is done only when the second changes.
+ *
+ * @return position after formatted text
+ */
+static char *fmt_tod(char *pos, const struct timeval *tv)
+{
+  static time_t cached_sec = -1;
+  static char   cached[32];
+  static size_t cached_len = 0;
+
+  if( tv->tv_sec != cached_sec )
+  {
+    struct tm tm;
+    time_t    t = tv->tv_sec;
+    memset(&tm, 0, sizeof tm);
+
+    /* Caveat emptor: time of day = event read time ... */
+    localtime_r(&t, &tm);
+
+    cached_len = snprintf(cached, sizeof cached,
+                          "%04d-%02d-%02d %02d:%02d:%02d.",
+                          tm.tm_year + 1900,
+                          tm.tm_mon + 1,
+                          tm.tm_mday,
+                          tm.tm_hour,
+                          tm.tm_min,
+                          tm.tm_sec);
+    cached_sec = tv->tv_sec;
+  }
+
+  pos = fmt_str(pos, cached, cached_len);
+  pos = fmt_dec(pos, (long)(tv->tv_usec / 1000), 3);
+  return fmt_str(pos, " - ", 3);
+}
+
+/** Upper limit for event line length, excluding title */
+#define EVENT_LINE_MAX 256
+
+/** Format one event line into output buffer
+ *
+ * @param title     text to print before event details
+ * @param title_len length of title
+ * @param tod       time of day prefix, or NULL
+ * @param tod_len   length of tod
+ * @param e         input event
+ */
+static void format_event(const char *title, size_t title_len,
+                         const char *tod, size_t tod_len,
+                         const struct input_event *e)
+{
+  char       *pos = outbuf_reserve(title_len + tod_len + EVENT_LINE_MAX);
+  const char *tc;
+  size_t      tc_len;
+
+  pos = fmt_str(pos, title, title_len);
+  pos = fmt_str(pos, ": ", 2);
+  pos = fmt_str(pos, tod, tod_len);
+
+  if( emit_event_time )
+  {
+    pos = fmt_dec(pos, (long)e->time.tv_sec, 0);
+    *pos++ = '.';
+    pos = fmt_dec(pos, (long)e->time.tv_usec / 1000, 3);
+    pos = fmt_str(pos, " - ", 3);
+  }
+
+  tc  = fmt_type_code(e->type, e->code, &tc_len);
+  pos = fmt_str(pos, tc, tc_len);
+  pos = fmt_dec(pos, e->value, 0);
+  *pos++ = '\n';
+
+  outbuf_commit(pos);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Structured output
+ *
+ * JSON (one object per line), CSV and TSV renderings of events for
+ * machine consumption. Records have the same fields in every format:
+ *
+ *   device     input device path
+ *   type       event type number
+ *   type_name  event type name
+ *   code       event code number
+ *   code_name  event code name
+ *   value      event value
+ *   time       event time stamp, seconds with microsecond precision
+ *   read_time  time of day when the event was read, ditto
+ *
+ * Events are serialized straight into the output buffer; the device
+ * path is escaped only once per batch.
+ * ------------------------------------------------------------------------- */
+
+/** Output formats */
+typedef enum
+{
+  FORMAT_TEXT,
+  FORMAT_JSON,
+  FORMAT_CSV,
+  FORMAT_TSV,
+} format_t;
+
+/** Selected output format */
+static format_t output_format = FORMAT_TEXT;
+
+/** Field names, in output order */
+static const char format_fields[][10] =
+{
+  "device", "type", "type_name", "code", "code_name",
+  "value", "time", "read_time",
+};
+
+/** Parse output format name
+ *
+ * @return 0 on success, or -1 if the name is not known
+ */
+static int format_parse(const char *name)
+{
+  static const char * const lut[] =
+  {
+    [FORMAT_TEXT] = "text",
+    [FORMAT_JSON] = "json",
+    [FORMAT_CSV]  = "csv",
+    [FORMAT_TSV]  = "tsv",
+  };
+
+  for( size_t i = 0; i < numof(lut); ++i )
+  {
+    if( !strcmp(lut[i], name) )
+    {
+      output_format = i;
+      return 0;
+    }
+  }
+  mce_log(LL_ERR, "%s: unknown output format", name);
+  return -1;
+}
+
+/** Escape device path for the selected output format
+ *
+ * @param dst  buffer, must have room for 6 x strlen(src) + 3 bytes
+ * @param src  string to escape
+ *
+ * @return length of escaped string
+ */
+static size_t format_escape(char *dst, const char *src)
+{
+  char *pos = dst;
+
+  switch( output_format )
+  {
+  case FORMAT_JSON:
+    *pos++ = '"';
+    for( ; *src; ++src )
+    {
+      unsigned char c = *src;
+      if( c == '"' || c == '\\' )
+      {
+        *pos++ = '\\', *pos++ = c;
+      }
+      else if( c < 0x20 )
+      {
+        pos = fmt_str(pos, "\\u00", 4);
+        *pos++ = "0123456789abcdef"[c >> 4];
+        *pos++ = "0123456789abcdef"[c & 15];
+      }
+      else
+      {
+        *pos++ = c;
+      }
+    }
+    *pos++ = '"';
+    break;
+
+  case FORMAT_CSV:
+    if( !strpbrk(src, ",\"\r\n") )
+    {
+      pos = fmt_str(pos, src, strlen(src));
+      break;
+    }
+    *pos++ = '"';
+    for( ; *src; ++src )
+    {
+      if( *src == '"' ) *pos++ = '"';
+      *pos++ = *src;
+    }
+    *pos++ = '"';
+    break;
+
+  default:
+    for( ; *src; ++src )
+    {
+      switch( *src )
+      {
+      case '\t': *pos++ = '\\', *pos++ = 't';  break;
+      case '\n': *pos++ = '\\', *pos++ = 'n';  break;
+      case '\\': *pos++ = '\\', *pos++ = '\\'; break;
+      default:   *pos++ = *src; break;
+      }
+    }
+    break;
+  }
+  return pos - dst;
+}
+
+/** Format time stamp as seconds with microsecond precision
+ */
+static char *fmt_time(char *pos, long sec, long usec)
+{
+  pos = fmt_dec(pos, sec, 0);
+  *pos++ = '.';
+  return fmt_dec(pos, usec, 6);
+}
+
+/** Format one event record into output buffer
+ *
+ * @param dev     escaped device path
+ * @param dev_len length of dev
+ * @param tv      time of day when the event was read
+ * @param e       input event
+ */
+static void format_record(const char *dev, size_t dev_len,
+                          const struct timeval *tv,
+                          const struct input_event *e)
+{
+  char       *pos  = outbuf_reserve(dev_len + EVENT_LINE_MAX);
+  const char *tname = evdev_get_event_type_name(e->type);
+  const char *cname = evdev_get_event_code_name(e->type, e->code);
+
+  if( output_format == FORMAT_JSON )
+  {
+    pos = fmt_str(pos, "{\"device\":", 10);
+    pos = fmt_str(pos, dev, dev_len);
+    pos = fmt_str(pos, ",\"type\":", 8);
+    pos = fmt_dec(pos, e->type, 0);
+    pos = fmt_str(pos, ",\"type_name\":\"", 14);
+    pos = fmt_str(pos, tname, strlen(tname));
+    pos = fmt_str(pos, "\",\"code\":", 9);
+    pos = fmt_dec(pos, e->code, 0);
+    pos = fmt_str(pos, ",\"code_name\":\"", 14);
+    pos = fmt_str(pos, cname, strlen(cname));
+    pos = fmt_str(pos, "\",\"value\":", 10);
+    pos = fmt_dec(pos, e->value, 0);
+    pos = fmt_str(pos, ",\"time\":", 8);
+    pos = fmt_time(pos, (long)e->time.tv_sec, (long)e->time.tv_usec);
+    pos = fmt_str(pos, ",\"read_time\":", 13);
+    pos = fmt_time(pos, (long)tv->tv_sec, (long)tv->tv_usec);
+    pos = fmt_str(pos, "}\n", 2);
+  }
+  else
+  {
+    char sep = (output_format == FORMAT_CSV) ? ',' : '\t';
+
+    pos = fmt_str(pos, dev, dev_len);
+    *pos++ = sep;
+    pos = fmt_dec(pos, e->type, 0);
+    *pos++ = sep;
+    pos = fmt_str(pos, tname, strlen(tname));
+    *pos++ = sep;
+    pos = fmt_dec(pos, e->code, 0);
+    *pos++ = sep;
+    pos = fmt_str(pos, cname, strlen(cname));
+    *pos++ = sep;
+    pos = fmt_dec(pos, e->value, 0);
+    *pos++ = sep;
+    pos = fmt_time(pos, (long)e->time.tv_sec, (long)e->time.tv_usec);
+    *pos++ = sep;
+    pos = fmt_time(pos, (long)tv->tv_sec, (long)tv->tv_usec);
+    *pos++ = '\n';
+  }
+
+  outbuf_commit(pos);
+}
+
+/** Show a batch of input events in structured output format
+ *
+ * @param title input device path
+ * @param tv    time of day when the events were read
+ * @param eve   array of input events
+ * @param n     number of events in eve
+ */
+static void show_records(const char *title, const struct timeval *tv,
+                         const struct input_event *eve, int n)
+{
+  static bool header_done = false;
+
+  char   dev[6 * 256 + 3];
+  size_t dev_len;
+
+  if( strlen(title) >= 256 )
+  {
+    title = "unknown";
+  }
+  dev_len = format_escape(dev, title);
+
+  if( !header_done && output_format != FORMAT_JSON )
+  {
+    char *pos = outbuf_reserve(EVENT_LINE_MAX);
+    for( size_t i = 0; i < numof(format_fields); ++i )
+    {
+      if( i ) *pos++ = (output_format == FORMAT_CSV) ? ',' : '\t';
+      pos = fmt_str(pos, format_fields[i], strlen(format_fields[i]));
+    }
+    *pos++ = '\n';
+    outbuf_commit(pos);
+  }
+  header_done = true;
+
+  for( int i = 0; i < n; ++i )
+  {
+    format_record(dev, dev_len, tv, &eve[i]);
+  }
+}
+
+/** Show a batch of input events
+ *
+ * The whole batch is formatted into the output buffer, the caller
+ * is expected to write it out with a single outbuf_flush() call.
+ *
+ * @param title text to print before event details
+ * @param tv    time of day when the events were read
+ * @param eve   array of input events
+ * @param n     number of events in eve
+ */
+static
+void
+show_events(const char *title, const struct timeval *tv,
+            const struct input_event *eve, int n)
+{
+  char   tod[64];
+  size_t tod_len   = 0;
+  size_t title_len = strlen(title);
+
+  if( output_format != FORMAT_TEXT )
+  {
+    show_records(title, tv, eve, n);
+    return;
+  }
+
+  if( emit_time_of_day )
+  {
+    tod_len = fmt_tod(tod, tv) - tod;
+  }
+
+  for( int i = 0; i < n; ++i )
+  {
+    format_event(title, title_len, tod, tod_len, &eve[i]);
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * Frame aggregation
+ *
+ * In frames mode events are not shown one by one. Instead device state
+ * is tracked incrementally and one record is emitted per input frame,
+ * i.e. for every SYN_REPORT. Multitouch protocol B slots are resolved,
+ * so each record lists the active contacts with their tracking id,
+ * position and pressure, plus key state changes and relative motion
+ * within the frame and the time since the previous frame.
+ *
+ * Frame state is allocated once per device; processing events does
+ * not allocate.
+ * ------------------------------------------------------------------------- */
+
+/** Number of multitouch slots tracked per device */
+#define FRAME_SLOTS MT_SLOTS_MAX
+
+/** Number of key state changes recorded per frame */
+#define FRAME_KEYS 16
+
+/** Multitouch contact state */
+typedef struct
+{
+  int id;       // tracking id, or -1 for no contact
+  int x;
+  int y;
+  int pressure;
+} frame_touch_t;
+
+/** Per device frame state */
+typedef struct
+{
+  bool           mt;       // device uses multitouch protocol B
+  bool           dropped;  // SYN_DROPPED seen during frame
+  int            cur;      // current multitouch slot, -1 if not tracked
+  unsigned long  frames;   // number of frames seen
+  struct timeval prev;     // time stamp of previous frame
+  frame_touch_t  touch[FRAME_SLOTS];
+  int            keys;     // number of key changes in frame
+  int            lost;     // key changes that did not fit in key[]
+  struct
+  {
+    int code;
+    int value;
+  }              key[FRAME_KEYS];
+  int            rel[REL_CNT];
+} frame_t;
+
+/** Flag for: show input frames instead of events */
+static bool frames_mode = false;
+
+/** Frame state, indexed by device slot */
+static frame_t **frame_lut = 0;
+
+/** Number of slots in frame_lut */
+static int frame_cnt = 0;
+
+/** Forget frame state of a device
+ *
+ * @param slot device slot
+ */
+static void frames_reset(int slot)
+{
+  if( slot < frame_cnt )
+  {
+    free(frame_lut[slot]), frame_lut[slot] = 0;
+  }
+}
+
+/** Get frame state of a device, allocate if needed
+ *
+ * @param slot device slot
+ *
+ * @return frame state, or NULL on allocation failure
+ */
+static frame_t *frames_get(int slot)
+{
+  frame_t *frm;
+
+  if( slot < frame_cnt && frame_lut[slot] )
+  {
+    return frame_lut[slot];
+  }
+
+  if( slot >= frame_cnt )
+  {
+    frame_t **lut = realloc(frame_lut, (slot + 1) * sizeof *frame_lut);
+
+    if( !lut )
+    {
+      return 0;
+    }
+    frame_lut = lut;
+    memset(frame_lut + frame_cnt, 0,
+           (slot + 1 - frame_cnt) * sizeof *frame_lut);
+    frame_cnt = slot + 1;
+  }
+
+  if( (frm = calloc(1, sizeof *frm)) )
+  {
+    for( int i = 0; i < FRAME_SLOTS; ++i )
+    {
+      frm->touch[i].id = -1;
+    }
+  }
+  return frame_lut[slot] = frm;
+}
+
+/** Format frame record into output buffer and start a new frame
+ *
+ * @param frm   frame state
+ * @param title text to print before frame details
+ * @param time  SYN_REPORT time stamp
+ */
+static void frames_emit(frame_t *frm, const char *title,
+                        const struct timeval *time)
+{
+  size_t title_len = strlen(title);
+  char  *pos = outbuf_reserve(title_len + 64 * (FRAME_SLOTS + FRAME_KEYS));
+  int    touches = 0;
+
+  for( int i = 0; i < FRAME_SLOTS; ++i )
+  {
+    touches += (frm->touch[i].id != -1);
+  }
+
+  pos = fmt_str(pos, title, title_len);
+  pos = fmt_str(pos, ": ", 2);
+  pos = fmt_dec(pos, (long)time->tv_sec, 0);
+  *pos++ = '.';
+  pos = fmt_dec(pos, (long)time->tv_usec, 6);
+  pos = fmt_str(pos, " - frame ", 9);
+  pos = fmt_dec(pos, (long)++frm->frames, 0);
+
+  if( frm->frames > 1 )
+  {
+    long dt = (time->tv_sec - frm->prev.tv_sec) * 1000000L +
+      (time->tv_usec - frm->prev.tv_usec);
+    pos = fmt_str(pos, " +", 2);
+    if( dt < 0 ) *pos++ = '-', dt = -dt;
+    pos = fmt_dec(pos, dt / 1000, 0);
+    *pos++ = '.';
+    pos = fmt_dec(pos, dt % 1000, 3);
+    pos = fmt_str(pos, "ms", 2);
+  }
+  frm->prev = *time;
+
+  if( frm->dropped )
+  {
+    pos = fmt_str(pos, " - DROPPED", 10);
+  }
+
+  if( touches )
+  {
+    pos = fmt_str(pos, " - touches", 10);
+    for( int i = 0; i < FRAME_SLOTS; ++i )
+    {
+      const frame_touch_t *t = &frm->touch[i];
+      if( t->id == -1 ) continue;
+      pos = fmt_str(pos, " [", 2);
+      pos = fmt_dec(pos, i, 0);
+      *pos++ = ':';
+      pos = fmt_dec(pos, t->id, 0);
+      pos = fmt_str(pos, " @ ", 3);
+      pos = fmt_dec(pos, t->x, 0);
+      *pos++ = ',';
+      pos = fmt_dec(pos, t->y, 0);
+      pos = fmt_str(pos, " p ", 3);
+      pos = fmt_dec(pos, t->pressure, 0);
+      *pos++ = ']';
+    }
+  }
+
+  if( frm->rel[REL_X] || frm->rel[REL_Y] )
+  {
+    pos = fmt_str(pos, " - rel ", 7);
+    pos = fmt_dec(pos, frm->rel[REL_X], 0);
+    *pos++ = ',';
+    pos = fmt_dec(pos, frm->rel[REL_Y], 0);
+  }
+
+  if( frm->rel[REL_WHEEL] )
+  {
+    pos = fmt_str(pos, " - wheel ", 9);
+    pos = fmt_dec(pos, frm->rel[REL_WHEEL], 0);
+  }
+
+  if( frm->keys )
+  {
+    pos = fmt_str(pos, " - keys", 7);
+    for( int i = 0; i < frm->keys; ++i )
+    {
+      const char *name = evdev_get_event_code_name(EV_KEY, frm->key[i].code);
+      *pos++ = ' ';
+      pos = fmt_str(pos, name, strlen(name));
+      *pos++ = '=';
+      pos = fmt_dec(pos, frm->key[i].value, 0);
+    }
+    if( frm->lost )
+    {
+      pos = fmt_str(pos, " +", 2);
+      pos = fmt_dec(pos, frm->lost, 0);
+      pos = fmt_str(pos, " more", 5);
+    }
+  }
+
+  *pos++ = '\n';
+  outbuf_commit(pos);
+
+  frm->dropped = false;
+  frm->keys = frm->lost = 0;
+  memset(frm->rel, 0, sizeof frm->rel);
+}
+
+/** Update frame state from a batch of events
+ *
+ * @param slot  device slot
+ * @param title text to print before frame details
+ * @param eve   array of input events
+ * @param n     number of events in eve
+ */
+static void frames_add(int slot, const char *title,
+                       const struct input_event *eve, int n)
+{
+  frame_t *frm = frames_get(slot);
+
+  if( !frm )
+  {
+    return;
+  }
+
+  for( int i = 0; i < n; ++i )
+  {
+    const struct input_event *e = &eve[i];
+    frame_touch_t            *t = 0;
+
+    // slots beyond FRAME_SLOTS are ignored until the next ABS_MT_SLOT
+    if( frm->cur != -1 )
+    {
+      t = &frm->touch[frm->cur];
+    }
+
+    switch( e->type )
+    {
+    case EV_SYN:
+      if( e->code == SYN_REPORT )
+      {
+        frames_emit(frm, title, &e->time);
+      }
+      else if( e->code == SYN_DROPPED )
+      {
+        frm->dropped = true;
+      }
+      break;
+
+    case EV_KEY:
+      if( frm->keys < FRAME_KEYS )
+      {
+        frm->key[frm->keys].code  = e->code;
+        frm->key[frm->keys].value = e->value;
+        ++frm->keys;
+      }
+      else
+      {
+        ++frm->lost;
+      }
+      if( e->code == BTN_TOUCH && !frm->mt )
+      {
+        frm->touch[0].id = e->value ? 0 : -1;
+      }
+      break;
+
+    case EV_REL:
+      if( e->code < REL_CNT )
+      {
+        frm->rel[e->code] += e->value;
+      }
+      break;
+
+    case EV_ABS:
+      switch( e->code )
+      {
+      case ABS_MT_SLOT:
+        frm->mt  = true;
+        frm->cur = (e->value >= 0 && e->value < FRAME_SLOTS) ? e->value : -1;
+        break;
+      case ABS_MT_TRACKING_ID:
+        frm->mt = true;
+        if( t ) t->id = (e->value < 0) ? -1 : e->value;
+        break;
+      case ABS_MT_POSITION_X:
+        frm->mt = true;
+        if( t ) t->x = e->value;
+        break;
+      case ABS_MT_POSITION_Y:
+        frm->mt = true;
+        if( t ) t->y = e->value;
+        break;
+      case ABS_MT_PRESSURE:
+        frm->mt = true;
+        if( t ) t->pressure = e->value;
+        break;
+      case ABS_X:
+        if( !frm->mt ) frm->touch[0].x = e->value;
+        break;
+      case ABS_Y:
+        if( !frm->mt ) frm->touch[0].y = e->value;
+        break;
+      case ABS_PRESSURE:
+        if( !frm->mt ) frm->touch[0].pressure = e->value;
+        break;
+      default:
+        break;
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * Capture files
+ *
+ * A capture file starts with an evrec_file_t header and is followed by
+ * a stream of records. Each record is an evrec_head_t followed by the
+ * payload, padded so that every header and payload stays 8 byte aligned.
+ * This allows the file to be mmap()ed and walked without copying.
+ *
+ * EVREC_DEVICE records carry an evdev_caps_t and bind a device slot
+ * to a device. EVREC_EVENTS records carry raw struct input_event
+ * arrays exactly as read() returned them, EVREC_DELTA records the same
+ * information in compact form. A device slot can be
+ * rebound by a later EVREC_DEVICE record, which makes appending to
+ * an existing capture file from a new tracer run safe.
+ * ------------------------------------------------------------------------- */
+
+/** Magic bytes at the start of capture files */
+#define EVREC_MAGIC "EVTRACE1"
+
+/** Round record payload size up to record alignment */
+#define EVREC_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/** Limit for device slots in capture files
+ *
+ * The tracer reuses free slots, so slots stay below the number of
+ * devices attached at the same time.
+ */
+#define EVREC_SLOTS_MAX 1024
+
+/** Capture file header */
+typedef struct
+{
+  char     magic[8];
+  uint32_t event_size; // sizeof (struct input_event) of the writer
+  uint32_t caps_size;  // sizeof (evdev_caps_t) of the writer
+} evrec_file_t;
+
+/** Capture file record types */
+enum
+{
+  EVREC_DEVICE = 1,
+  EVREC_EVENTS = 2,
+  EVREC_DELTA  = 3,
+};
+
+/** Capture file record header */
+typedef struct
+{
+  uint32_t type;   // EVREC_DEVICE / EVREC_EVENTS / EVREC_DELTA
+  uint32_t size;   // payload size without padding
+  uint32_t device; // device slot
+  uint32_t count;  // number of events in EVREC_EVENTS payload
+  int64_t  sec;    // time of day when the events were read
+  int64_t  usec;
+} evrec_head_t;
+
+/** Capture file path, or NULL when not recording */
+static const char *evrec_path = 0;
+
+/** Capture file descriptor, or -1 when not recording */
+static int evrec_fd = -1;
+
+/** Records waiting to be written to capture file */
+static char evrec_buf[64 * 1024];
+
+/** Number of bytes used in evrec_buf */
+static size_t evrec_len = 0;
+
+/** Write data to capture file
+ *
+ * @return 0 on success, or -1 in case of errors
+ */
+static int evrec_write(const void *data, size_t size)
+{
+  const char *pos = data;
+
+  while( size > 0 )
+  {
+    ssize_t rc = write(evrec_fd, pos, size);
+    if( rc < 0 )
+    {
+      if( errno == EINTR ) continue;
+      mce_log(LL_ERR, "%s: write: %m", evrec_path);
+      return -1;
+    }
+    pos += rc, size -= rc;
+  }
+  return 0;
+}
+
+/** Write out buffered capture file records
+ *
+ * @return 0 on success, or -1 in case of errors
+ */
+static int evrec_flush(void)
+{
+  int err = evrec_write(evrec_buf, evrec_len);
+  evrec_len = 0;
+  return err;
+}
+
+/** Append a record to capture file
+ *
+ * @param head record header, size field must be filled in
+ * @param data record payload
+ */
+static void evrec_append(const evrec_head_t *head, const void *data)
+{
+  static const char pad[8];
+  size_t need = sizeof *head + EVREC_ALIGN(head->size);
+
+  if( evrec_len + need > sizeof evrec_buf )
+  {
+    evrec_flush();
+  }
+
+  if( need > sizeof evrec_buf )
+  {
+    // does not fit in buffer -> write directly
+    evrec_write(head, sizeof *head);
+    evrec_write(data, head->size);
+    evrec_write(pad, EVREC_ALIGN(head->size) - head->size);
+    return;
+  }
+
+  memcpy(evrec_buf + evrec_len, head, sizeof *head);
+  evrec_len += sizeof *head;
+  memcpy(evrec_buf + evrec_len, data, head->size);
+  evrec_len += head->size;
+  memcpy(evrec_buf + evrec_len, pad, EVREC_ALIGN(head->size) - head->size);
+  evrec_len += EVREC_ALIGN(head->size) - head->size;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Compact capture records
+ *
+ * For long term logging raw events are too bulky, so in compact mode
+ * events are delta encoded into EVREC_DELTA records instead. Each event
+ * is stored as LEB128 varints:
+ *
+ *   idx << 1 | batch   index into the dictionary of the record
+ *   [device type code] only when idx defines a new dictionary entry
+ *   [read time delta]  only when batch is set, i.e. a new read() starts
+ *   event time delta   [us], zig-zag
+ *   value delta        against previous value of the same entry, zig-zag
+ *
+ * Time deltas start from the read time in the record header and values
+ * from zero, and the dictionary is built from scratch in every record.
+ * Thus every record is a keyframe that can be decoded without looking
+ * at anything before it. A new record is started when the current one
+ * grows past EVDELTA_BLOCK bytes or spans EVDELTA_KEYFRAME_SEC seconds.
+ * The latter is checked by the periodic flush too, so events of a device
+ * that went quiet reach the file within about a keyframe interval.
+ * ------------------------------------------------------------------------- */
+
+/** Target payload size of compact records */
+#define EVDELTA_BLOCK (32 * 1024)
+
+/** Worst case encoded size of one event */
+#define EVDELTA_EVENT_MAX (7 * 10)
+
+/** Maximum number of dictionary entries per compact record */
+#define EVDELTA_DICT_MAX 1024
+
+/** Log2 of dictionary lookup table size */
+#define EVDELTA_HASH_BITS 12
+
+/** Size of dictionary lookup table */
+#define EVDELTA_HASH (1 << EVDELTA_HASH_BITS)
+
+/** Maximum time span of a compact record [s] */
+#define EVDELTA_KEYFRAME_SEC 60
+
+/** Dictionary lookup table entry */
+typedef struct
+{
+  uint64_t key; // device << 32 | type << 16 | code
+  uint32_t gen; // record generation the entry belongs to
+  uint32_t idx; // dictionary index
+} evdelta_slot_t;
+
+/** Compact record encoder state */
+static struct
+{
+  size_t         len;      // bytes used in buf
+  uint32_t       count;    // events in buf
+  uint32_t       gen;      // bumped for every record
+  int            dict_cnt; // dictionary entries in use
+  int64_t        base;     // read time at start of record [us]
+  int64_t        read_us;  // previous read time [us]
+  int64_t        time_us;  // previous event time [us]
+  uint64_t       bytes;    // total bytes written, headers included
+  int32_t        value[EVDELTA_DICT_MAX];
+  evdelta_slot_t hash[EVDELTA_HASH];
+  char           buf[EVDELTA_BLOCK + EVDELTA_EVENT_MAX];
+} evdelta = { .gen = 1 };
+
+/** Flag for: write compact records instead of raw events */
+static bool evdelta_mode = false;
+
+/** Append varint to buffer
+ */
+static char *evdelta_put(char *pos, uint64_t val)
+{
+  while( val >= 0x80 )
+  {
+    *pos++ = (char)(val | 0x80);
+    val >>= 7;
+  }
+  *pos++ = (char)val;
+  return pos;
+}
+
+/** Parse varint from buffer
+ *
+ * @return position after the varint, or NULL if data is truncated
+ */
+static const char *evdelta_get(const char *pos, const char *end,
+                               uint64_t *val)
+{
+  *val = 0;
+  for( int shift = 0; pos < end && shift < 64; shift += 7 )
+  {
+    unsigned char c = *pos++;
+    *val |= (uint64_t)(c & 0x7f) << shift;
+    if( !(c & 0x80) )
+    {
+      return pos;
+    }
+  }
+  return 0;
+}
+
+/** Map signed value to unsigned so that small magnitudes stay small
+ */
+static uint64_t evdelta_zigzag(int64_t val)
+{
+  return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
+
+/** Reverse evdelta_zigzag()
+ */
+static int64_t evdelta_unzigzag(uint64_t val)
+{
+  return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+/** Write out pending compact record
+ */
+static void evdelta_flush(void)
+{
+  evrec_head_t head;
+
+  if( evdelta.count == 0 )
+  {
+    return;
+  }
+
+  memset(&head, 0, sizeof head);
+  head.type  = EVREC_DELTA;
+  head.size  = evdelta.len;
+  head.count = evdelta.count;
+  head.sec   = evdelta.base / 1000000;
+  head.usec  = evdelta.base % 1000000;
+  evrec_append(&head, evdelta.buf);
+
+  evdelta.bytes   += sizeof head + EVREC_ALIGN(evdelta.len);
+  evdelta.len      = 0;
+  evdelta.count    = 0;
+  evdelta.dict_cnt = 0;
+  evdelta.gen     += 1;
+}
+
+/** Close pending compact record if it spans EVDELTA_KEYFRAME_SEC
+ *
+ * @param now_us current time of day [us]
+ */
+static void evdelta_expire(int64_t now_us)
+{
+  if( evdelta.count &&
+      now_us - evdelta.base >= EVDELTA_KEYFRAME_SEC * INT64_C(1000000) )
+  {
+    evdelta_flush();
+  }
+}
+
+/** Add events to compact record
+ *
+ * @param slot device slot
+ * @param tv   time of day when the events were read
+ * @param eve  array of input events
+ * @param n    number of events in eve
+ */
+static void evdelta_add(int slot, const struct timeval *tv,
+                        const struct input_event *eve, int n)
+{
+  int64_t read_us = tv->tv_sec * INT64_C(1000000) + tv->tv_usec;
+
+  evdelta_expire(read_us);
+
+  for( int i = 0; i < n; ++i )
+  {
+    const struct input_event *e = &eve[i];
+
+    if( evdelta.len > EVDELTA_BLOCK ||
+        evdelta.dict_cnt == EVDELTA_DICT_MAX )
+    {
+      evdelta_flush();
+    }
+
+    if( evdelta.count == 0 )
+    {
+      evdelta.base = evdelta.read_us = evdelta.time_us = read_us;
+    }
+
+    uint64_t key = ((uint64_t)slot << 32 | (uint32_t)e->type << 16 |
+                    e->code);
+    uint32_t h   = (uint32_t)((key * UINT64_C(0x9e3779b97f4a7c15)) >>
+                              (64 - EVDELTA_HASH_BITS));
+    bool     def = false;
+
+    while( evdelta.hash[h].gen == evdelta.gen && evdelta.hash[h].key != key )
+    {
+      h = (h + 1) & (EVDELTA_HASH - 1);
+    }
+    if( evdelta.hash[h].gen != evdelta.gen )
+    {
+      evdelta.hash[h].key = key;
+      evdelta.hash[h].gen = evdelta.gen;
+      evdelta.hash[h].idx = evdelta.dict_cnt;
+      evdelta.value[evdelta.dict_cnt++] = 0;
+      def = true;
+    }
+
+    uint32_t idx   = evdelta.hash[h].idx;
+    bool     batch = (i == 0 || evdelta.count == 0);
+    int64_t  t     = e->time.tv_sec * INT64_C(1000000) + e->time.tv_usec;
+    char    *pos   = evdelta.buf + evdelta.len;
+
+    pos = evdelta_put(pos, (uint64_t)idx << 1 | batch);
+    if( def )
+    {
+      pos = evdelta_put(pos, slot);
+      pos = evdelta_put(pos, e->type);
+      pos = evdelta_put(pos, e->code);
+    }
+    if( batch )
+    {
+      pos = evdelta_put(pos, evdelta_zigzag(read_us - evdelta.read_us));
+      evdelta.read_us = read_us;
+    }
+    pos = evdelta_put(pos, evdelta_zigzag(t - evdelta.time_us));
+    evdelta.time_us = t;
+    pos = evdelta_put(pos, evdelta_zigzag((int64_t)e->value -
+                                          evdelta.value[idx]));
+    evdelta.value[idx] = e->value;
+
+    evdelta.len = pos - evdelta.buf;
+    evdelta.count += 1;
+  }
+}
+
+/** Callback for events read from a capture file
+ *
+ * @param ctx  context pointer given by caller
+ * @param slot device slot
+ * @param tv   time of day when the events were read
+ * @param eve  array of input events
+ * @param n    number of events in eve
+ */
+typedef void (*evrec_sink_t)(void *ctx, uint32_t slot,
+                             const struct timeval *tv,
+                             const struct input_event *eve, int n);
+
+/** Devices bound to slots while walking a capture file */
+typedef struct
+{
+  const evdev_caps_t **dev; // indexed by device slot
+  size_t               devs;
+} evrec_devs_t;
+
+/** Render a batch of events from a capture file
+ *
+ * Matches evrec_sink_t, ctx is an evrec_devs_t.
+ */
+static void evrec_show(void *ctx, uint32_t slot, const struct timeval *tv,
+                       const struct input_event *eve, int n)
+{
+  const evrec_devs_t *devs  = ctx;
+  const char         *title = "unknown";
+
+  // slot numbers come from the file, keep them from sizing anything
+  if( slot >= EVREC_SLOTS_MAX )
+  {
+    return;
+  }
+  if( slot < devs->devs && devs->dev[slot] )
+  {
+    title = devs->dev[slot]->path;
+  }
+  if( frames_mode )
+  {
+    frames_add(slot, title, eve, n);
+  }
+  else
+  {
+    show_events(title, tv, eve, n);
+  }
+}
+
+/** Convert microseconds to timeval
+ */
+static struct timeval evdelta_timeval(int64_t us)
+{
+  struct timeval tv = { .tv_sec = us / 1000000, .tv_usec = us % 1000000 };
+  return tv;
+}
+
+/** Decode compact record
+ *
+ * @param head record header followed by payload
+ * @param sink callback for decoded event batches
+ * @param ctx  context pointer for sink
+ *
+ * @return 0 on success, or -1 if the record is corrupted
+ */
+static int evdelta_decode(const evrec_head_t *head, evrec_sink_t sink,
+                          void *ctx)
+{
+  struct
+  {
+    uint32_t slot;
+    uint16_t type;
+    uint16_t code;
+    int32_t  value;
+  } dict[EVDELTA_DICT_MAX];
+
+  int                 err      = -1;
+  const char         *pos      = (const char *)(head + 1);
+  const char         *end      = pos + head->size;
+  int64_t             read_us  = head->sec * INT64_C(1000000) + head->usec;
+  int64_t             time_us  = read_us;
+  int                 dict_cnt = 0;
+  uint32_t            slot     = 0;
+  int                 n        = 0;
+  struct timeval      tv;
+  struct input_event *eve      = 0;
+
+  // every event takes at least three bytes
+  if( head->count > head->size / 3 ||
+      !(eve = malloc(head->count * sizeof *eve)) )
+  {
+    goto cleanup;
+  }
+
+  for( uint32_t i = 0; i < head->count; ++i )
+  {
+    uint64_t val, dt, dv;
+    uint32_t idx;
+
+    if( !(pos = evdelta_get(pos, end, &val)) ||
+        (idx = val >> 1) > (uint32_t)dict_cnt )
+    {
+      goto cleanup;
+    }
+
+    if( idx == (uint32_t)dict_cnt )
+    {
+      uint64_t def[3];
+      for( int k = 0; k < 3; ++k )
+      {
+        if( !(pos = evdelta_get(pos, end, &def[k])) ) goto cleanup;
+      }
+      if( dict_cnt == EVDELTA_DICT_MAX || def[0] > UINT32_MAX ||
+          def[1] > UINT16_MAX || def[2] > UINT16_MAX )
+      {
+        goto cleanup;
+      }
+      dict[dict_cnt].slot  = def[0];
+      dict[dict_cnt].type  = def[1];
+      dict[dict_cnt].code  = def[2];
+      dict[dict_cnt].value = 0;
+      ++dict_cnt;
+    }
+
+    if( val & 1 )
+    {
+      if( n )
+      {
+        sink(ctx, slot, &tv, eve, n), n = 0;
+      }
+      if( !(pos = evdelta_get(pos, end, &dt)) )
+      {
+        goto cleanup;
+      }
+      read_us += evdelta_unzigzag(dt);
+      tv   = evdelta_timeval(read_us);
+      slot = dict[idx].slot;
+    }
+    else if( i == 0 || dict[idx].slot != slot )
+    {
+      goto cleanup;
+    }
+
+    if( !(pos = evdelta_get(pos, end, &dt)) ||
+        !(pos = evdelta_get(pos, end, &dv)) )
+    {
+      goto cleanup;
+    }
+    time_us += evdelta_unzigzag(dt);
+    dict[idx].value += (int32_t)evdelta_unzigzag(dv);
+
+    eve[n].time  = evdelta_timeval(time_us);
+    eve[n].type  = dict[idx].type;
+    eve[n].code  = dict[idx].code;
+    eve[n].value = dict[idx].value;
+    ++n;
+  }
+
+  if( n )
+  {
+    sink(ctx, slot, &tv, eve, n);
+  }
+  err = 0;
+
+cleanup:
+  free(eve);
+  return err;
+}
+
+/** Open capture file for appending
+ *
+ * @param path capture file path
+ *
+ * @return 0 on success, or -1 in case of errors
+ */
+static int evrec_open(const char *path)
+{
+  struct stat  st;
+  evrec_file_t hdr;
+
+  memset(&hdr, 0, sizeof hdr);
+  memcpy(hdr.magic, EVREC_MAGIC, sizeof hdr.magic);
+  hdr.event_size = sizeof (struct input_event);
+  hdr.caps_size  = sizeof (evdev_caps_t);
+
+  evrec_path = path;
+
+  if( (evrec_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1 )
+  {
+    mce_log(LL_ERR, "%s: open: %m", path);
+    goto fail;
+  }
+
+  if( fstat(evrec_fd, &st) == -1 )
+  {
+    mce_log(LL_ERR, "%s: stat: %m", path);
+    goto fail;
+  }
+
+  if( st.st_size == 0 )
+  {
+    if( evrec_write(&hdr, sizeof hdr) == -1 )
+    {
+      goto fail;
+    }
+  }
+  else
+  {
+    evrec_file_t old;
+    int          fd = open(path, O_RDONLY);
+    int          ok = (fd != -1 &&
+                       read(fd, &old, sizeof old) == sizeof old &&
+                       !memcmp(&old, &hdr, sizeof hdr));
+    if( fd != -1 ) close(fd);
+
+    if( !ok )
+    {
+      mce_log(LL_ERR, "%s: not a compatible capture file", path);
+      goto fail;
+    }
+  }
+
+  return 0;
+
+fail:
+  if( evrec_fd != -1 ) close(evrec_fd), evrec_fd = -1;
+  return -1;
+}
+
+/** Flush and close capture file
+ */
+static void evrec_close(void)
+{
+  if( evrec_fd != -1 )
+  {
+    evdelta_flush();
+    evrec_flush();
+    close(evrec_fd), evrec_fd = -1;
+  }
+}
+
+/** Add device record to capture file
+ *
+ * @param slot device slot
+ * @param fd   input device file descriptor
+ * @param path input device path
+ */
+static void evrec_add_device(int slot, int fd, const char *path)
+{
+  evrec_head_t head;
+  evdev_caps_t caps;
+
+  evdev_lookup_caps(fd, path, &caps);
+
+  // events of a previous device in the slot must precede the rebinding
+  evdelta_flush();
+
+  memset(&head, 0, sizeof head);
+  head.type   = EVREC_DEVICE;
+  head.size   = sizeof caps;
+  head.device = slot;
+  evrec_append(&head, &caps);
+}
+
+/** Add events record to capture file
+ *
+ * @param slot device slot
+ * @param tv   time of day when the events were read
+ * @param eve  array of input events
+ * @param n    number of events in eve
+ */
+static void evrec_add_events(int slot, const struct timeval *tv,
+                             const struct input_event *eve, int n)
+{
+  evrec_head_t head;
+
+  if( evdelta_mode )
+  {
+    evdelta_add(slot, tv, eve, n);
+    return;
+  }
+
+  memset(&head, 0, sizeof head);
+  head.type   = EVREC_EVENTS;
+  head.size   = n * sizeof *eve;
+  head.device = slot;
+  head.count  = n;
+  head.sec    = tv->tv_sec;
+  head.usec   = tv->tv_usec;
+  evrec_append(&head, eve);
+}
+
+/** Map capture file for reading
+ *
+ * @param path capture file path
+ * @param size set to file size
+ *
+ * @return file contents, or NULL in case of errors
+ */
+static const char *evrec_map(const char *path, size_t *size)
+{
+  int                 fd   = -1;
+  char               *base = MAP_FAILED;
+  const evrec_file_t *hdr;
+  struct stat         st;
+
+  if( (fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1 )
+  {
+    mce_log(LL_ERR, "%s: open: %m", path);
+    goto fail;
+  }
+
+  *size = st.st_size;
+  if( *size < sizeof *hdr ||
+      (base = mmap(0, *size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED )
+  {
+    mce_log(LL_ERR, "%s: not a capture file", path);
+    goto fail;
+  }
+
+  hdr = (const evrec_file_t *)base;
+  if( memcmp(hdr->magic, EVREC_MAGIC, sizeof hdr->magic) ||
+      hdr->event_size != sizeof (struct input_event) ||
+      hdr->caps_size  != sizeof (evdev_caps_t) )
+  {
+    mce_log(LL_ERR, "%s: not a compatible capture file", path);
+    goto fail;
+  }
+
+  close(fd);
+  return base;
+
+fail:
+  if( base != MAP_FAILED ) munmap(base, *size);
+  if( fd != -1 ) close(fd);
+  return 0;
+}
+
+/** Get next record from mapped capture file
+ *
+ * @param path capture file path, for diagnostics
+ * @param base file contents
+ * @param size file size
+ * @param off  offset of the record, advanced past it
+ *
+ * @return record header, or NULL at end of file
+ */
+static const evrec_head_t *evrec_next(const char *path, const char *base,
+                                      size_t size, size_t *off)
+{
+  const evrec_head_t *head = (const evrec_head_t *)(base + *off);
+
+  if( *off >= size )
+  {
+    return 0;
+  }
+
+  if( size - *off < sizeof *head ||
+      size - *off - sizeof *head < EVREC_ALIGN(head->size) )
+  {
+    mce_log(LL_WARN, "%s: truncated record at offset %zu", path, *off);
+    return 0;
+  }
+
+  *off += sizeof *head + EVREC_ALIGN(head->size);
+  return head;
+}
+
+/** Bind device slot to device record
+ *
+ * @param devs slot bindings
+ * @param head EVREC_DEVICE record
+ *
+ * @return 0 on success, or -1 if the slot is out of range or out of memory
+ */
+static int evrec_bind(evrec_devs_t *devs, const evrec_head_t *head)
+{
+  if( head->device >= EVREC_SLOTS_MAX )
+  {
+    return -1;
+  }
+
+  if( head->device >= devs->devs )
+  {
+    size_t               cnt = head->device + 1;
+    const evdev_caps_t **dev = realloc(devs->dev, cnt * sizeof *dev);
+
+    if( !dev )
+    {
+      return -1;
+    }
+    devs->dev = dev;
+    memset(devs->dev + devs->devs, 0,
+           (cnt - devs->devs) * sizeof *devs->dev);
+    devs->devs = cnt;
+  }
+  devs->dev[head->device] = (const evdev_caps_t *)(head + 1);
+  return 0;
+}
+
+/** Render events stored in a capture file
+ *
+ * @param path capture file path
+ *
+ * @return 0 on success, or -1 in case of errors
+ */
+static int evrec_replay(const char *path)
+{
+  size_t              size = 0;
+  const char         *base = evrec_map(path, &size);
+  evrec_devs_t        devs = { 0, 0 };
+  const evrec_head_t *head;
+
+  if( !base )
+  {
+    return -1;
+  }
+
+  for( size_t off = sizeof (evrec_file_t);
+       (head = evrec_next(path, base, size, &off)); )
+  {
+    if( head->type == EVREC_DEVICE && head->size == sizeof (evdev_caps_t) )
+    {
+      if( evrec_bind(&devs, head) == -1 )
+      {
+        mce_log(LL_WARN, "%s: bad device record at offset %zu", path,
+                off - sizeof *head - EVREC_ALIGN(head->size));
+        continue;
+      }
+      frames_reset(head->device);
+    }
+    else if( head->type == EVREC_EVENTS &&
+             head->size == head->count * sizeof (struct input_event) )
+    {
+      struct timeval tv = { .tv_sec = head->sec, .tv_usec = head->usec };
+
+      evrec_show(&devs, head->device, &tv,
+                 (const struct input_event *)(head + 1), head->count);
+    }
+    else if( head->type == EVREC_DELTA &&
+             evdelta_decode(head, evrec_show, &devs) == -1 )
+    {
+      mce_log(LL_WARN, "%s: corrupted record at offset %zu", path,
+              off - sizeof *head - EVREC_ALIGN(head->size));
+    }
+  }
+  outbuf_flush();
+
+  free(devs.dev);
+  munmap((void *)base, size);
+
+  return 0;
+}
+
+/** Get monotonic time stamp in nanoseconds
+ */
+static int64_t monotime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Offline analysis
+ *
+ * Capture files are analyzed in parallel: the file is mmap()ed, split
+ * into one byte range per cpu core, and every range is analyzed by a
+ * worker thread into per device partial results. The partials are then
+ * merged in file order.
+ *
+ * Records carry no sync marks, so a worker finds the first record of
+ * its range by looking for a run of plausible record headers. Each
+ * worker walks on past the end of its range to the first record after
+ * it, which is where the next range really starts; a range whose guess
+ * was wrong is analyzed again once that is known. No thread has to
+ * walk the whole file before the others can start.
+ *
+ * Which device a slot refers to at the start of a range is only known
+ * after the preceding ranges are done. Workers keep events of such
+ * slots apart and they are attributed when the partials are merged.
+ *
+ * Frames and key presses can span chunk boundaries, so the partials
+ * keep what is needed for stitching: times of the first and last
+ * SYN_REPORT, flags of the frames cut in half by the boundaries, and
+ * for keys the first release of a press from before the chunk and the
+ * press still held at the end of it.
+ *
+ * Devices are identified by the EVREC_DEVICE record that bound them,
+ * so a slot that gets reused by another device yields separate results.
+ * ------------------------------------------------------------------------- */
+
+/** Hold time after which a key counts as stuck [us] */
+#define ANALYZE_STUCK_US (5 * INT64_C(1000000))
+
+/** Interval between touch frames that counts as a gap [us] */
+#define ANALYZE_GAP_US (50 * INT64_C(1000))
+
+/** Number of busiest event codes to report */
+#define ANALYZE_TOP 16
+
+/** Frame flag: frame carries touch data */
+#define ANALYZE_TOUCH (1u << 0)
+
+/** Frame flag: frame ends a contact */
+#define ANALYZE_LIFT  (1u << 1)
+
+/** Key press state of a device within a chunk */
+typedef struct
+{
+  int64_t first_up; // release of a press made before the chunk, or -1
+  int64_t down;     // time of press held at end of chunk, or -1
+  int64_t hold_max; // longest press seen [us]
+  bool    seen;     // key state became known within the chunk
+} analyze_key_t;
+
+/** Analysis results of a device, partial or merged */
+typedef struct
+{
+  uint64_t      count[EV_CNT][KEY_CNT];
+  uint64_t      events;
+  int64_t       first;        // time of first event [us], or -1
+  int64_t       last;         // time of last event [us]
+  uint64_t      frames;       // SYN_REPORT count
+  int64_t       syn_first;    // time of first SYN_REPORT, or -1
+  int64_t       syn_last;     // time of last SYN_REPORT, or -1
+  uint64_t      ivals;        // frame intervals seen
+  double        ival_sum;     // sum of frame intervals [us]
+  double        ival_sum2;    // sum of squared frame intervals [us^2]
+  int64_t       ival_max;
+  unsigned      head;         // flags of frame started before the chunk
+  unsigned      tail;         // flags of frame open at end of chunk
+  int64_t       touch_first;  // first touch frame after syn_first, or -1
+  int64_t       touch_last;   // last touch frame after syn_first, or -1
+  bool          touch_lift;   // last touch frame ended a contact
+  uint64_t      gaps;
+  int64_t       gap_max;
+  analyze_key_t key[KEY_CNT];
+} analyze_dev_t;
+
+/** Smallest byte range worth a worker thread */
+#define ANALYZE_CHUNK_MIN (256 * 1024)
+
+/** Consecutive plausible record headers needed to resync */
+#define ANALYZE_RESYNC_RUN 8
+
+/** Chunk of a capture file analyzed by one worker */
+typedef struct
+{
+  pthread_t            thread;
+  const char          *path;
+  const char          *base;
+  size_t               size;
+  size_t               beg;      // offset of first record
+  size_t               stop;     // records from here on belong to next chunk
+  size_t               end;      // offset after last record
+  int                 *slot_dev; // device slot -> local device, -1 for none
+  analyze_dev_t      **pre;      // results of slots bound before the chunk
+  size_t               slots;
+  const evdev_caps_t **caps;     // devices bound within the chunk
+  analyze_dev_t      **local;    // results of those devices
+  int                  locals;
+  analyze_dev_t      **dev;      // all partial results by device id
+  int                  devs;
+} analyze_chunk_t;
+
+/** Allocate analysis results with nothing seen yet
+ */
+static analyze_dev_t *analyze_dev_create(void)
+{
+  analyze_dev_t *ad = calloc(1, sizeof *ad);
+
+  if( ad )
+  {
+    ad->first = ad->syn_first = ad->syn_last = -1;
+    ad->touch_first = ad->touch_last = -1;
+    for( int i = 0; i < KEY_CNT; ++i )
+    {
+      ad->key[i].first_up = ad->key[i].down = -1;
+    }
+  }
+  return ad;
+}
+
+/** Account frame interval
+ */
+static void analyze_interval(analyze_dev_t *ad, int64_t dt)
+{
+  ad->ivals     += 1;
+  ad->ival_sum  += dt;
+  ad->ival_sum2 += (double)dt * dt;
+  if( ad->ival_max < dt ) ad->ival_max = dt;
+}
+
+/** Account touch frame, checking for gap after previous one
+ *
+ * @param ad    analysis results
+ * @param t     SYN_REPORT time [us]
+ * @param flags frame flags
+ */
+static void analyze_touch(analyze_dev_t *ad, int64_t t, unsigned flags)
+{
+  if( !(flags & ANALYZE_TOUCH) )
+  {
+    return;
+  }
+  if( ad->touch_last != -1 && !ad->touch_lift )
+  {
+    int64_t dt = t - ad->touch_last;
+    if( dt > ANALYZE_GAP_US )
+    {
+      ad->gaps += 1;
+      if( ad->gap_max < dt ) ad->gap_max = dt;
+    }
+  }
+  if( ad->touch_first == -1 ) ad->touch_first = t;
+  ad->touch_last = t;
+  ad->touch_lift = (flags & ANALYZE_LIFT) != 0;
+}
+
+/** Analyze a batch of events within a chunk
+ *
+ * @param ad  partial results of the device
+ * @param eve array of input events
+ * @param n   number of events in eve
+ */
+static void analyze_events(analyze_dev_t *ad, const struct input_event *eve,
+                           int n)
+{
+  for( int i = 0; i < n; ++i )
+  {
+    const struct input_event *e = &eve[i];
+    int64_t t = e->time.tv_sec * INT64_C(1000000) + e->time.tv_usec;
+
+    if( e->type >= EV_CNT || e->code >= KEY_CNT )
+    {
+      continue;
+    }
+
+    ad->count[e->type][e->code] += 1;
+    if( ad->first == -1 ) ad->first = t;
+    ad->last = t;
+
+    switch( e->type )
+    {
+    case EV_SYN:
+      if( e->code != SYN_REPORT )
+      {
+        break;
+      }
+      ad->frames += 1;
+      if( ad->syn_first == -1 )
+      {
+        // frame started in an earlier chunk, merge deals with it
+        ad->syn_first = t;
+        ad->head = ad->tail;
+      }
+      else
+      {
+        analyze_interval(ad, t - ad->syn_last);
+        analyze_touch(ad, t, ad->tail);
+      }
+      ad->syn_last = t;
+      ad->tail = 0;
+      break;
+
+    case EV_ABS:
+      if( e->code >= ABS_MT_SLOT )
+      {
+        ad->tail |= ANALYZE_TOUCH;
+        if( e->code == ABS_MT_TRACKING_ID && e->value == -1 )
+        {
+          ad->tail |= ANALYZE_LIFT;
+        }
+      }
+      break;
+
+    case EV_KEY:
+      {
+        analyze_key_t *k = &ad->key[e->code];
+
+        if( e->code == BTN_TOUCH )
+        {
+          ad->tail |= ANALYZE_TOUCH | (e->value ? 0 : ANALYZE_LIFT);
+        }
+
+        if( e->value == 0 )
+        {
+          if( k->down != -1 )
+          {
+            if( k->hold_max < t - k->down ) k->hold_max = t - k->down;
+          }
+          else if( !k->seen )
+          {
+            k->first_up = t;
+          }
+          k->down = -1;
+          k->seen = true;
+        }
+        else if( e->value == 1 )
+        {
+          if( k->down == -1 ) k->down = t;
+          k->seen = true;
+        }
+        // autorepeat does not change the state
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+  ad->events += n;
+}
+
+/** Check whether a record header could be genuine
+ *
+ * @param head  record header candidate
+ * @param avail bytes from head to end of file
+ *
+ * @return true if the header is consistent with a record
+ */
+static bool analyze_plausible(const evrec_head_t *head, size_t avail)
+{
+  if( avail < sizeof *head ||
+      avail - sizeof *head < EVREC_ALIGN(head->size) ||
+      head->device >= EVREC_SLOTS_MAX )
+  {
+    return false;
+  }
+
+  switch( head->type )
+  {
+  case EVREC_DEVICE:
+    return head->size == sizeof (evdev_caps_t) && head->count == 0;
+  case EVREC_EVENTS:
+    return head->count > 0 &&
+           head->size == head->count * sizeof (struct input_event);
+  case EVREC_DELTA:
+    return head->count > 0 && head->size > 0 &&
+           head->size <= EVDELTA_BLOCK + EVDELTA_EVENT_MAX;
+  default:
+    return false;
+  }
+}
+
+/** Find first record at or after an offset that is not a record boundary
+ *
+ * @param base file contents
+ * @param size file size
+ * @param off  offset to start looking from
+ *
+ * @return offset of the first record that starts a run of plausible
+ *         ones, or size if there is none
+ */
+static size_t analyze_resync(const char *base, size_t size, size_t off)
+{
+  for( off = EVREC_ALIGN(off); off < size; off += 8 )
+  {
+    size_t at  = off;
+    int    run = 0;
+
+    // a run that reaches the end of file exactly counts as well
+    while( run < ANALYZE_RESYNC_RUN && at < size &&
+           analyze_plausible((const evrec_head_t *)(base + at), size - at) )
+    {
+      at += sizeof (evrec_head_t) +
+            EVREC_ALIGN(((const evrec_head_t *)(base + at))->size);
+      ++run;
+    }
+    if( run == ANALYZE_RESYNC_RUN || (run > 0 && at == size) )
+    {
+      break;
+    }
+  }
+  return (off < size) ? off : size;
+}
+
+/** Make room for a device slot in chunk state
+ *
+ * @return true on success, false if the slot is out of range or out of
+ *         memory
+ */
+static bool analyze_grow(analyze_chunk_t *ch, uint32_t slot)
+{
+  size_t         grow = slot + 1;
+  int           *sd;
+  analyze_dev_t **pre;
+
+  if( slot < ch->slots )
+  {
+    return true;
+  }
+  if( slot >= EVREC_SLOTS_MAX )
+  {
+    return false;
+  }
+  if( !(sd = realloc(ch->slot_dev, grow * sizeof *sd)) )
+  {
+    return false;
+  }
+  ch->slot_dev = sd;
+  if( !(pre = realloc(ch->pre, grow * sizeof *pre)) )
+  {
+    return false;
+  }
+  ch->pre = pre;
+  for( ; ch->slots < grow; ++ch->slots )
+  {
+    ch->slot_dev[ch->slots] = -1;
+    ch->pre[ch->slots]      = 0;
+  }
+  return true;
+}
+
+/** Handle events decoded from a chunk
+ *
+ * Matches evrec_sink_t, ctx is an analyze_chunk_t.
+ */
+static void analyze_sink(void *ctx, uint32_t slot, const struct timeval *tv,
+                         const struct input_event *eve, int n)
+{
+  analyze_chunk_t *ch = ctx;
+  analyze_dev_t  **ad;
+
+  (void)tv;
+
+  if( !analyze_grow(ch, slot) )
+  {
+    return;
+  }
+  if( ch->slot_dev[slot] != -1 )
+  {
+    ad = &ch->local[ch->slot_dev[slot]];
+  }
+  else
+  {
+    ad = &ch->pre[slot];
+  }
+  if( !*ad && !(*ad = analyze_dev_create()) )
+  {
+    return;
+  }
+  analyze_events(*ad, eve, n);
+}
+
+/** Bind device slot to device record within a chunk
+ */
+static void analyze_bind(analyze_chunk_t *ch, const evrec_head_t *head)
+{
+  const evdev_caps_t **caps;
+  analyze_dev_t      **local;
+
+  if( !analyze_grow(ch, head->device) )
+  {
+    return;
+  }
+  if( !(caps = realloc(ch->caps, (ch->locals + 1) * sizeof *caps)) )
+  {
+    return;
+  }
+  ch->caps = caps;
+  if( !(local = realloc(ch->local, (ch->locals + 1) * sizeof *local)) )
+  {
+    return;
+  }
+  ch->local = local;
+  ch->caps[ch->locals]      = (const evdev_caps_t *)(head + 1);
+  ch->local[ch->locals]     = 0;
+  ch->slot_dev[head->device] = ch->locals++;
+}
+
+/** Forget everything a chunk has been analyzed into
+ */
+static void analyze_reset(analyze_chunk_t *ch)
+{
+  for( size_t i = 0; i < ch->slots; ++i )
+  {
+    free(ch->pre[i]);
+  }
+  for( int i = 0; i < ch->locals; ++i )
+  {
+    free(ch->local[i]);
+  }
+  for( int i = 0; i < ch->devs; ++i )
+  {
+    free(ch->dev[i]);
+  }
+  free(ch->slot_dev), ch->slot_dev = 0;
+  free(ch->pre), ch->pre = 0;
+  free(ch->caps), ch->caps = 0;
+  free(ch->local), ch->local = 0;
+  free(ch->dev), ch->dev = 0;
+  ch->slots  = 0;
+  ch->locals = 0;
+  ch->devs   = 0;
+}
+
+/** Worker thread entry point, analyzes one chunk
+ */
+static void *analyze_main(void *aptr)
+{
+  analyze_chunk_t    *ch  = aptr;
+  size_t              off = ch->beg;
+  const evrec_head_t *head;
+
+  while( off < ch->stop && (head = evrec_next(ch->path, ch->base, ch->size,
+                                              &off)) )
+  {
+    if( head->type == EVREC_DEVICE && head->size == sizeof (evdev_caps_t) )
+    {
+      analyze_bind(ch, head);
+    }
+    else if( head->type == EVREC_EVENTS &&
+             head->size == head->count * sizeof (struct input_event) )
+    {
+      analyze_sink(ch, head->device, 0,
+                   (const struct input_event *)(head + 1), head->count);
+    }
+    else if( head->type == EVREC_DELTA &&
+             evdelta_decode(head, analyze_sink, ch) == -1 )
+    {
+      mce_log(LL_WARN, "%s: corrupted record at offset %zu", ch->path,
+              off - sizeof *head - EVREC_ALIGN(head->size));
+    }
+  }
+  ch->end = (off < ch->stop) ? ch->size : off;
+  return 0;
+}
+
+/** Worker thread entry point, finds the first record and analyzes chunk
+ */
+static void *analyze_start(void *aptr)
+{
+  analyze_chunk_t *ch = aptr;
+
+  if( ch->beg != sizeof (evrec_file_t) )
+  {
+    ch->beg = analyze_resync(ch->base, ch->size, ch->beg);
+  }
+  return analyze_main(ch);
+}
+
+/** Merge partial results of a chunk into results of preceding chunks
+ *
+ * @param ad   merged results so far
+ * @param part partial results of the next chunk
+ */
+static void analyze_merge(analyze_dev_t *ad, const analyze_dev_t *part)
+{
+  for( int etype = 0; etype < EV_CNT; ++etype )
+  {
+    for( int ecode = 0; ecode < KEY_CNT; ++ecode )
+    {
+      ad->count[etype][ecode] += part->count[etype][ecode];
+    }
+  }
+  ad->events += part->events;
+  if( part->first != -1 )
+  {
+    if( ad->first == -1 ) ad->first = part->first;
+    ad->last = part->last;
+  }
+
+  if( part->syn_first == -1 )
+  {
+    // whole chunk is within one frame
+    ad->tail |= part->tail;
+  }
+  else
+  {
+    // stitch the frame that was cut by the chunk boundary
+    if( ad->syn_last != -1 )
+    {
+      analyze_interval(ad, part->syn_first - ad->syn_last);
+    }
+    analyze_touch(ad, part->syn_first, ad->tail | part->head);
+    if( part->touch_first != -1 )
+    {
+      analyze_touch(ad, part->touch_first, ANALYZE_TOUCH);
+      ad->touch_last = part->touch_last;
+      ad->touch_lift = part->touch_lift;
+    }
+    if( ad->syn_first == -1 ) ad->syn_first = part->syn_first;
+    ad->syn_last   = part->syn_last;
+    ad->tail       = part->tail;
+    ad->frames    += part->frames;
+    ad->ivals     += part->ivals;
+    ad->ival_sum  += part->ival_sum;
+    ad->ival_sum2 += part->ival_sum2;
+    if( ad->ival_max < part->ival_max ) ad->ival_max = part->ival_max;
+    ad->gaps      += part->gaps;
+    if( ad->gap_max < part->gap_max ) ad->gap_max = part->gap_max;
+  }
+
+  for( int i = 0; i < KEY_CNT; ++i )
+  {
+    analyze_key_t       *k = &ad->key[i];
+    const analyze_key_t *p = &part->key[i];
+
+    if( p->first_up != -1 && k->down != -1 &&
+        k->hold_max < p->first_up - k->down )
+    {
+      k->hold_max = p->first_up - k->down;
+    }
+    if( k->hold_max < p->hold_max ) k->hold_max = p->hold_max;
+    if( p->seen )
+    {
+      k->down = p->down;
+      k->seen = true;
+    }
+  }
+}
+
+/** Print analysis results of a device
+ *
+ * @param caps device capabilities from the capture file
+ * @param ad   merged analysis results
+ */
+static void analyze_report(const evdev_caps_t *caps, const analyze_dev_t *ad)
+{
+  struct { int type, code; uint64_t cnt; } top[ANALYZE_TOP];
+  int    tops  = 0;
+  int    stuck = 0;
+  double secs  = (ad->last - ad->first) * 1e-6;
+
+  if( secs <= 0 ) secs = 1e-6;
+
+  printf("%s \"%s\"\n", caps->path, caps->name);
+  printf("  %.3f s, %llu events (%.1f/s), %llu frames (%.1f/s)\n", secs,
+         (unsigned long long)ad->events, ad->events / secs,
+         (unsigned long long)ad->frames, ad->frames / secs);
+
+  if( ad->ivals )
+  {
+    double mean = ad->ival_sum / ad->ivals;
+    double var  = ad->ival_sum2 / ad->ivals - mean * mean;
+    printf("  frame interval: mean %.3f ms, jitter %.3f ms, max %.3f ms\n",
+           mean * 1e-3, sqrt(var > 0 ? var : 0) * 1e-3, ad->ival_max * 1e-3);
+  }
+
+  if( ad->touch_first != -1 )
+  {
+    printf("  touch frame gaps over %lld ms: %llu, longest %.3f ms\n",
+           (long long)(ANALYZE_GAP_US / 1000), (unsigned long long)ad->gaps,
+           ad->gap_max * 1e-3);
+  }
+
+  for( int i = 0; i < KEY_CNT; ++i )
+  {
+    const analyze_key_t *k    = &ad->key[i];
+    int64_t              held = (k->down != -1) ? ad->last - k->down : 0;
+
+    if( k->hold_max < ANALYZE_STUCK_US && held < ANALYZE_STUCK_US )
+    {
+      continue;
+    }
+    printf("%s %s %.1f s%s", stuck++ ? "," : "  stuck keys:",
+           evdev_get_event_code_name(EV_KEY, i),
+           (held > k->hold_max ? held : k->hold_max) * 1e-6,
+           (k->down != -1) ? " (down at end)" : "");
+  }
+  if( stuck )
+  {
+    printf("\n");
+  }
+
+  // pick busiest codes with insertion sort
+  for( int etype = 0; etype < EV_CNT; ++etype )
+  {
+    for( int ecode = 0; ecode < KEY_CNT; ++ecode )
+    {
+      uint64_t cnt = ad->count[etype][ecode];
+      int      pos = tops;
+
+      if( !cnt || (tops == ANALYZE_TOP && top[tops - 1].cnt >= cnt) )
+      {
+        continue;
+      }
+      if( tops < ANALYZE_TOP ) ++tops;
+      for( ; pos > 0 && top[pos - 1].cnt < cnt; --pos )
+      {
+        if( pos < ANALYZE_TOP ) top[pos] = top[pos - 1];
+      }
+      top[pos].type = etype, top[pos].code = ecode, top[pos].cnt = cnt;
+    }
+  }
+
+  for( int i = 0; i < tops; ++i )
+  {
+    printf("  %-8s %-24s %12llu %10.1f/s\n",
+           evdev_get_event_type_name(top[i].type),
+           evdev_get_event_code_name(top[i].type, top[i].code),
+           (unsigned long long)top[i].cnt, top[i].cnt / secs);
+  }
+  printf("\n");
+}
+
+/** Analyze capture file using all cpu cores
+ *
+ * @param path capture file path
+ *
+ * @return 0 on success, or -1 in case of errors
+ */
+static int analyze_file(const char *path)
+{
+  int                  err      = -1;
+  size_t               size     = 0;
+  const char          *base     = evrec_map(path, &size);
+  long                 cpus     = sysconf(_SC_NPROCESSORS_ONLN);
+  int                  cnt      = (cpus < 1) ? 1 : (cpus > 64) ? 64 : cpus;
+  analyze_chunk_t     *ch       = 0;
+  const evdev_caps_t **caps     = 0;
+  int                  devs     = 0;
+  int                 *slot_dev = 0;
+  size_t               data     = size - sizeof (evrec_file_t);
+  int64_t              started  = monotime();
+
+  if( !base || !(ch = calloc(cnt, sizeof *ch)) ||
+      !(slot_dev = malloc(EVREC_SLOTS_MAX * sizeof *slot_dev)) )
+  {
+    goto cleanup;
+  }
+
+  if( (size_t)cnt > data / ANALYZE_CHUNK_MIN + 1 )
+  {
+    cnt = data / ANALYZE_CHUNK_MIN + 1;
+  }
+
+  for( int i = 0; i < cnt; ++i )
+  {
+    analyze_chunk_t *c = &ch[i];
+
+    c->path = path;
+    c->base = base;
+    c->size = size;
+    c->beg  = i ? ch[i - 1].stop : sizeof (evrec_file_t);
+    c->stop = (i < cnt - 1) ? c->beg + data / cnt : size;
+  }
+
+  for( int i = 0; i < cnt; ++i )
+  {
+    if( pthread_create(&ch[i].thread, 0, analyze_start, &ch[i]) )
+    {
+      // run in the main thread instead
+      analyze_start(&ch[i]);
+      ch[i].thread = pthread_self();
+    }
+  }
+
+  for( int i = 0; i < cnt; ++i )
+  {
+    if( !pthread_equal(ch[i].thread, pthread_self()) )
+    {
+      pthread_join(ch[i].thread, 0);
+    }
+  }
+
+  // redo chunks that did not start where the previous one ended
+  for( int i = 1; i < cnt; ++i )
+  {
+    if( ch[i].beg != ch[i - 1].end )
+    {
+      mce_log(LL_DEBUG, "%s: resync at %zu was off, redoing chunk %d", path,
+              ch[i].beg, i);
+      analyze_reset(&ch[i]);
+      ch[i].beg = ch[i - 1].end;
+      if( ch[i].stop < ch[i].beg ) ch[i].stop = ch[i].beg;
+      analyze_main(&ch[i]);
+    }
+  }
+
+  // number devices in file order and attribute events of slots bound
+  // before each chunk
+  for( int i = 0; i < EVREC_SLOTS_MAX; ++i )
+  {
+    slot_dev[i] = -1;
+  }
+  for( int i = 0; i < cnt; ++i )
+  {
+    analyze_chunk_t     *c    = &ch[i];
+    const evdev_caps_t **grow = realloc(caps, (devs + c->locals + 1) *
+                                        sizeof *caps);
+
+    if( !grow )
+    {
+      mce_log(LL_ERR, "%s: %m", "realloc");
+      goto cleanup;
+    }
+    caps = grow;
+
+    if( !(c->dev = calloc(devs + c->locals + 1, sizeof *c->dev)) )
+    {
+      mce_log(LL_ERR, "%s: %m", "calloc");
+      goto cleanup;
+    }
+    c->devs = devs + c->locals;
+
+    for( size_t slot = 0; slot < c->slots; ++slot )
+    {
+      if( c->pre[slot] && slot_dev[slot] != -1 )
+      {
+        c->dev[slot_dev[slot]] = c->pre[slot], c->pre[slot] = 0;
+      }
+      if( c->slot_dev[slot] != -1 )
+      {
+        slot_dev[slot] = devs + c->slot_dev[slot];
+      }
+    }
+    for( int j = 0; j < c->locals; ++j )
+    {
+      caps[devs] = c->caps[j];
+      c->dev[devs++] = c->local[j], c->local[j] = 0;
+    }
+  }
+
+  for( int id = 0; id < devs; ++id )
+  {
+    analyze_dev_t *ad = analyze_dev_create();
+
+    // chunks before the binding have shorter result arrays
+    for( int i = 0; ad && i < cnt; ++i )
+    {
+      if( id < ch[i].devs && ch[i].dev[id] )
+      {
+        analyze_merge(ad, ch[i].dev[id]);
+      }
+    }
+    if( ad && ad->events )
+    {
+      analyze_report(caps[id], ad);
+    }
+    free(ad);
+  }
+
+  printf("%s: %.1f MB, %d devices, analyzed in %.3f s using %d threads\n",
+         path, size / 1e6, devs, (monotime() - started) * 1e-9, cnt);
+  err = 0;
+
+cleanup:
+  for( int i = 0; ch && i < cnt; ++i )
+  {
+    analyze_reset(&ch[i]);
+  }
+  free(ch);
+  free(caps);
+  free(slot_dev);
+  if( base ) munmap((void *)base, size);
+
+  return err;
+}
+
+/** Flag for: leave the mainloop */
+static volatile sig_atomic_t mainloop_quit = 0;
+
+/** Signal handler for terminating the mainloop
+ */
+static void mainloop_quit_cb(int sig)
+{
+  (void)sig;
+  mainloop_quit = 1;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Latency histograms
+ *
+ * In latency mode devices are switched to CLOCK_MONOTONIC time stamps
+ * and for every event the time between the kernel stamping it and
+ * userspace reading it is collected into log-linear histograms, one
+ * per device and event type. Each power of two range is split into
+ * 2^LATENCY_SUB_BITS buckets, which keeps the relative error of the
+ * reported percentiles under ~6% regardless of magnitude.
+ * ------------------------------------------------------------------------- */
+
+/** Log2 of number of histogram buckets per power of two */
+#define LATENCY_SUB_BITS 4
+
+/** Number of histogram buckets needed for covering 64 bit values */
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+/** Per device latency statistics */
+typedef struct
+{
+  char     *path;
+  bool      realtime;    // EVIOCSCLOCKID failed, stamps are CLOCK_REALTIME
+  uint64_t  cnt[EV_CNT];
+  uint64_t  sum[EV_CNT];
+  uint64_t  max[EV_CNT];
+  uint32_t *hist[EV_CNT]; // allocated on first use
+} latency_t;
+
+/** Flag for: collect latency statistics instead of showing events */
+static bool latency_mode = false;
+
+/** Latency statistics, indexed by device slot */
+static latency_t **latency_lut = 0;
+
+/** Number of slots in latency_lut */
+static int latency_cnt = 0;
+
+/** Map latency value to histogram bucket
+ */
+static int latency_bucket(uint64_t val)
+{
+  if( val < (1u << LATENCY_SUB_BITS) )
+  {
+    return (int)val;
+  }
+  int msb   = 63 - __builtin_clzll(val);
+  int shift = msb - LATENCY_SUB_BITS;
+  return ((shift + 1) << LATENCY_SUB_BITS) +
+    (int)((val >> shift) - (1u << LATENCY_SUB_BITS));
+}
+
+/** Map histogram bucket to the highest value it covers
+ */
+static uint64_t latency_bucket_max(int bucket)
+{
+  if( bucket < (1 << LATENCY_SUB_BITS) )
+  {
+    return bucket;
+  }
+  int      shift = (bucket >> LATENCY_SUB_BITS) - 1;
+  uint64_t sub   = bucket & ((1 << LATENCY_SUB_BITS) - 1);
+  return (((1u << LATENCY_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+/** Get latency value below which given fraction of samples fall
+ */
+static uint64_t latency_percentile(const latency_t *lat, int etype, double p)
+{
+  uint64_t want = (uint64_t)(lat->cnt[etype] * p + 0.5);
+  uint64_t seen = 0;
+
+  if( want < 1 ) want = 1;
+
+  for( int i = 0; i < LATENCY_BUCKETS; ++i )
+  {
+    if( (seen += lat->hist[etype][i]) >= want )
+    {
+      uint64_t val = latency_bucket_max(i);
+      return (val < lat->max[etype]) ? val : lat->max[etype];
+    }
+  }
+  return lat->max[etype];
+}
+
+/** Start collecting latency statistics for a device
+ *
+ * @param slot device slot
+ * @param fd   input device file descriptor
+ * @param path input device path
+ */
+static void latency_attach(int slot, int fd, const char *path)
+{
+  int       clk = CLOCK_MONOTONIC;
+  latency_t *lat = calloc(1, sizeof *lat);
+
+  lat->path = strdup(path);
+
+  if( ioctl(fd, EVIOCSCLOCKID, &clk) == -1 )
+  {
+    mce_log(LL_WARN, "%s: EVIOCSCLOCKID: %m; using CLOCK_REALTIME", path);
+    lat->realtime = true;
+  }
+
+  if( slot >= latency_cnt )
+  {
+    latency_lut = realloc(latency_lut, (slot + 1) * sizeof *latency_lut);
+    memset(latency_lut + latency_cnt, 0,
+           (slot + 1 - latency_cnt) * sizeof *latency_lut);
+    latency_cnt = slot + 1;
+  }
+  latency_lut[slot] = lat;
+}
+
+/** Collect latency statistics from a batch of events
+ *
+ * @param slot  device slot
+ * @param stamp monotonic read time [ns]
+ * @param tv    time of day when the events were read
+ * @param eve   array of input events
+ * @param n     number of events in eve
+ */
+static void latency_add(int slot, int64_t stamp, const struct timeval *tv,
+                        const struct input_event *eve, int n)
+{
+  latency_t *lat = (slot < latency_cnt) ? latency_lut[slot] : 0;
+  int64_t    now;
+
+  if( !lat )
+  {
+    return;
+  }
+
+  now = lat->realtime ? tv->tv_sec * INT64_C(1000000) + tv->tv_usec
+                      : stamp / 1000;
+
+  for( int i = 0; i < n; ++i )
+  {
+    unsigned etype = eve[i].type;
+    int64_t  diff  = now - (eve[i].time.tv_sec * INT64_C(1000000) +
+                            eve[i].time.tv_usec);
+    uint64_t val   = (diff > 0) ? (uint64_t)diff : 0;
+
+    if( etype >= EV_CNT )
+    {
+      continue;
+    }
+
+    if( !lat->hist[etype] &&
+        !(lat->hist[etype] = calloc(LATENCY_BUCKETS, sizeof (uint32_t))) )
+    {
+      continue;
+    }
+
+    lat->hist[etype][latency_bucket(val)] += 1;
+    lat->cnt[etype] += 1;
+    lat->sum[etype] += val;
+    if( lat->max[etype] < val ) lat->max[etype] = val;
+  }
+}
+
+/** Print latency statistics of a device
+ *
+ * @param slot device slot
+ */
+static void latency_report(int slot)
+{
+  latency_t *lat = (slot < latency_cnt) ? latency_lut[slot] : 0;
+
+  if( !lat )
+  {
+    return;
+  }
+
+  printf("%s: latency [us]%s\n", lat->path,
+         lat->realtime ? " (CLOCK_REALTIME)" : "");
+
+  for( int etype = 0; etype < EV_CNT; ++etype )
+  {
+    if( !lat->cnt[etype] )
+    {
+      continue;
+    }
+    printf("  %-8s count %10llu  avg %7llu  p50 %7llu  p99 %7llu"
+           "  p999 %7llu  max %7llu\n",
+           evdev_get_event_type_name(etype),
+           (unsigned long long)lat->cnt[etype],
+           (unsigned long long)(lat->sum[etype] / lat->cnt[etype]),
+           (unsigned long long)latency_percentile(lat, etype, 0.50),
+           (unsigned long long)latency_percentile(lat, etype, 0.99),
+           (unsigned long long)latency_percentile(lat, etype, 0.999),
+           (unsigned long long)lat->max[etype]);
+  }
+  fflush(stdout);
+}
+
+/** Print latency statistics of all devices
+ */
+static void latency_report_all(void)
+{
+  for( int slot = 0; slot < latency_cnt; ++slot )
+  {
+    latency_report(slot);
+  }
+}
+
+/** Print final latency statistics of a device and stop collecting
+ *
+ * @param slot device slot
+ */
+static void latency_detach(int slot)
+{
+  latency_t *lat = (slot < latency_cnt) ? latency_lut[slot] : 0;
+
+  if( lat )
+  {
+    latency_report(slot);
+    for( int etype = 0; etype < EV_CNT; ++etype )
+    {
+      free(lat->hist[etype]);
+    }
+    free(lat->path);
+    free(lat);
+    latency_lut[slot] = 0;
+  }
+}
+
+/* ------------------------------------------------------------------------- *
+ * Rate statistics
+ *
+ * In stats mode nothing is shown per event. Events are just counted in
+ * flat per device arrays indexed by type and code, and every report
+ * interval a summary of event rates, SYN_REPORT rates, the busiest
+ * event codes and SYN_DROPPED counts is drawn, one line per device.
+ * ------------------------------------------------------------------------- */
+
+/** Number of busiest codes to consider per device */
+#define STATS_TOP 8
+
+/** Per device event counters */
+typedef struct
+{
+  char     *path;
+  uint64_t  total;   // events since attach
+  uint64_t  dropped; // SYN_DROPPED since attach
+  uint32_t  events;  // events during current interval
+  uint32_t  reports; // SYN_REPORT during current interval
+  uint32_t  count[EV_CNT][KEY_CNT]; // events during current interval
+} stats_t;
+
+/** Flag for: show rate statistics instead of events */
+static bool stats_mode = false;
+
+/** Event counters, indexed by device slot */
+static stats_t **stats_lut = 0;
+
+/** Number of slots in stats_lut */
+static int stats_cnt = 0;
+
+/** Time of previous stats report [ns] */
+static int64_t stats_prev = 0;
+
+/** Start counting events from a device
+ *
+ * @param slot device slot
+ * @param path input device path
+ */
+static void stats_attach(int slot, const char *path)
+{
+  stats_t *st = calloc(1, sizeof *st);
+
+  st->path = strdup(path);
+
+  if( slot >= stats_cnt )
+  {
+    stats_lut = realloc(stats_lut, (slot + 1) * sizeof *stats_lut);
+    memset(stats_lut + stats_cnt, 0,
+           (slot + 1 - stats_cnt) * sizeof *stats_lut);
+    stats_cnt = slot + 1;
+  }
+  stats_lut[slot] = st;
+
+  if( !stats_prev )
+  {
+    stats_prev = monotime();
+  }
+}
+
+/** Stop counting events from a device
+ *
+ * @param slot device slot
+ */
+static void stats_detach(int slot)
+{
+  if( slot < stats_cnt && stats_lut[slot] )
+  {
+    free(stats_lut[slot]->path);
+    free(stats_lut[slot]);
+    stats_lut[slot] = 0;
+  }
+}
+
+/** Count a batch of events
+ *
+ * @param slot device slot
+ * @param eve  array of input events
+ * @param n    number of events in eve
+ */
+static void stats_add(int slot, const struct input_event *eve, int n)
+{
+  stats_t *st = (slot < stats_cnt) ? stats_lut[slot] : 0;
+
+  if( !st )
+  {
+    return;
+  }
+
+  st->events += n;
+  st->total  += n;
+
+  for( int i = 0; i < n; ++i )
+  {
+    unsigned etype = eve[i].type;
+    unsigned ecode = eve[i].code;
+
+    if( etype < EV_CNT && ecode < KEY_CNT )
+    {
+      st->count[etype][ecode] += 1;
+    }
+    if( etype == EV_SYN )
+    {
+      if( ecode == SYN_REPORT )  st->reports += 1;
+      if( ecode == SYN_DROPPED ) st->dropped += 1;
+    }
+  }
+}
+
+/** Draw rate statistics of all devices and start a new interval
+ */
+static void stats_report(void)
+{
+  int     cols = get_terminal_width();
+  int64_t now  = monotime();
+  double  secs = (now - stats_prev) * 1e-9;
+  bool    tty  = isatty(STDOUT_FILENO);
+  char    line[1024];
+
+  if( cols >= (int)sizeof line ) cols = sizeof line - 1;
+  if( secs <= 0 ) secs = 1;
+  stats_prev = now;
+
+  // home cursor and clear screen so that the summary stays in place
+  printf("%s%.*s\n", tty ? "\033[H\033[J" : "", cols,
+         "DEVICE                    EV/S   SYN/S  DROPPED  TOP CODES/S");
+
+  for( int slot = 0; slot < stats_cnt; ++slot )
+  {
+    stats_t *st = stats_lut[slot];
+    struct { int type, code; uint32_t cnt; } top[STATS_TOP];
+    int      tops = 0;
+    int      len;
+
+    if( !st )
+    {
+      continue;
+    }
+
+    // pick busiest codes with insertion sort
+    for( int etype = 0; etype < EV_CNT; ++etype )
+    {
+      for( int ecode = 0; ecode < KEY_CNT; ++ecode )
+      {
+        uint32_t cnt = st->count[etype][ecode];
+        int      pos = tops;
+
+        if( !cnt || (tops == STATS_TOP && top[tops - 1].cnt >= cnt) )
+        {
+          continue;
+        }
+        if( tops < STATS_TOP ) ++tops;
+        for( ; pos > 0 && top[pos - 1].cnt < cnt; --pos )
+        {
+          if( pos < STATS_TOP ) top[pos] = top[pos - 1];
+        }
+        top[pos].type = etype, top[pos].code = ecode, top[pos].cnt = cnt;
+      }
+    }
+
+    len = snprintf(line, sizeof line, "%-22.22s %7.0f %7.0f %8llu ",
+                   st->path, st->events / secs, st->reports / secs,
+                   (unsigned long long)st->dropped);
+
+    // add as many top codes as fit on the line
+    for( int i = 0; i < tops && len < cols; ++i )
+    {
+      char item[64];
+      int  add = snprintf(item, sizeof item, " %s %.0f",
+                          evdev_get_event_code_name(top[i].type, top[i].code),
+                          top[i].cnt / secs);
+      if( len + add > cols ) break;
+      memcpy(line + len, item, add + 1);
+      len += add;
+    }
+    if( len > cols ) len = cols;
+    printf("%.*s\n", len, line);
+
+    st->events = st->reports = 0;
+    memset(st->count, 0, sizeof st->count);
+  }
+  fflush(stdout);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Shared memory publishing
+ *
+ * In publish mode events are not shown but copied into a shared memory
+ * ring, see evshm.h for the layout and the client side. Device slots
+ * double as ring device slots, so only the first EVSHM_DEVICES slots
+ * get their path and name published.
+ * ------------------------------------------------------------------------- */
+
+/** Default number of ring entries */
+#define EVSHM_ENTRIES 65536
+
+/** Shared memory object name, or NULL when not publishing */
+static const char *evshm_name = 0;
+
+/** Group allowed to read the ring, or NULL for owner only access
+ *
+ * The ring carries every keystroke, so it must not be more widely
+ * readable than the input devices themselves.
+ */
+static const char *evshm_group = 0;
+
+/** Shared memory object path, valid while publishing */
+static char evshm_shm_path[256];
+
+/** Control object path, valid while publishing */
+static char evshm_ctl_shm_path[256];
+
+/** Published ring, or NULL when not publishing */
+static evshm_ring_t *evshm_ring = 0;
+
+/** Control object shared with waiting clients, or NULL */
+static evshm_ctl_t *evshm_ctl = 0;
+
+/** Position of next event to publish */
+static uint64_t evshm_head = 0;
+
+/** Interval between wake ups while the waiter count is stale [ns] */
+#define EVSHM_STALE_NS (10 * INT64_C(1000000))
+
+/** Time before which no wake up is made, or 0 while the count is trusted
+ *
+ * A client killed in evshm_wait(), or any group member writing the
+ * control object, can leave the waiter count nonzero with nobody
+ * waiting. A wake up that reaches nobody marks the count stale, and
+ * until one reaches somebody again, wake ups are rate limited.
+ */
+static int64_t evshm_stale_until = 0;
+
+/** Create and map a fresh shared memory object
+ *
+ * @param path  shared memory object path
+ * @param size  object size
+ * @param grp   group to give access to, or NULL for owner only
+ * @param mode  group permission bits to use with grp
+ *
+ * @return mapping, or NULL in case of errors
+ */
+static void *evshm_map_new(const char *path, size_t size,
+                           const struct group *grp, mode_t mode)
+{
+  int   fd   = -1;
+  void *base = MAP_FAILED;
+
+  // start from scratch, clients of a previous run keep their old mapping
+  shm_unlink(path);
+
+  if( (fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1 ||
+      (grp && (fchown(fd, -1, grp->gr_gid) == -1 ||
+               fchmod(fd, 0600 | mode) == -1)) ||
+      ftruncate(fd, size) == -1 ||
+      (base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0)) == MAP_FAILED )
+  {
+    mce_log(LL_ERR, "%s: shared memory: %m", path);
+    if( fd != -1 ) shm_unlink(path);
+  }
+
+  if( fd != -1 ) close(fd);
+  return (base == MAP_FAILED) ? 0 : base;
+}
+
+/** Create shared memory ring
+ *
+ * @param name shared memory object name
+ *
+ * @return 0 on success, or -1 in case of errors
+ */
+static int evshm_create(const char *name)
+{
+  struct group *grp  = 0;
+
+  evshm_path(name, evshm_shm_path, sizeof evshm_shm_path);
+  evshm_ctl_path(name, evshm_ctl_shm_path, sizeof evshm_ctl_shm_path);
+
+  if( evshm_group && !(grp = getgrnam(evshm_group)) )
+  {
+    mce_log(LL_ERR, "%s: unknown group", evshm_group);
+    goto cleanup;
+  }
+
+  // the group may read the ring, but must write the waiter count
+  if( !(evshm_ctl = evshm_map_new(evshm_ctl_shm_path, sizeof *evshm_ctl,
+                                  grp, 0060)) )
+  {
+    goto cleanup;
+  }
+
+  if( !(evshm_ring = evshm_map_new(evshm_shm_path,
+                                   evshm_size(EVSHM_ENTRIES), grp, 0040)) )
+  {
+    goto cleanup;
+  }
+
+  evshm_ring->version = EVSHM_VERSION;
+  evshm_ring->entries = EVSHM_ENTRIES;
+  __atomic_store_n(&evshm_ring->magic, EVSHM_MAGIC, __ATOMIC_RELEASE);
+
+cleanup:
+  if( !evshm_ring && evshm_ctl )
+  {
+    munmap(evshm_ctl, sizeof *evshm_ctl), evshm_ctl = 0;
+    shm_unlink(evshm_ctl_shm_path);
+  }
+  return evshm_ring ? 0 : -1;
+}
+
+/** Remove shared memory ring
+ */
+static void evshm_destroy(void)
+{
+  if( evshm_ring )
+  {
+    munmap(evshm_ring, evshm_size(EVSHM_ENTRIES)), evshm_ring = 0;
+    shm_unlink(evshm_shm_path);
+  }
+  if( evshm_ctl )
+  {
+    munmap(evshm_ctl, sizeof *evshm_ctl), evshm_ctl = 0;
+    shm_unlink(evshm_ctl_shm_path);
+  }
+}
+
+/** Publish device slot description
+ *
+ * @param slot device slot
+ * @param fd   input device file descriptor, or -1 when detaching
+ * @param path input device path
+ */
+static void evshm_set_device(int slot, int fd, const char *path)
+{
+  evshm_dev_t *dev;
+  char         name[sizeof dev->name] = "";
+
+  if( !evshm_ring || slot >= EVSHM_DEVICES )
+  {
+    return;
+  }
+
+  // clients spin while seq is odd, so query the device before that
+  if( fd != -1 && ioctl(fd, EVIOCGNAME(sizeof name - 1), name) == -1 )
+  {
+    mce_log(LL_WARN, "%s: EVIOCGNAME: %m", path);
+  }
+
+  dev = &evshm_ring->dev[slot];
+  __atomic_store_n(&dev->seq, dev->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  dev->attached = (fd != -1);
+  if( fd != -1 )
+  {
+    memcpy(dev->name, name, sizeof dev->name);
+    snprintf(dev->path, sizeof dev->path, "%s", path);
+  }
+
+  __atomic_store_n(&dev->seq, dev->seq + 1, __ATOMIC_RELEASE);
+}
+
+/** Publish a batch of events
+ *
+ * @param slot device slot
+ * @param eve  array of input events
+ * @param n    number of events in eve
+ */
+static void evshm_publish(int slot, const struct input_event *eve, int n)
+{
+  uint32_t mask = evshm_ring->entries - 1;
+
+  for( int i = 0; i < n; ++i, ++evshm_head )
+  {
+    evshm_entry_t *e = &evshm_ring->ring[evshm_head & mask];
+
+    __atomic_store_n(&e->seq, 2 * evshm_head + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&e->sec,    eve[i].time.tv_sec,  __ATOMIC_RELAXED);
+    __atomic_store_n(&e->usec,   eve[i].time.tv_usec, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->type,   eve[i].type,         __ATOMIC_RELAXED);
+    __atomic_store_n(&e->code,   eve[i].code,         __ATOMIC_RELAXED);
+    __atomic_store_n(&e->value,  eve[i].value,        __ATOMIC_RELAXED);
+    __atomic_store_n(&e->device, slot,                __ATOMIC_RELAXED);
+
+    __atomic_store_n(&e->seq, 2 * evshm_head + 2, __ATOMIC_RELEASE);
+  }
+
+  // Publish the head before looking at the waiter count, evshm_wait()
+  // does the opposite; the system call is made only when someone sleeps
+  __atomic_store_n(&evshm_ring->head, evshm_head, __ATOMIC_SEQ_CST);
+  if( __atomic_load_n(&evshm_ctl->waiters, __ATOMIC_SEQ_CST) )
+  {
+    int64_t now = evshm_stale_until ? monotime() : 0;
+
+    if( now < evshm_stale_until )
+    {
+      return;
+    }
+    __atomic_add_fetch(&evshm_ctl->futex, 1, __ATOMIC_RELEASE);
+    if( syscall(SYS_futex, &evshm_ctl->futex, FUTEX_WAKE, INT_MAX,
+                0, 0, 0) > 0 )
+    {
+      evshm_stale_until = 0;
+    }
+    else
+    {
+      evshm_stale_until = (now ?: monotime()) + EVSHM_STALE_NS;
+    }
+  }
+}
+
+/** Follow events published by another evdev_trace instance
+ *
+ * @param name shared memory object name
+ *
+ * @return 0 on success, or -1 in case of errors
+ */
+static int evshm_follow(const char *name)
+{
+  static evshm_event_t eve[256];
+  static struct input_event batch[256];
+
+  evshm_client_t cl;
+  uint64_t       lost = 0;
+
+  if( evshm_attach(&cl, name) == -1 )
+  {
+    mce_log(LL_ERR, "%s: can't attach: %m", name);
+    return -1;
+  }
+
+  while( !mainloop_quit )
+  {
+    int n = evshm_read(&cl, eve, numof(eve));
+
+    if( cl.lost != lost )
+    {
+      mce_log(LL_WARN, "%s: %llu events lost", name,
+              (unsigned long long)(cl.lost - lost));
+      lost = cl.lost;
+    }
+
+    if( n == 0 )
+    {
+      evshm_wait(&cl, 1000);
+      continue;
+    }
+
+    // show runs of events from the same device as one batch
+    for( int i = 0, k = 0; i < n; i = k )
+    {
+      char           path[128] = "";
+      struct timeval tv;
+      int            cnt = 0;
+
+      for( k = i; k < n && eve[k].device == eve[i].device; ++k )
+      {
+        batch[cnt++] = eve[k].ev;
+      }
+      if( !evshm_device(&cl, eve[i].device, path, 0) && !*path )
+      {
+        strcpy(path, "unknown");
+      }
+      gettimeofday(&tv, 0);
+      show_events(path, &tv, batch, cnt);
+    }
+    outbuf_flush();
+  }
+
+  evshm_detach(&cl);
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Overrun recovery
+ *
+ * When the kernel side event buffer of a client overflows, the buffer
+ * is flushed and SYN_DROPPED is queued instead. Events up to the next
+ * SYN_REPORT are then a partial frame and must be ignored, after which
+ * the current device state needs to be fetched via ioctls.
+ *
+ * To be able to tell what changed, the last known key, absolute axis
+ * and multitouch slot state is tracked from the event stream. After an
+ * overrun the difference against a fresh snapshot is emitted as a
+ * synthetic frame, so that everything downstream sees a consistent
+ * stream of events.
+ * ------------------------------------------------------------------------- */
+
+/** Maximum number of multitouch slots tracked */
+#define RESYNC_MT_SLOTS MT_SLOTS_MAX
+
+/** First per slot multitouch axis */
+#define RESYNC_MT_FIRST ABS_MT_TOUCH_MAJOR
+
+/** Number of per slot multitouch axes */
+#define RESYNC_MT_CODES (ABS_MT_TOOL_Y - RESYNC_MT_FIRST + 1)
+
+/** Maximum number of events in a corrective frame */
+#define RESYNC_FIX_MAX (KEY_CNT + ABS_CNT + \
+                        RESYNC_MT_SLOTS * (RESYNC_MT_CODES + 1) + 2)
+
+/** Device state tracking for overrun recovery */
+typedef struct
+{
+  int                fd;       // device fd, owned by device_t
+  char              *path;
+  bool               dropping; // discarding events until SYN_REPORT
+  int                discarded;// events discarded after SYN_DROPPED
+  unsigned long      key_bits[BMAP_SIZE(KEY_CNT)];
+  unsigned long      abs_bits[BMAP_SIZE(ABS_CNT)];
+  unsigned long      key[BMAP_SIZE(KEY_CNT)];
+  int                abs[ABS_CNT];
+  int                mt_slots; // number of slots tracked, 0 if no MT
+  int                mt_slot;  // currently selected slot
+  int                mt[RESYNC_MT_CODES][RESYNC_MT_SLOTS];
+  int                fix_cnt;
+  struct input_event fix[RESYNC_FIX_MAX];
+} resync_t;
+
+/** Flag for: recover device state after SYN_DROPPED */
+static bool resync_enabled = true;
+
+/** Check if per slot multitouch axis is tracked
+ */
+static bool resync_mt_code(const resync_t *rs, int code)
+{
+  return (rs->mt_slots && code >= RESYNC_MT_FIRST &&
+          code < RESYNC_MT_FIRST + RESYNC_MT_CODES);
+}
+
+/** Fetch current device state from the kernel
+ *
+ * @param rs  device state
+ * @param key key state bitmap to fill
+ * @param abs absolute axis values to fill
+ * @param mt  multitouch slot values to fill
+ */
+static void resync_query(resync_t *rs, unsigned long *key, int *abs,
+                         int (*mt)[RESYNC_MT_SLOTS])
+{
+  struct
+  {
+    uint32_t code;
+    int32_t  values[RESYNC_MT_SLOTS];
+  } req;
+
+  if( ioctl(rs->fd, EVIOCGKEY(BMAP_SIZE(KEY_CNT) * sizeof *key), key) == -1 )
+  {
+    mce_log(LL_WARN, "%s: EVIOCGKEY: %m", rs->path);
+  }
+
+  for( int code = 0; code < ABS_CNT; ++code )
+  {
+    struct input_absinfo info;
+
+    if( !bit_is_set(rs->abs_bits, code) || resync_mt_code(rs, code) )
+    {
+      continue;
+    }
+    if( ioctl(rs->fd, EVIOCGABS(code), &info) == -1 )
+    {
+      mce_log(LL_WARN, "%s: EVIOCGABS: %m", rs->path);
+      continue;
+    }
+    abs[code] = info.value;
+  }
+
+  for( int i = 0; rs->mt_slots && i < RESYNC_MT_CODES; ++i )
+  {
+    if( !bit_is_set(rs->abs_bits, RESYNC_MT_FIRST + i) )
+    {
+      continue;
+    }
+    req.code = RESYNC_MT_FIRST + i;
+    if( ioctl(rs->fd, EVIOCGMTSLOTS(sizeof req), &req) == -1 )
+    {
+      mce_log(LL_WARN, "%s: EVIOCGMTSLOTS: %m", rs->path);
+      continue;
+    }
+    memcpy(mt[i], req.values, sizeof mt[i]);
+  }
+}
+
+/** Start tracking device state
+ *
+ * @param fd   input device file descriptor
+ * @param path input device path
+ *
+ * @return device state, or NULL if resync is disabled
+ */
+static resync_t *resync_attach(int fd, const char *path)
+{
+  resync_t            *rs;
+  struct input_absinfo info;
+
+  if( !resync_enabled || !(rs = calloc(1, sizeof *rs)) )
+  {
+    return 0;
+  }
+
+  rs->fd   = fd;
+  rs->path = strdup(path);
+
+  if( ioctl(fd, EVIOCGBIT(EV_KEY, sizeof rs->key_bits), rs->key_bits) == -1 ||
+      ioctl(fd, EVIOCGBIT(EV_ABS, sizeof rs->abs_bits), rs->abs_bits) == -1 )
+  {
+    mce_log(LL_WARN, "%s: EVIOCGBIT: %m", path);
+  }
+
+  if( bit_is_set(rs->abs_bits, ABS_MT_SLOT) &&
+      ioctl(fd, EVIOCGABS(ABS_MT_SLOT), &info) != -1 )
+  {
+    rs->mt_slots = info.maximum + 1;
+    if( rs->mt_slots > RESYNC_MT_SLOTS )
+    {
+      mce_log(LL_NOTICE, "%s: tracking only %d of %d touch slots", path,
+              RESYNC_MT_SLOTS, rs->mt_slots);
+      rs->mt_slots = RESYNC_MT_SLOTS;
+    }
+  }
+
+  resync_query(rs, rs->key, rs->abs, rs->mt);
+  rs->mt_slot = rs->abs[ABS_MT_SLOT];
+  return rs;
+}
+
+/** Stop tracking device state
+ */
+static void resync_detach(resync_t *rs)
+{
+  if( rs )
+  {
+    free(rs->path);
+    free(rs);
+  }
+}
+
+/** Update tracked state with an event
+ */
+static void resync_track(resync_t *rs, const struct input_event *e)
+{
+  if( e->type == EV_KEY && e->code < KEY_CNT )
+  {
+    unsigned long mask = 1ul << (e->code % LONG_BIT);
+    if( e->value )
+      rs->key[e->code / LONG_BIT] |= mask;
+    else
+      rs->key[e->code / LONG_BIT] &= ~mask;
+  }
+  else if( e->type == EV_ABS && e->code < ABS_CNT )
+  {
+    if( e->code == ABS_MT_SLOT )
+    {
+      rs->mt_slot = e->value;
+    }
+    if( !resync_mt_code(rs, e->code) )
+    {
+      rs->abs[e->code] = e->value;
+    }
+    else if( rs->mt_slot >= 0 && rs->mt_slot < rs->mt_slots )
+    {
+      rs->mt[e->code - RESYNC_MT_FIRST][rs->mt_slot] = e->value;
+    }
+  }
+}
+
+/** Add event to corrective frame
+ */
+static void resync_emit(resync_t *rs, const struct timeval *time,
+                        int type, int code, int value)
+{
+  struct input_event *e;
+
+  if( filter_active && type != EV_SYN && !bit_is_set(filter_code[type], code) )
+  {
+    return;
+  }
+
+  e = &rs->fix[rs->fix_cnt++];
+  e->time  = *time;
+  e->type  = type;
+  e->code  = code;
+  e->value = value;
+}
+
+/** Build corrective frame from difference between tracked and current state
+ *
+ * @param rs   device state
+ * @param time time stamp to use for the synthetic events
+ */
+static void resync_state(resync_t *rs, const struct timeval *time)
+{
+  unsigned long key[BMAP_SIZE(KEY_CNT)];
+  int           abs[ABS_CNT];
+  int           mt[RESYNC_MT_CODES][RESYNC_MT_SLOTS];
+  int           slot = rs->mt_slot;
+
+  memcpy(key, rs->key, sizeof key);
+  memcpy(abs, rs->abs, sizeof abs);
+  memcpy(mt, rs->mt, sizeof mt);
+  resync_query(rs, key, abs, mt);
+
+  rs->fix_cnt = 0;
+
+  for( int code = 0; code < KEY_CNT; ++code )
+  {
+    if( bit_is_set(rs->key_bits, code) &&
+        bit_is_set(key, code) != bit_is_set(rs->key, code) )
+    {
+      resync_emit(rs, time, EV_KEY, code, bit_is_set(key, code));
+    }
+  }
+
+  for( int code = 0; code < ABS_CNT; ++code )
+  {
+    if( code != ABS_MT_SLOT && abs[code] != rs->abs[code] )
+    {
+      resync_emit(rs, time, EV_ABS, code, abs[code]);
+    }
+  }
+
+  for( int s = 0; s < rs->mt_slots; ++s )
+  {
+    // tracking id first, so that other values apply to the new contact
+    const int id = ABS_MT_TRACKING_ID - RESYNC_MT_FIRST;
+
+    for( int k = -1; k < RESYNC_MT_CODES; ++k )
+    {
+      int i = (k < 0) ? id : k;
+      if( k == id || mt[i][s] == rs->mt[i][s] )
+      {
+        continue;
+      }
+      if( slot != s )
+      {
+        resync_emit(rs, time, EV_ABS, ABS_MT_SLOT, slot = s);
+      }
+      resync_emit(rs, time, EV_ABS, RESYNC_MT_FIRST + i, mt[i][s]);
+    }
+  }
+
+  if( rs->mt_slots && slot != abs[ABS_MT_SLOT] )
+  {
+    resync_emit(rs, time, EV_ABS, ABS_MT_SLOT, abs[ABS_MT_SLOT]);
+  }
+
+  if( rs->fix_cnt )
+  {
+    resync_emit(rs, time, EV_SYN, SYN_REPORT, 0);
+  }
+
+  memcpy(rs->key, key, sizeof key);
+  memcpy(rs->abs, abs, sizeof abs);
+  memcpy(rs->mt, mt, sizeof mt);
+  rs->mt_slot = abs[ABS_MT_SLOT];
+
+  mce_log(LL_WARN, "%s: SYN_DROPPED: %d events discarded, "
+          "%d state changes restored", rs->path, rs->discarded,
+          rs->fix_cnt ? rs->fix_cnt - 1 : 0);
+  rs->discarded = 0;
+}
+
+/** Track device state over a batch of events and resync after overruns
+ *
+ * Returns the number of events at the start of eve that should be
+ * passed on as is. If an overrun was recovered from, the corrective
+ * frame is left in rs->fix and should be passed on after them.
+ *
+ * @param rs   device state, or NULL if resync is disabled
+ * @param eve  array of input events
+ * @param n    number of events in eve
+ * @param used set to number of events consumed from eve
+ *
+ * @return number of events to pass on
+ */
+static int resync_scan(resync_t *rs, const struct input_event *eve, int n,
+                       int *used)
+{
+  if( rs )
+  {
+    rs->fix_cnt = 0;
+  }
+
+  for( int i = 0; rs && i < n; ++i )
+  {
+    const struct input_event *e = &eve[i];
+
+    if( rs->dropping )
+    {
+      if( e->type == EV_SYN && e->code == SYN_REPORT )
+      {
+        rs->dropping = false;
+        resync_state(rs, &e->time);
+        *used = i + 1;
+        return 0;
+      }
+      ++rs->discarded;
+    }
+    else if( e->type == EV_SYN && e->code == SYN_DROPPED )
+    {
+      // SYN_DROPPED itself is shown, the partial frame after it is not
+      rs->dropping = true;
+      *used = i + 1;
+      return i + 1;
+    }
+    else
+    {
+      resync_track(rs, e);
+    }
+  }
+
+  *used = n;
+  return (rs && rs->dropping) ? 0 : n;
+}
+
+/** Handle a batch of input events read from a device
+ *
+ * @param slot  device slot
+ * @param title text to print before event details
+ * @param stamp monotonic read time [ns]
+ * @param tv    time of day when the events were read
+ * @param eve   array of input events
+ * @param n     number of events in eve
+ */
+static void handle_events(int slot, const char *title, int64_t stamp,
+                          const struct timeval *tv,
+                          const struct input_event *eve, int n)
+{
+  if( stats_mode )
+  {
+    stats_add(slot, eve, n);
+  }
+  else if( latency_mode )
+  {
+    latency_add(slot, stamp, tv, eve, n);
+  }
+  else if( evshm_ring )
+  {
+    evshm_publish(slot, eve, n);
+  }
+  else if( evrec_fd != -1 )
+  {
+    evrec_add_events(slot, tv, eve, n);
+  }
+  else if( frames_mode )
+  {
+    frames_add(slot, title, eve, n);
+  }
+  else
+  {
+    show_events(title, tv, eve, n);
+  }
+}
+
+/** Resync, filter and handle a batch of input events that has just been read
+ *
+ * @param slot  device slot
+ * @param rs    device state for overrun recovery, or NULL
+ * @param title text to print before event details
+ * @param stamp monotonic read time [ns]
+ * @param eve   array of input events
+ * @param n     number of events in eve
+ */
+static void process_batch(int slot, resync_t *rs, const char *title,
+                          int64_t stamp, struct input_event *eve, int n)
+{
+  struct timeval tv;
+
+  memset(&tv, 0, sizeof tv);
+  if( emit_time_of_day || evrec_fd != -1 || latency_mode ||
+      output_format != FORMAT_TEXT )
+  {
+    gettimeofday(&tv, 0);
+  }
+
+  while( n > 0 )
+  {
+    int used;
+    int pass = resync_scan(rs, eve, n, &used);
+
+    if( (pass = filter_events(eve, pass)) )
+    {
+      handle_events(slot, title, stamp, &tv, eve, pass);
+    }
+    if( rs && rs->fix_cnt )
+    {
+      handle_events(slot, title, stamp, &tv, rs->fix, rs->fix_cnt);
+    }
+    eve += used, n -= used;
+  }
+}
+
+/** Upper limit for events read per system call */
+#define READ_BATCH_MAX 65536
+
+/** Number of events to read per system call */
+static int read_batch = 256;
+
+/** Read buffer used by the mainloop, holds read_batch events */
+static struct input_event *read_buf = 0;
+
+/** Read and show input events
+ *
+ * @param slot  device slot
+ * @param fd    input device file descriptor to read from
+ * @param rs    device state for overrun recovery, or NULL
+ * @param title text to print before event details
+ *
+ * @return positive value on success, 0 on eof, -1 on errors
+ */
+static
+int
+process_events(int slot, int fd, resync_t *rs, const char *title)
+{
+  struct input_event *eve = read_buf;
+  int64_t stamp;
+
+  errno = 0;
+  int n = read(fd, eve, read_batch * sizeof *eve);
+  stamp = latency_mode ? monotime() : 0;
+  if( n < 0 )
+  {
+    if( errno == EINTR || errno == EAGAIN )
+    {
+      return 1;
+    }
+    mce_log(LL_ERR, "%s: %m", title);
+    return -1;
+  }
+
+  if( n == 0 )
+  {
+    mce_log(LL_ERR, "%s: EOF", title);
+    return 0;
+  }
+
+  process_batch(slot, rs, title, stamp, eve, n / sizeof *eve);
+  outbuf_flush();
+  return 1;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Threaded readers
+ *
+ * In threaded mode every device gets a reader thread that reads event
+ * batches straight into a single producer / single consumer ring. The
+ * mainloop acts as the merger: it repeatedly takes the pending event
+ * with the oldest time stamp over all rings, so that output stays in
+ * global time order even though devices are read concurrently.
+ *
+ * A reader that has nothing queued might still have older events in
+ * flight, so events are held back for up to MERGE_HOLD_MS unless every
+ * other live reader has something queued too.
+ * ------------------------------------------------------------------------- */
+
+/** Number of batches in a reader ring, must be a power of two */
+#define READER_RING 64
+
+/** How long to wait for other readers before emitting events [ms] */
+#define MERGE_HOLD_MS 20
+
+/** Event batch queued by a reader thread */
+typedef struct
+{
+  int64_t            stamp; // monotonic read time [ns]
+  struct timeval     tv;    // time of day when read
+  int                n;     // number of events
+  struct input_event eve[]; // read_batch events
+} batch_t;
+
+/** Reader thread state */
+typedef struct
+{
+  pthread_t thread;
+  int       slot;     // device slot
+  int       fd;       // device fd, owned by device_t
+  int       stop_fd;  // eventfd for telling reader to exit
+  unsigned  head;     // next batch to fill, written by reader
+  unsigned  tail;     // next batch to merge, written by merger
+  int       cursor;   // next event in batch at tail
+  int       done;     // reader has exited
+  resync_t *resync;   // owned by device_t
+  struct input_event *spill; // batch being split after an overrun
+  char     *ring;     // READER_RING batches
+} reader_t;
+
+/** Get size of a batch holding read_batch events
+ */
+static size_t reader_batch_size(void)
+{
+  return sizeof (batch_t) + read_batch * sizeof (struct input_event);
+}
+
+/** Get batch from reader ring
+ *
+ * @param rd  reader state
+ * @param pos free running ring position
+ */
+static batch_t *reader_batch(const reader_t *rd, unsigned pos)
+{
+  return (batch_t *)(rd->ring + (pos % READER_RING) * reader_batch_size());
+}
+
+/** Flag for: read devices in separate threads */
+static bool use_threads = false;
+
+/** eventfd readers use for waking up the merger */
+static int merge_efd = -1;
+
+/** Wake up merger
+ */
+static void merge_wakeup(void)
+{
+  uint64_t one = 1;
+  if( write(merge_efd, &one, sizeof one) == -1 )
+  {
+    // counter can't overflow in practice, nothing to do
+  }
+}
+
+/** Wait until there is room in reader ring
+ *
+ * @return false if the reader was told to stop while waiting
+ */
+static bool reader_wait(reader_t *rd)
+{
+  struct pollfd pfd = { .fd = rd->stop_fd, .events = POLLIN };
+
+  while( rd->head - __atomic_load_n(&rd->tail, __ATOMIC_ACQUIRE) ==
+         READER_RING )
+  {
+    // ring full -> let the kernel buffer events for a while
+    if( poll(&pfd, 1, 1) > 0 ) return false;
+  }
+  return true;
+}
+
+/** Queue copy of events for merging, split into batches as needed
+ *
+ * @param rd    reader state
+ * @param stamp monotonic read time [ns]
+ * @param tv    time of day when read
+ * @param eve   array of input events
+ * @param n     number of events in eve
+ *
+ * @return false if the reader was told to stop while waiting
+ */
+static bool reader_push(reader_t *rd, int64_t stamp, const struct timeval *tv,
+                        const struct input_event *eve, int n)
+{
+  while( n > 0 )
+  {
+    if( !reader_wait(rd) )
+    {
+      return false;
+    }
+
+    batch_t *b   = reader_batch(rd, rd->head);
+    int      cnt = (n < read_batch) ? n : read_batch;
+
+    memcpy(b->eve, eve, cnt * sizeof *eve);
+    b->stamp = stamp;
+    b->tv    = *tv;
+    eve += cnt, n -= cnt;
+
+    if( (b->n = filter_events(b->eve, cnt)) == 0 )
+    {
+      continue;
+    }
+
+    __atomic_store_n(&rd->head, rd->head + 1, __ATOMIC_RELEASE);
+    merge_wakeup();
+  }
+  return true;
+}
+
+/** Reader thread entry point
+ */
+static void *reader_main(void *aptr)
+{
+  reader_t     *rd = aptr;
+  resync_t     *rs = rd->resync;
+  struct pollfd pfd[2] =
+  {
+    { .fd = rd->fd,      .events = POLLIN },
+    { .fd = rd->stop_fd, .events = POLLIN },
+  };
+
+  while( reader_wait(rd) )
+  {
+    if( poll(pfd, 2, -1) == -1 )
+    {
+      if( errno == EINTR ) continue;
+      break;
+    }
+
+    if( pfd[1].revents )
+    {
+      break;
+    }
+
+    batch_t *b = reader_batch(rd, rd->head);
+    int      n = read(rd->fd, b->eve, read_batch * sizeof *b->eve);
+
+    if( n < 0 )
+    {
+      if( errno == EINTR || errno == EAGAIN ) continue;
+      mce_log(LL_ERR, "reader %d: %m", rd->slot);
+      break;
+    }
+
+    if( n == 0 )
+    {
+      mce_log(LL_ERR, "reader %d: EOF", rd->slot);
+      break;
+    }
+
+    b->stamp = monotime();
+    gettimeofday(&b->tv, 0);
+    n /= sizeof *b->eve;
+
+    int used;
+    int pass = resync_scan(rs, b->eve, n, &used);
+
+    if( used == n && !(rs && rs->fix_cnt) )
+    {
+      // no overrun -> queue batch in place
+      if( (b->n = filter_events(b->eve, pass)) == 0 )
+      {
+        continue;
+      }
+      __atomic_store_n(&rd->head, rd->head + 1, __ATOMIC_RELEASE);
+      merge_wakeup();
+      continue;
+    }
+
+    // overrun -> queue pieces of the batch and the corrective frame
+    const struct input_event *eve   = rd->spill;
+    int64_t                   stamp = b->stamp;
+    struct timeval            tv    = b->tv;
+
+    memcpy(rd->spill, b->eve, n * sizeof *b->eve);
+
+    for( ;; )
+    {
+      if( !reader_push(rd, stamp, &tv, eve, pass) ||
+          (rs->fix_cnt && !reader_push(rd, stamp, &tv, rs->fix, rs->fix_cnt)) )
+      {
+        goto done;
+      }
+      if( (eve += used, n -= used) == 0 )
+      {
+        break;
+      }
+      pass = resync_scan(rs, eve, n, &used);
+    }
+  }
+
+done:
+
+  __atomic_store_n(&rd->done, 1, __ATOMIC_RELEASE);
+  merge_wakeup();
+  return 0;
+}
+
+/** Release reader state
+ */
+static void reader_free(reader_t *rd)
+{
+  if( rd )
+  {
+    free(rd->spill);
+    free(rd->ring);
+    free(rd);
+  }
+}
+
+/** Start reader thread for a device
+ *
+ * @param slot device slot
+ * @param fd   input device file descriptor
+ * @param rs   device state for overrun recovery, or NULL
+ *
+ * @return reader state, or NULL in case of errors
+ */
+static reader_t *reader_start(int slot, int fd, resync_t *rs)
+{
+  reader_t *rd = calloc(1, sizeof *rd);
+  sigset_t  all, old;
+
+  if( !rd )
+  {
+    mce_log(LL_ERR, "reader %d: %m", slot);
+    return 0;
+  }
+
+  rd->slot    = slot;
+  rd->fd      = fd;
+  rd->resync  = rs;
+  rd->spill   = calloc(read_batch, sizeof *rd->spill);
+  rd->ring    = calloc(READER_RING, reader_batch_size());
+  rd->stop_fd = eventfd(0, EFD_CLOEXEC);
+
+  // signals are to be handled by the main thread only
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  if( !rd->spill || !rd->ring || rd->stop_fd == -1 ||
+      pthread_create(&rd->thread, 0, reader_main, rd) )
+  {
+    mce_log(LL_ERR, "reader %d: can't start thread", slot);
+    if( rd->stop_fd != -1 ) close(rd->stop_fd);
+    reader_free(rd), rd = 0;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, 0);
+
+  return rd;
+}
+
+/** Stop reader thread
+ *
+ * Events that are still queued are left in the ring.
+ */
+static void reader_stop(reader_t *rd)
+{
+  uint64_t one = 1;
+
+  if( write(rd->stop_fd, &one, sizeof one) == -1 )
+  {
+    mce_log(LL_ERR, "reader %d: %m", rd->slot);
+  }
+  pthread_join(rd->thread, 0);
+  close(rd->stop_fd), rd->stop_fd = -1;
+}
+
+/* ------------------------------------------------------------------------- *
+ * io_uring reader
+ *
+ * With the io_uring backend every device has one read request in
+ * flight, targeting a registered buffer that is reserved for the
+ * device slot. Completions are reaped in batches and the reads are
+ * re-armed, so a wakeup costs one io_uring_enter() regardless of how
+ * many devices had data, where the poll based loop needs epoll_wait()
+ * plus one read() per ready device.
+ *
+ * Everything else (hotplug, report timer, devices in slots beyond the
+ * registered buffers) stays in the epoll set, which is watched by a
+ * poll request on the same ring.
+ *
+ * The ring is driven via raw system calls, liburing is not needed.
+ * ------------------------------------------------------------------------- */
+
+/** Number of registered buffers, i.e. device slots read via io_uring */
+#define URING_BUFS 64
+
+/** Upper limit for events per registered buffer
+ *
+ * Registered buffers stay pinned in memory for every slot, whether a
+ * device uses it or not, so they are not sized from --batch alone:
+ * 64 buffers of READ_BATCH_MAX events would pin about 100 MB. A device
+ * with more events pending is simply read again right away.
+ */
+#define URING_BUF_MAX 1024
+
+/** Size of submission queue */
+#define URING_ENTRIES 256
+
+/** user_data tag for the epoll poll request */
+#define URING_EPOLL_TAG UINT64_MAX
+
+/** user_data tag for cancel requests */
+#define URING_CANCEL_TAG (UINT64_MAX - 1)
+
+/** io_uring instance */
+typedef struct
+{
+  int                  fd;
+  void                *sq_ring;
+  size_t               sq_size;
+  void                *cq_ring;
+  size_t               cq_size;
+  struct io_uring_sqe *sqes;
+  size_t               sqes_size;
+  unsigned             sq_entries;
+  unsigned            *sq_head;
+  unsigned            *sq_tail;
+  unsigned            *sq_mask;
+  unsigned            *sq_array;
+  unsigned            *cq_head;
+  unsigned            *cq_tail;
+  unsigned            *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned             pending; // queued but not yet submitted
+  unsigned long        enters;  // io_uring_enter() calls made
+  struct input_event  *buf;     // bufs * buf_len events
+  int                  bufs;
+  int                  buf_len;
+} uring_t;
+
+/** Get registered read buffer
+ */
+static struct input_event *uring_buf(const uring_t *ur, int buf)
+{
+  return ur->buf + (size_t)buf * ur->buf_len;
+}
+
+/** Release io_uring instance
+ */
+static void uring_quit(uring_t *ur)
+{
+  if( ur->sqes != MAP_FAILED ) munmap(ur->sqes, ur->sqes_size);
+  if( ur->cq_ring != MAP_FAILED && ur->cq_ring != ur->sq_ring )
+  {
+    munmap(ur->cq_ring, ur->cq_size);
+  }
+  if( ur->sq_ring != MAP_FAILED ) munmap(ur->sq_ring, ur->sq_size);
+  if( ur->fd != -1 ) close(ur->fd);
+  free(ur->buf);
+
+  memset(ur, 0, sizeof *ur);
+  ur->fd = -1;
+  ur->sq_ring = ur->cq_ring = ur->sqes = MAP_FAILED;
+}
+
+/** Set up io_uring instance with registered read buffers
+ *
+ * @param ur      io_uring instance
+ * @param entries submission queue size
+ * @param bufs    number of read buffers to register
+ * @param len     number of events per read buffer
+ *
+ * @return 0 on success, or -1 if io_uring is not available
+ */
+static int uring_init(uring_t *ur, unsigned entries, int bufs, int len)
+{
+  struct io_uring_params p;
+  struct iovec           iov[bufs];
+  char                  *sq, *cq;
+
+  memset(ur, 0, sizeof *ur);
+  ur->fd = -1;
+  ur->sq_ring = ur->cq_ring = ur->sqes = MAP_FAILED;
+
+  memset(&p, 0, sizeof p);
+  if( (ur->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1 )
+  {
+    goto fail;
+  }
+
+  ur->sq_entries = p.sq_entries;
+  ur->sq_size    = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  ur->cq_size    = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  ur->sqes_size  = p.sq_entries * sizeof (struct io_uring_sqe);
+
+  if( p.features & IORING_FEAT_SINGLE_MMAP )
+  {
+    if( ur->cq_size > ur->sq_size ) ur->sq_size = ur->cq_size;
+    ur->cq_size = ur->sq_size;
+  }
+
+  ur->sq_ring = mmap(0, ur->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     ur->fd, IORING_OFF_SQ_RING);
+  if( ur->sq_ring == MAP_FAILED )
+  {
+    goto fail;
+  }
+
+  if( p.features & IORING_FEAT_SINGLE_MMAP )
+  {
+    ur->cq_ring = ur->sq_ring;
+  }
+  else if( (ur->cq_ring = mmap(0, ur->cq_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED, ur->fd,
+                               IORING_OFF_CQ_RING)) == MAP_FAILED )
+  {
+    goto fail;
+  }
+
+  if( (ur->sqes = mmap(0, ur->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       ur->fd, IORING_OFF_SQES)) == MAP_FAILED )
+  {
+    goto fail;
+  }
+
+  sq = ur->sq_ring, cq = ur->cq_ring;
+  ur->sq_head  = (unsigned *)(sq + p.sq_off.head);
+  ur->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+  ur->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+  ur->sq_array = (unsigned *)(sq + p.sq_off.array);
+  ur->cq_head  = (unsigned *)(cq + p.cq_off.head);
+  ur->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+  ur->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+  ur->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  if( !(ur->buf = calloc((size_t)bufs * len, sizeof *ur->buf)) )
+  {
+    goto fail;
+  }
+  ur->bufs    = bufs;
+  ur->buf_len = len;
+
+  for( int i = 0; i < bufs; ++i )
+  {
+    iov[i].iov_base = uring_buf(ur, i);
+    iov[i].iov_len  = len * sizeof *ur->buf;
+  }
+  if( syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_BUFFERS,
+              iov, bufs) == -1 )
+  {
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  uring_quit(ur);
+  return -1;
+}
+
+/** Submit queued requests and optionally wait for completions
+ *
+ * @param ur   io_uring instance
+ * @param wait number of completions to wait for
+ *
+ * @return number of requests submitted, or -1 in case of errors
+ */
+static int uring_enter(uring_t *ur, unsigned wait)
+{
+  int rc = syscall(__NR_io_uring_enter, ur->fd, ur->pending, wait,
+                   wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+  ++ur->enters;
+  if( rc > 0 )
+  {
+    ur->pending -= rc;
+  }
+  return rc;
+}
+
+/** Get cleared submission queue entry
+ *
+ * The entry is visible to the kernel on the next uring_enter(); there
+ * is no kernel side polling, so it can be filled in after this.
+ */
+static struct io_uring_sqe *uring_sqe(uring_t *ur)
+{
+  unsigned tail = *ur->sq_tail;
+
+  if( tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >= ur->sq_entries )
+  {
+    uring_enter(ur, 0);
+  }
+
+  unsigned             idx = tail & *ur->sq_mask;
+  struct io_uring_sqe *sqe = &ur->sqes[idx];
+
+  memset(sqe, 0, sizeof *sqe);
+  ur->sq_array[idx] = idx;
+  __atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++ur->pending;
+  return sqe;
+}
+
+/** Queue read into registered buffer
+ */
+static void uring_read(uring_t *ur, int fd, int buf, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe = uring_sqe(ur);
+
+  sqe->opcode    = IORING_OP_READ_FIXED;
+  sqe->fd        = fd;
+  sqe->addr      = (uintptr_t)uring_buf(ur, buf);
+  sqe->len       = ur->buf_len * sizeof *ur->buf;
+  sqe->buf_index = buf;
+  sqe->user_data = user_data;
+}
+
+/** Queue one shot poll for input
+ */
+static void uring_poll(uring_t *ur, int fd, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe = uring_sqe(ur);
+
+  sqe->opcode        = IORING_OP_POLL_ADD;
+  sqe->fd            = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data     = user_data;
+}
+
+/** Queue cancellation of a pending request
+ */
+static void uring_cancel(uring_t *ur, uint64_t target)
+{
+  struct io_uring_sqe *sqe = uring_sqe(ur);
+
+  sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+  sqe->fd        = -1;
+  sqe->addr      = target;
+  sqe->user_data = URING_CANCEL_TAG;
+}
+
+/** Get next completion, or NULL if there are none
+ */
+static struct io_uring_cqe *uring_peek(uring_t *ur)
+{
+  unsigned head = *ur->cq_head;
+
+  if( head == __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE) )
+  {
+    return 0;
+  }
+  return &ur->cqes[head & *ur->cq_mask];
+}
+
+/** Release completion returned by uring_peek()
+ */
+static void uring_advance(uring_t *ur)
+{
+  __atomic_store_n(ur->cq_head, *ur->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/** Flag for: read devices via io_uring */
+static bool use_uring = false;
+
+/** io_uring instance used by the mainloop */
+static uring_t mainloop_uring = { .fd = -1 };
+
+/** Request generation per device slot, for ignoring stale completions */
+static uint32_t uring_gen[URING_BUFS];
+
+/** Flag per device slot: read request in flight */
+static bool uring_busy[URING_BUFS];
+
+/** Flag for: poll on the epoll fd in flight */
+static bool uring_epoll_armed = false;
+
+/** Check if device slot can be read via io_uring
+ */
+static bool uring_slot(int slot)
+{
+  return mainloop_uring.fd != -1 && slot < URING_BUFS;
+}
+
+/** Queue read for a device slot
+ */
+static void uring_arm(int slot, int fd)
+{
+  uring_read(&mainloop_uring, fd, slot,
+             ((uint64_t)uring_gen[slot] << 32) | (uint32_t)slot);
+  uring_busy[slot] = true;
+}
+
+/** Start reading device via io_uring
+ *
+ * @return true on success, or false if epoll needs to be used instead
+ */
+static bool uring_attach(int slot, int fd)
+{
+  if( !uring_slot(slot) )
+  {
+    return false;
+  }
+
+  // let io_uring wait for data instead of failing with EAGAIN
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  uring_arm(slot, fd);
+  return true;
+}
+
+/** Stop reading device via io_uring
+ */
+static void uring_detach(int slot)
+{
+  if( uring_slot(slot) && uring_busy[slot] )
+  {
+    uring_cancel(&mainloop_uring,
+                 ((uint64_t)uring_gen[slot] << 32) | (uint32_t)slot);
+    uring_enter(&mainloop_uring, 0);
+    ++uring_gen[slot];
+  }
+}
+
+/** Directory watched for input device hotplug */
+#define HOTPLUG_DIR "/dev/input"
+
+/** epoll data tag for the inotify file descriptor */
+#define HOTPLUG_TAG UINT32_MAX
+
+/** epoll data tag for the merger eventfd */
+#define MERGE_TAG (UINT32_MAX - 1)
+
+/** epoll data tag for the periodic report timerfd */
+#define REPORT_TAG (UINT32_MAX - 2)
+
+/** Interval for periodic reports [ms], or 0 for none */
+static int report_interval = 0;
+
+/** Interval for writing out buffered capture records [ms]
+ *
+ * A quiet device would otherwise leave the tail of the last burst in
+ * memory until the next block fills up, out of reach of tail -f and
+ * lost if evdev_trace gets killed. Only closed records are written;
+ * an open compact record stays open until it is full or spans
+ * EVDELTA_KEYFRAME_SEC, so that compression does not suffer.
+ */
+#define EVREC_FLUSH_MS 2000
+
+/** Monotonic time when the next periodic report is due [ns] */
+static int64_t report_due = 0;
+
+/** Monotonic time when buffered capture records were last written [ns] */
+static int64_t report_flushed = 0;
+
+/** Get periodic timer interval [ms]
+ *
+ * @return interval, or 0 when there is nothing to do periodically
+ */
+static int report_tick(void)
+{
+  int tick = report_interval;
+
+  if( evrec_fd != -1 && (tick <= 0 || tick > EVREC_FLUSH_MS) )
+  {
+    tick = EVREC_FLUSH_MS;
+  }
+  return tick;
+}
+
+/** Print periodic reports and write out buffered capture records
+ *
+ * Called on every report timer tick. The timer ticks at the shorter of
+ * the two intervals, half a tick of slack keeps reports from slipping
+ * by a whole tick due to timer jitter.
+ */
+static void report_periodic(void)
+{
+  int64_t now   = monotime();
+  int64_t slack = report_tick() * INT64_C(500000);
+
+  if( report_interval > 0 && now >= report_due - slack )
+  {
+    report_due = now + report_interval * INT64_C(1000000);
+    if( latency_mode )
+    {
+      latency_report_all();
+    }
+    if( stats_mode )
+    {
+      stats_report();
+    }
+  }
+
+  if( evrec_fd != -1 &&
+      now - report_flushed >= EVREC_FLUSH_MS * INT64_C(1000000) - slack )
+  {
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    report_flushed = now;
+    evdelta_expire(tv.tv_sec * INT64_C(1000000) + tv.tv_usec);
+    if( evrec_len > 0 )
+    {
+      evrec_flush();
+    }
+  }
+}
+
+/** Traced input device */
+typedef struct
+{
+  int       fd;
+  char     *path;
+  reader_t *reader; // reader thread in threaded mode
+  resync_t *resync; // state for overrun recovery
+} device_t;
+
+/** Traced input devices, indexed by device slot */
+static device_t *device_lut = 0;
+
+/** Number of slots in device_lut */
+static int device_cnt = 0;
+
+/** Number of attached devices */
+static int device_attached = 0;
+
+/** epoll file descriptor used by the mainloop */
+static int mainloop_epfd = -1;
+
+/** Find device slot by path
+ *
+ * @return device slot, or -1 if not attached
+ */
+static int device_find(const char *path)
+{
+  for( int i = 0; i < device_cnt; ++i )
+  {
+    if( device_lut[i].fd != -1 && !strcmp(device_lut[i].path, path) )
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/** Check if event time stamp a is before b
+ */
+static bool time_before(const struct timeval *a, const struct timeval *b)
+{
+  return (a->tv_sec != b->tv_sec) ? (a->tv_sec < b->tv_sec)
+                                  : (a->tv_usec < b->tv_usec);
+}
+
+/** Handle all events still queued by a stopped reader
+ *
+ * @param slot device slot
+ */
+static void reader_drain(int slot)
+{
+  reader_t *rd = device_lut[slot].reader;
+
+  for( ; rd->tail != rd->head; ++rd->tail, rd->cursor = 0 )
+  {
+    const batch_t *b = reader_batch(rd, rd->tail);
+    handle_events(slot, device_lut[slot].path, b->stamp, &b->tv,
+                  b->eve + rd->cursor, b->n - rd->cursor);
+  }
+  outbuf_flush();
+}
+
+static void device_detach(int slot);
+
+/** Merge events queued by reader threads in time stamp order
+ *
+ * @return timeout for the next merge round [ms], or -1 for none
+ */
+static int merge_process(void)
+{
+  int64_t now     = monotime();
+  int     timeout = -1;
+
+  for( ;; )
+  {
+    reader_t                 *best    = 0;
+    const struct input_event *best_e  = 0;
+    const struct input_event *next_e  = 0;
+    bool                      starved = false;
+
+    // find the oldest and the second oldest queued event
+    for( int i = 0; i < device_cnt; ++i )
+    {
+      reader_t *rd = device_lut[i].reader;
+      if( !rd ) continue;
+
+      int      done = __atomic_load_n(&rd->done, __ATOMIC_ACQUIRE);
+      unsigned head = __atomic_load_n(&rd->head, __ATOMIC_ACQUIRE);
+
+      if( rd->tail == head )
+      {
+        starved |= !done;
+        continue;
+      }
+
+      const struct input_event *e =
+        &reader_batch(rd, rd->tail)->eve[rd->cursor];
+
+      if( !best_e || time_before(&e->time, &best_e->time) )
+      {
+        next_e = best_e, best = rd, best_e = e;
+      }
+      else if( !next_e || time_before(&e->time, &next_e->time) )
+      {
+        next_e = e;
+      }
+    }
+
+    if( !best )
+    {
+      break;
+    }
+
+    const batch_t *b = reader_batch(best, best->tail);
+
+    if( starved )
+    {
+      int64_t wait = b->stamp + MERGE_HOLD_MS * INT64_C(1000000) - now;
+      if( wait > 0 )
+      {
+        timeout = (int)((wait + 999999) / 1000000);
+        break;
+      }
+    }
+
+    // emit events up to the time stamp of the next oldest reader
+    int run = 1;
+    while( best->cursor + run < b->n &&
+           (!next_e ||
+            !time_before(&next_e->time, &b->eve[best->cursor + run].time)) )
+    {
+      ++run;
+    }
+
+    handle_events(best->slot, device_lut[best->slot].path, b->stamp, &b->tv,
+                  b->eve + best->cursor, run);
+
+    if( (best->cursor += run) == b->n )
+    {
+      best->cursor = 0;
+      __atomic_store_n(&best->tail, best->tail + 1, __ATOMIC_RELEASE);
+    }
+  }
+
+  outbuf_flush();
+
+  // reap readers that have exited and have been merged
+  for( int i = 0; i < device_cnt; ++i )
+  {
+    reader_t *rd = device_lut[i].reader;
+    if( rd && __atomic_load_n(&rd->done, __ATOMIC_ACQUIRE) &&
+        rd->tail == __atomic_load_n(&rd->head, __ATOMIC_ACQUIRE) )
+    {
+      device_detach(i);
+    }
+  }
+
+  return timeout;
+}
+
+/** Open input device and start tracing it
+ *
+ * @param path     input device path
+ * @param identify if nonzero print input device information
+ *
+ * @return device slot, or -1 in case of errors
+ */
+static int device_attach(const char *path, int identify)
+{
+  int slot = -1;
+  int fd   = -1;
+
+  if( (fd = evdev_open_device(path)) == -1 )
+  {
+    goto cleanup;
+  }
+
+  // stale wakeups for a reused slot must not block the mainloop
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  // reuse free slot, or add a new one
+  for( slot = 0; slot < device_cnt; ++slot )
+  {
+    if( device_lut[slot].fd == -1 &&
+        !(uring_slot(slot) && uring_busy[slot]) ) break;
+  }
+  if( slot == device_cnt )
+  {
+    device_t *lut = realloc(device_lut, (device_cnt + 1) * sizeof *lut);
+
+    if( !lut )
+    {
+      mce_log(LL_ERR, "%s: %m", path);
+      close(fd), slot = -1;
+      goto cleanup;
+    }
+    device_lut = lut;
+    ++device_cnt;
+  }
+  device_lut[slot].fd     = fd;
+  device_lut[slot].path   = strdup(path);
+  device_lut[slot].reader = 0;
+  device_lut[slot].resync = 0;
+  ++device_attached;
+
+  if( identify )
+  {
+    printf("----====( %s )====----\n", path);
+    evdev_identify_device(fd);
+    printf("\n");
+  }
+
+  filter_apply(fd, path);
+
+  if( evrec_fd != -1 )
+  {
+    evrec_add_device(slot, fd, path);
+  }
+
+  if( latency_mode && mainloop_epfd != -1 )
+  {
+    latency_attach(slot, fd, path);
+  }
+
+  if( stats_mode && mainloop_epfd != -1 )
+  {
+    stats_attach(slot, path);
+  }
+
+  if( mainloop_epfd != -1 )
+  {
+    evshm_set_device(slot, fd, path);
+  }
+
+  if( mainloop_epfd != -1 )
+  {
+    device_lut[slot].resync = resync_attach(fd, path);
+  }
+
+  if( merge_efd != -1 )
+  {
+    if( !(device_lut[slot].reader = reader_start(slot, fd,
+                                                 device_lut[slot].resync)) )
+    {
+      device_detach(slot), slot = -1;
+    }
+  }
+  else if( uring_attach(slot, fd) )
+  {
+    // completions are handled in uring_wait()
+  }
+  else if( mainloop_epfd != -1 )
+  {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = slot };
+    if( epoll_ctl(mainloop_epfd, EPOLL_CTL_ADD, fd, &ev) == -1 )
+    {
+      mce_log(LL_ERR, "%s: epoll_ctl: %m", path);
+    }
+  }
+
+cleanup:
+
+  return slot;
+}
+
+/** Stop tracing input device and close it
+ *
+ * @param slot device slot
+ */
+static void device_detach(int slot)
+{
+  device_t *dev = &device_lut[slot];
+
+  if( dev->reader )
+  {
+    reader_stop(dev->reader);
+    reader_drain(slot);
+    reader_free(dev->reader), dev->reader = 0;
+  }
+
+  latency_detach(slot);
+  stats_detach(slot);
+  frames_reset(slot);
+
+  if( dev->fd != -1 )
+  {
+    uring_detach(slot);
+    resync_detach(dev->resync), dev->resync = 0;
+    evshm_set_device(slot, -1, 0);
+
+    // closing removes the fd from epoll set too
+    close(dev->fd), dev->fd = -1;
+    free(dev->path), dev->path = 0;
+    --device_attached;
+  }
+}
+
+/** Handle changes in input device directory
+ *
+ * @param fd       inotify file descriptor
+ * @param identify if nonzero print input device information
+ */
+static void hotplug_process(int fd, int identify)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char path[256];
+  int  n;
+
+  while( (n = read(fd, buf, sizeof buf)) > 0 )
+  {
+    for( char *pos = buf; pos < buf + n; )
+    {
+      const struct inotify_event *ie = (const struct inotify_event *)pos;
+      pos += sizeof *ie + ie->len;
+
+      if( !ie->len || strncmp(ie->name, "event", 5) )
+      {
+        continue;
+      }
+
+      snprintf(path, sizeof path, "%s/%s", HOTPLUG_DIR, ie->name);
+
+      if( ie->mask & IN_DELETE )
+      {
+        int slot = device_find(path);
+        if( slot != -1 )
+        {
+          mce_log(LL_NOTICE, "%s: removed", path);
+          device_detach(slot);
+        }
+      }
+      else if( device_find(path) == -1 )
+      {
+        // IN_CREATE, or IN_ATTRIB after udev has fixed permissions
+        if( device_attach(path, identify) != -1 )
+        {
+          mce_log(LL_NOTICE, "%s: added", path);
+        }
+      }
+    }
+  }
+}
+
+/** Start watching for input device hotplug
+ *
+ * The watch must be in place before the existing devices are listed,
+ * otherwise a device that shows up in between is never traced. Events
+ * for devices that were listed too are ignored by hotplug_process().
+ *
+ * @return inotify file descriptor, or -1 if hotplug is not available
+ */
+static int hotplug_watch(void)
+{
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+  if( fd == -1 ||
+      inotify_add_watch(fd, HOTPLUG_DIR,
+                        IN_CREATE | IN_ATTRIB | IN_DELETE) == -1 )
+  {
+    mce_log(LL_WARN, "%s: hotplug not available: %m", HOTPLUG_DIR);
+    if( fd != -1 ) close(fd), fd = -1;
+  }
+  return fd;
+}
+
+/** Wait for io_uring completions and handle device reads
+ *
+ * @param ev  where to store ready epoll events
+ * @param max size of ev
+ *
+ * @return number of epoll events stored
+ */
+static int uring_wait(struct epoll_event *ev, int max)
+{
+  uring_t             *ur     = &mainloop_uring;
+  bool                 polled = false;
+  struct io_uring_cqe *cqe;
+  int64_t              stamp;
+
+  if( !uring_epoll_armed )
+  {
+    uring_poll(ur, mainloop_epfd, URING_EPOLL_TAG);
+    uring_epoll_armed = true;
+  }
+
+  if( uring_enter(ur, 1) == -1 && errno != EINTR )
+  {
+    mce_log(LL_ERR, "%s: %m", "io_uring_enter");
+  }
+
+  stamp = latency_mode ? monotime() : 0;
+
+  while( (cqe = uring_peek(ur)) )
+  {
+    uint64_t ud  = cqe->user_data;
+    int      res = cqe->res;
+    int      slot;
+
+    uring_advance(ur);
+
+    if( ud == URING_EPOLL_TAG )
+    {
+      uring_epoll_armed = false;
+      polled = true;
+      continue;
+    }
+
+    if( ud == URING_CANCEL_TAG )
+    {
+      continue;
+    }
+
+    slot = (uint32_t)ud;
+    uring_busy[slot] = false;
+
+    if( (uint32_t)(ud >> 32) != uring_gen[slot] || device_lut[slot].fd == -1 )
+    {
+      // completion for a detached device
+      continue;
+    }
+
+    if( res > 0 )
+    {
+      process_batch(slot, device_lut[slot].resync, device_lut[slot].path,
+                    stamp, uring_buf(ur, slot), res / sizeof *ur->buf);
+      uring_arm(slot, device_lut[slot].fd);
+    }
+    else if( res == -EINTR || res == -EAGAIN )
+    {
+      uring_arm(slot, device_lut[slot].fd);
+    }
+    else
+    {
+      mce_log(LL_ERR, "%s: %s", device_lut[slot].path,
+              res ? strerror(-res) : "EOF");
+      device_detach(slot);
+    }
+  }
+
+  outbuf_flush();
+
+  return polled ? epoll_wait(mainloop_epfd, ev, max, 0) : 0;
+}
+
+/** Mainloop for processing event input devices
+ *
+ * @param path  vector of input device paths
+ * @param count number of paths in the path
+ * @param identify if nonzero print input device information
+ * @param trace stay in loop and print out events as they arrive
+ * @param inotify_fd hotplug_watch() descriptor for tracing also devices
+ *                   that are added later on, or -1; closed on return
+ */
+static
+void
+mainloop(char **path, int count, int identify, int trace, int inotify_fd)
+{
+  int report_fd  = -1;
+  int timeout    = -1;
+
+  if( trace && (mainloop_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 )
+  {
+    mce_log(LL_ERR, "%s: %m", "epoll_create1");
+    goto cleanup;
+  }
+
+  if( trace && !(read_buf = calloc(read_batch, sizeof *read_buf)) )
+  {
+    mce_log(LL_ERR, "%s: %m", "calloc");
+    goto cleanup;
+  }
+
+  if( trace && use_uring && !use_threads &&
+      uring_init(&mainloop_uring, URING_ENTRIES, URING_BUFS,
+                 (read_batch < URING_BUF_MAX) ? read_batch
+                                              : URING_BUF_MAX) == -1 )
+  {
+    mce_log(LL_WARN, "io_uring not available: %m; using %s", "epoll");
+  }
+
+  if( trace && use_threads )
+  {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = MERGE_TAG };
+
+    if( (merge_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+        epoll_ctl(mainloop_epfd, EPOLL_CTL_ADD, merge_efd, &ev) == -1 )
+    {
+      mce_log(LL_ERR, "%s: %m", "eventfd");
+      goto cleanup;
+    }
+  }
+
+  if( identify && count > 1 )
+  {
+    // probe devices concurrently, attach without identifying again
+    identify_devices(path, count);
+  }
+
+  for( int i = 0; i < count; ++i )
+  {
+    device_attach(path[i], identify && count == 1);
+  }
+
+  if( !trace )
+  {
+    goto cleanup;
+  }
+
+  if( report_tick() > 0 )
+  {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = REPORT_TAG };
+    struct itimerspec  it;
+    int                tick = report_tick();
+
+    it.it_interval.tv_sec  = tick / 1000;
+    it.it_interval.tv_nsec = tick % 1000 * 1000000L;
+    it.it_value            = it.it_interval;
+
+    report_due     = monotime() + report_interval * INT64_C(1000000);
+    report_flushed = monotime();
+
+    if( (report_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1 ||
+        timerfd_settime(report_fd, 0, &it, 0) == -1 ||
+        epoll_ctl(mainloop_epfd, EPOLL_CTL_ADD, report_fd, &ev) == -1 )
+    {
+      mce_log(LL_WARN, "%s: %m", "timerfd");
+    }
+  }
+
+  if( inotify_fd != -1 )
+  {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = HOTPLUG_TAG };
+
+    // devices added since the watch was set up are waiting in the queue
+    if( epoll_ctl(mainloop_epfd, EPOLL_CTL_ADD, inotify_fd, &ev) == -1 )
+    {
+      mce_log(LL_WARN, "%s: hotplug not available: %m", HOTPLUG_DIR);
+      close(inotify_fd), inotify_fd = -1;
+    }
+  }
+
+  while( (device_attached > 0 || inotify_fd != -1) && !mainloop_quit )
+  {
+    struct epoll_event ev[64];
+
+    int n;
+
+    if( mainloop_uring.fd != -1 )
+    {
+      n = uring_wait(ev, numof(ev));
+    }
+    else
+    {
+      n = epoll_wait(mainloop_epfd, ev, numof(ev), timeout);
+    }
+
+    for( int i = 0; i < n; ++i )
+    {
+      uint32_t slot = ev[i].data.u32;
+
+      if( slot == HOTPLUG_TAG )
+      {
+        hotplug_process(inotify_fd, identify);
+      }
+      else if( slot == REPORT_TAG )
+      {
+        uint64_t cnt;
+        if( read(report_fd, &cnt, sizeof cnt) > 0 )
+        {
+          report_periodic();
+        }
+      }
+      else if( slot == MERGE_TAG )
+      {
+        uint64_t cnt;
+        if( read(merge_efd, &cnt, sizeof cnt) == -1 )
+        {
+          // already reset, nothing to do
+        }
+      }
+      else if( device_lut[slot].fd != -1 &&
+               process_events(slot, device_lut[slot].fd,
+                              device_lut[slot].resync,
+                              device_lut[slot].path) <= 0 )
+      {
+        device_detach(slot);
+      }
+    }
+
+    if( merge_efd != -1 )
+    {
+      timeout = merge_process();
+    }
+  }
+
+cleanup:
+
+  for( int i = 0; i < device_cnt; ++i )
+  {
+    device_detach(i);
+  }
+  free(device_lut), device_lut = 0, device_cnt = 0;
+
+  if( mainloop_uring.fd != -1 )
+  {
+    uring_quit(&mainloop_uring);
+    memset(uring_busy, 0, sizeof uring_busy);
+    uring_epoll_armed = false;
+  }
+
+  if( inotify_fd != -1 ) close(inotify_fd);
+  if( report_fd != -1 ) close(report_fd);
+  if( merge_efd != -1 ) close(merge_efd), merge_efd = -1;
+  if( mainloop_epfd != -1 ) close(mainloop_epfd), mainloop_epfd = -1;
+  free(read_buf), read_buf = 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Benchmarks
+ * ------------------------------------------------------------------------- */
+
+/** Get monotonic time stamp in nanoseconds
+ */
+static int64_t bench_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+/** Benchmark: event code name to number lookups
+ */
+static void bench_lookup(void)
+{
+  enum { ROUNDS = 200, NAMES = 2048 };
+
+  static const char *name[NAMES];
+  static int         type[NAMES];
+  size_t             cnt = 0;
+  long               sum[2] = { 0, 0 };
+  int64_t            t[3];
+
+  for( size_t etype = 0; etype < numof(rlookup_lut); ++etype )
+  {
+    for( size_t ecode = 0; ecode < rlookup_lut[etype].cnt; ++ecode )
+    {
+      if( rlookup_lut[etype].lut[ecode] && cnt < NAMES )
+      {
+        name[cnt] = rlookup_lut[etype].lut[ecode];
+        type[cnt] = etype;
+        ++cnt;
+      }
+    }
+  }
+
+  // do not include hash table setup in timings
+  evdev_lookup_event_code(EV_KEY, "KEY_A");
+
+  t[0] = bench_time();
+  for( int r = 0; r < ROUNDS; ++r )
+  {
+    for( size_t i = 0; i < cnt; ++i )
+    {
+      sum[0] += rlookup(rlookup_lut[type[i]].lut, rlookup_lut[type[i]].cnt,
+                        name[i]);
+    }
+  }
+  t[1] = bench_time();
+  for( int r = 0; r < ROUNDS; ++r )
+  {
+    for( size_t i = 0; i < cnt; ++i )
+    {
+      sum[1] += evdev_lookup_event_code(type[i], name[i]);
+    }
+  }
+  t[2] = bench_time();
+
+  printf("lookup: %zu names x %d rounds%s\n", cnt, ROUNDS,
+         sum[0] == sum[1] ? "" : " (RESULTS DIFFER)");
+  printf("lookup: linear scan %10.1f ns/lookup\n",
+         (double)(t[1] - t[0]) / (cnt * ROUNDS));
+  printf("lookup: hash index  %10.1f ns/lookup\n",
+         (double)(t[2] - t[1]) / (cnt * ROUNDS));
+}
+
+/** Fill array with synthetic multitouch events
+ *
+ * Simulates a touch panel with 10 active slots, i.e. the kind of
+ * event stream that is most demanding to keep up with.
+ */
+static void bench_fill_events(struct input_event *eve, int n)
+{
+  struct timeval tv = { .tv_sec = 1500000000, .tv_usec = 0 };
+
+  for( int i = 0; i < n; )
+  {
+    for( int slot = 0; slot < 10 && i < n; ++slot )
+    {
+      static const int code[] = { ABS_MT_SLOT, ABS_MT_POSITION_X,
+                                  ABS_MT_POSITION_Y, ABS_MT_PRESSURE };
+      for( size_t k = 0; k < numof(code) && i < n; ++k, ++i )
+      {
+        eve[i].time  = tv;
+        eve[i].type  = EV_ABS;
+        eve[i].code  = code[k];
+        eve[i].value = (k == 0) ? slot : (int)(i * 7 % 1080);
+      }
+    }
+    if( i < n )
+    {
+      eve[i].time  = tv;
+      eve[i].type  = EV_SYN;
+      eve[i].code  = SYN_REPORT;
+      eve[i].value = 0;
+      ++i;
+    }
+    tv.tv_usec += 1000;
+    if( tv.tv_usec >= 1000000 ) tv.tv_sec += 1, tv.tv_usec = 0;
+  }
+}
+
+/** Benchmark: formatting event batches to text
+ */
+static void bench_format(void)
+{
+  enum { BATCHES = 4000, BATCH = 256 };
+
+  static struct input_event eve[BATCH];
+  const char    *title = "/dev/input/event0";
+  struct timeval tv    = { .tv_sec = 1500000000, .tv_usec = 0 };
+  int            saved_fd;
+  FILE          *ref;
+  int64_t        t[3];
+
+  bench_fill_events(eve, BATCH);
+
+  if( !(ref = fopen("/dev/null", "w")) )
+  {
+    mce_log(LL_ERR, "%s: open: %m", "/dev/null");
+    return;
+  }
+  // stdout is line buffered when tracing
+  setvbuf(ref, 0, _IOLBF, BUFSIZ);
+
+  saved_fd   = outbuf.fd;
+  outbuf.fd  = fileno(ref);
+
+  for( int tod = 0; tod < 2; ++tod )
+  {
+    bool saved_tod   = emit_time_of_day;
+    emit_time_of_day = tod;
+
+    // reference: one printf() per event, as process_events() used to do
+    t[0] = bench_time();
+    for( int b = 0; b < BATCHES; ++b )
+    {
+      char tmp[64], toe[64];
+      *tmp = 0;
+      if( emit_time_of_day )
+      {
+        struct tm tm;
+        time_t    s;
+        gettimeofday(&tv, 0);
+        s = tv.tv_sec;
+        localtime_r(&s, &tm);
+        snprintf(tmp, sizeof tmp, "%04d-%02d-%02d %02d:%02d:%02d.%03ld - ",
+                 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                 tm.tm_hour, tm.tm_min, tm.tm_sec,
+                 (long)(tv.tv_usec / 1000));
+      }
+      for( int i = 0; i < BATCH; ++i )
+      {
+        const struct input_event *e = &eve[i];
+        snprintf(toe, sizeof toe, "%ld.%03ld - ",
+                 (long)e->time.tv_sec, (long)e->time.tv_usec / 1000);
+        fprintf(ref, "%s: %s%s0x%02x/%s - 0x%03x/%s - %d\n",
+                title, tmp, toe,
+                e->type, evdev_get_event_type_name(e->type),
+                e->code, evdev_get_event_code_name(e->type, e->code),
+                e->value);
+      }
+    }
+    t[1] = bench_time();
+    for( int b = 0; b < BATCHES; ++b )
+    {
+      gettimeofday(&tv, 0);
+      show_events(title, &tv, eve, BATCH);
+      outbuf_flush();
+    }
+    t[2] = bench_time();
+
+    emit_time_of_day = saved_tod;
+
+    printf("format%s: %d batches x %d events\n",
+           tod ? " (tod)" : "", BATCHES, BATCH);
+    printf("format%s: printf per event %10.0f events/s\n", tod ? " (tod)" : "",
+           1e9 * BATCHES * BATCH / (t[1] - t[0]));
+    printf("format%s: batch formatter  %10.0f events/s\n", tod ? " (tod)" : "",
+           1e9 * BATCHES * BATCH / (t[2] - t[1]));
+  }
+
+  outbuf.fd = saved_fd;
+  fclose(ref);
+}
+
+/** Number of pipes standing in for input devices in reader benchmark */
+#define BENCH_PIPES 8
+
+/** Reader benchmark state shared with the writer thread */
+typedef struct
+{
+  int rd[BENCH_PIPES];
+  int wr[BENCH_PIPES];
+  int stop;
+} bench_pipes_t;
+
+/** Reader benchmark writer thread, feeds event batches into pipes
+ */
+static void *bench_writer(void *aptr)
+{
+  bench_pipes_t     *bp = aptr;
+  struct input_event eve[8];
+
+  bench_fill_events(eve, numof(eve));
+
+  for( unsigned i = 0; !__atomic_load_n(&bp->stop, __ATOMIC_RELAXED); ++i )
+  {
+    if( write(bp->wr[i % BENCH_PIPES], eve, sizeof eve) == -1 &&
+        errno != EINTR )
+    {
+      break;
+    }
+  }
+  return 0;
+}
+
+/** Get thread cpu time in nanoseconds
+ */
+static int64_t bench_cpu_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+/** Benchmark: reading events with epoll + read vs. io_uring
+ *
+ * Pipes fed by a writer thread stand in for input devices; only the
+ * reading side is measured.
+ */
+static void bench_reader(void)
+{
+  enum { EVENTS = 1000000 };
+
+  struct sigaction sa, old;
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, &old);
+
+  for( int backend = 0; backend < 2; ++backend )
+  {
+    static struct input_event buf[256];
+
+    bench_pipes_t bp;
+    pthread_t     writer;
+    uring_t       ur    = { .fd = -1 };
+    int           epfd  = -1;
+    long          calls = 0;
+    long          wakes = 0;
+    long          evcnt = 0;
+    int64_t       cpu;
+
+    memset(&bp, 0, sizeof bp);
+    for( int i = 0; i < BENCH_PIPES; ++i )
+    {
+      int fd[2];
+      if( pipe(fd) == -1 )
+      {
+        mce_log(LL_ERR, "%s: %m", "pipe");
+        goto cleanup;
+      }
+      bp.rd[i] = fd[0], bp.wr[i] = fd[1];
+    }
+
+    if( backend == 0 )
+    {
+      epfd = epoll_create1(EPOLL_CLOEXEC);
+      for( int i = 0; i < BENCH_PIPES; ++i )
+      {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, bp.rd[i], &ev);
+      }
+    }
+    else if( uring_init(&ur, 64, BENCH_PIPES, numof(buf)) == -1 )
+    {
+      mce_log(LL_WARN, "io_uring not available: %m; %s", "skipped");
+      goto cleanup;
+    }
+    else
+    {
+      for( int i = 0; i < BENCH_PIPES; ++i )
+      {
+        uring_read(&ur, bp.rd[i], i, i);
+      }
+    }
+
+    pthread_create(&writer, 0, bench_writer, &bp);
+    cpu = bench_cpu_time();
+
+    while( evcnt < EVENTS )
+    {
+      ++wakes;
+      if( backend == 0 )
+      {
+        struct epoll_event ev[BENCH_PIPES];
+        int n = epoll_wait(epfd, ev, numof(ev), -1);
+        ++calls;
+        for( int i = 0; i < n; ++i )
+        {
+          int rc = read(bp.rd[ev[i].data.u32], buf, sizeof buf);
+          ++calls;
+          if( rc > 0 ) evcnt += rc / sizeof *buf;
+        }
+      }
+      else
+      {
+        struct io_uring_cqe *cqe;
+        uring_enter(&ur, 1);
+        while( (cqe = uring_peek(&ur)) )
+        {
+          int i = (int)cqe->user_data;
+          if( cqe->res > 0 ) evcnt += cqe->res / sizeof *buf;
+          uring_advance(&ur);
+          uring_read(&ur, bp.rd[i], i, i);
+        }
+      }
+    }
+
+    cpu = bench_cpu_time() - cpu;
+    if( backend == 1 )
+    {
+      calls = ur.enters;
+    }
+
+    __atomic_store_n(&bp.stop, 1, __ATOMIC_RELAXED);
+    uring_quit(&ur);
+    for( int i = 0; i < BENCH_PIPES; ++i )
+    {
+      close(bp.rd[i]), bp.rd[i] = 0;
+    }
+    pthread_join(writer, 0);
+
+    printf("reader: %-10s %8.0f syscalls/Mev %8.1f cpu ms/Mev"
+           " %6.1f events/wakeup\n",
+           backend ? "io_uring" : "epoll+read",
+           calls * 1e6 / evcnt, cpu * 1e-6 * 1e6 / evcnt,
+           (double)evcnt / wakes);
+
+  cleanup:
+    if( epfd != -1 ) close(epfd);
+    for( int i = 0; i < BENCH_PIPES; ++i )
+    {
+      if( bp.rd[i] > 0 ) close(bp.rd[i]);
+      if( bp.wr[i] > 0 ) close(bp.wr[i]);
+    }
+  }
+
+  sigaction(SIGPIPE, &old, 0);
+}
+
+/** Benchmark: compact capture record encoding
+ */
+static void bench_delta(void)
+{
+  enum { BATCHES = 4000, BATCH = 256 };
+
+  static struct input_event eve[BATCH];
+  struct timeval tv;
+  int64_t        t0, t1;
+  double         raw;
+
+  if( (evrec_fd = open("/dev/null", O_WRONLY)) == -1 )
+  {
+    mce_log(LL_ERR, "%s: %m", "/dev/null");
+    return;
+  }
+  evrec_path = "/dev/null";
+  bench_fill_events(eve, BATCH);
+
+  t0 = bench_time();
+  for( int b = 0; b < BATCHES; ++b )
+  {
+    for( int i = 0; i < BATCH; ++i )
+    {
+      eve[i].time.tv_sec += 1;
+    }
+    tv = eve[BATCH - 1].time;
+    evdelta_add(0, &tv, eve, BATCH);
+  }
+  evdelta_flush();
+  evrec_flush();
+  t1 = bench_time();
+
+  raw = (double)BATCHES * (sizeof (evrec_head_t) + sizeof eve);
+  printf("delta: %6.1f ns/event %6.2f bytes/event %5.1fx smaller than raw\n",
+         (double)(t1 - t0) / (BATCHES * BATCH),
+         (double)evdelta.bytes / (BATCHES * BATCH), raw / evdelta.bytes);
+
+  close(evrec_fd), evrec_fd = -1;
+}
+
+/** Available benchmarks */
+static const struct
+{
+  const char *name;
+  void      (*func)(void);
+} bench_lut[] =
+{
+  { "lookup", bench_lookup },
+  { "format", bench_format },
+  { "reader", bench_reader },
+  { "delta",  bench_delta  },
+};
+
+/** Run built-in benchmarks
+ *
+ * @param which name of benchmark to run, or NULL to run all
+ *
+ * @return 0 on success, or -1 if no such benchmark exists
+ */
+static int run_benchmarks(const char *which)
+{
+  int err = -1;
+
+  for( size_t i = 0; i < numof(bench_lut); ++i )
+  {
+    if( !which || !strcmp(which, bench_lut[i].name) )
+    {
+      bench_lut[i].func();
+      err = 0;
+    }
+  }
+
+  if( err )
+  {
+    mce_log(LL_ERR, "%s: unknown benchmark", which);
+  }
+  return err;
+}
+
+/** Configuration table for long command line options */
+static struct option optL[] =
+{
+  { "help",          0, 0, 'h' },
+  { "trace",         0, 0, 't' },
+  { "identify",      0, 0, 'i' },
+  { "emit-also-tod", 0, 0, 'e' },
+  { "emit-only-tod", 0, 0, 'E' },
+  { "record",        1, 0, 'r' },
+  { "replay",        1, 0, 'R' },
+  { "benchmark",     2, 0, 'B' },
+  { "threads",       0, 0, 'T' },
+  { "uring",         0, 0, 'u' },
+  { "latency",       2, 0, 'l' },
+  { "stats",         2, 0, 's' },
+  { "filter",        1, 0, 'f' },
+  { "format",        1, 0, 'F' },
+  { "frames",        0, 0, 'm' },
+  { "batch",         1, 0, 'b' },
+  { "no-resync",     0, 0, 'n' },
+  { "compact",       0, 0, 'z' },
+  { "analyze",       1, 0, 'A' },
+  { "publish",       2, 0, 'P' },
+  { "subscribe",     2, 0, 'S' },
+  { "no-cache",      0, 0, 'C' },
+  { "publish-group", 1, 0, 'g' },
+  { 0,0,0,0 }
+};
+
+/** Configuration string for short command line options */
 static const char optS[] =
 "h" // --help
 "t" // --trace
 "i" // --identify
 "e" // --emit-also-tod
 "E" // --emit-only-tod
+"r:" // --record
+"R:" // --replay
+"B::" // --benchmark
+"T" // --threads
+"u" // --uring
+"l::" // --latency
+"s::" // --stats
+"f:" // --filter
+"F:" // --format
+"m" // --frames
+"b:" // --batch
+"n" // --no-resync
+"z" // --compact
+"A:" // --analyze
+"P::" // --publish
+"S::" // --subscribe
+"C" // --no-cache
+"g:" // --publish-group
 ;
 
 /** Program name string */
@@ -1403,12 +7494,60 @@ static void usage(void)
          "  -t, --trace          -- trace input events\n"
          "  -e, --emit-also-tod  -- emit also time of day\n"
          "  -E, --emit-only-tod  -- emit only time of day\n"
+         "  -r, --record=FILE    -- append raw events to capture file\n"
+         "  -z, --compact        -- delta encode recorded events, about\n"
+         "                          5-10x smaller than raw capture\n"
+         "  -R, --replay=FILE    -- show events from capture file\n"
+         "  -A, --analyze=FILE   -- summarize event rates, frame jitter,\n"
+         "                          stuck keys and touch frame gaps in\n"
+         "                          capture file\n"
+         "  -P, --publish[=NAME] -- publish events in shared memory ring\n"
+         "                          for evshm.h clients instead of showing\n"
+         "                          them, NAME defaults to evdev_trace\n"
+         "  -g, --publish-group=GROUP -- let GROUP read the published\n"
+         "                          ring, by default only the owner can\n"
+         "                          read it\n"
+         "  -S, --subscribe[=NAME] -- show events published by another\n"
+         "                          evdev_trace instance\n"
+         "  -T, --threads        -- read each device in a separate thread\n"
+         "  -u, --uring          -- read devices via io_uring if available,\n"
+         "                          at most 1024 events per read\n"
+         "  -f, --filter=EXPR    -- trace only selected events, e.g.\n"
+         "                          EV_ABS:ABS_MT_*,EV_KEY:KEY_POWER\n"
+         "  -F, --format=FORMAT  -- output format: text, json, csv or tsv\n"
+         "  -m, --frames         -- show one line per SYN_REPORT frame with\n"
+         "                          multitouch contacts and key changes\n"
+         "  -l, --latency[=SEC]  -- show read latency histograms instead\n"
+         "                          of events, every SEC seconds (10)\n"
+         "  -s, --stats[=MS]     -- show event rate summary instead of\n"
+         "                          events, refreshed every MS ms (1000)\n"
+         "  -b, --batch=EVENTS   -- events to read per system call (256)\n"
+         "  -n, --no-resync      -- show events after SYN_DROPPED as is\n"
+         "  -C, --no-cache       -- query device capabilities from the\n"
+         "                          devices instead of the cache\n"
+         "  -B, --benchmark[=NAME] -- run built-in benchmarks and exit\n"
+         "                          NAME: lookup, format, reader or delta\n"
          "\n"
          "NOTES\n"
-         "  If no device paths are given, /dev/input/event* is assumed.\n"
+         "  If no device paths are given, /dev/input/event* is assumed and\n"
+         "  devices that are added while tracing are picked up too.\n"
          "  \n"
          "  Full device path is not required, \"/dev/input/event1\" can\n"
          "  be shortened to \"event1\" or just \"1\".\n"
+         "  \n"
+         "  EV_SYN events are never filtered out.\n"
+         "  \n"
+         "  After SYN_DROPPED the partial frame that follows is discarded\n"
+         "  and device state changes missed in the overrun are emitted as\n"
+         "  a synthetic frame instead.\n"
+         "  \n"
+         "  Device capabilities are cached in\n"
+         "  $XDG_CACHE_HOME/evdev_trace.caps, keyed by device path, id,\n"
+         "  name, phys, uniq and sysfs instance. When identifying several\n"
+         "  devices, they are probed concurrently.\n"
+         "  \n"
+         "  When recording, events are written to the capture file instead\n"
+         "  of stdout; use --replay to render them later on.\n"
          "\n",
          progname);
 }
@@ -1460,6 +7599,13 @@ main(int argc, char **argv)
   int f_trace    = 0;
   int f_identify = 0;
 
+  const char *record_path = 0;
+  const char *replay_path = 0;
+  const char *analyze_path = 0;
+  const char *follow_name  = 0;
+
+  struct sigaction sa;
+
   setlinebuf(stdout);
 
   glob_t gb;
@@ -1500,6 +7646,115 @@ main(int argc, char **argv)
       emit_event_time  = false;
       break;
 
+    case 'r':
+      record_path = optarg;
+      f_trace = 1;
+      break;
+
+    case 'R':
+      replay_path = optarg;
+      break;
+
+    case 'A':
+      analyze_path = optarg;
+      break;
+
+    case 'P':
+      evshm_name = optarg ?: EVSHM_DEFAULT_NAME;
+      f_trace = 1;
+      break;
+
+    case 'g':
+      evshm_group = optarg;
+      break;
+
+    case 'S':
+      follow_name = optarg ?: EVSHM_DEFAULT_NAME;
+      break;
+
+    case 'T':
+      use_threads = true;
+      break;
+
+    case 'u':
+      use_uring = true;
+      break;
+
+    case 'f':
+      if( filter_parse(optarg) == -1 )
+      {
+        goto cleanup;
+      }
+      break;
+
+    case 'F':
+      if( format_parse(optarg) == -1 )
+      {
+        goto cleanup;
+      }
+      break;
+
+    case 'm':
+      frames_mode = true;
+      break;
+
+    case 'b':
+      read_batch = strtol(optarg, 0, 0);
+      if( read_batch < 1 || read_batch > READ_BATCH_MAX )
+      {
+        mce_log(LL_ERR, "%s: batch size must be 1 - %d", optarg,
+                READ_BATCH_MAX);
+        goto cleanup;
+      }
+      break;
+
+    case 'n':
+      resync_enabled = false;
+      break;
+
+    case 'z':
+      evdelta_mode = true;
+      break;
+
+    case 'C':
+      evcache_enabled = false;
+      break;
+
+    case 'l':
+    case 's':
+      {
+        // seconds for latency, milliseconds for stats
+        long  scale = (opt == 'l') ? 1000 : 1;
+        long  val   = (opt == 'l') ? 10 : 1000;
+        char *end   = 0;
+
+        if( optarg )
+        {
+          val = strtol(optarg, &end, 0);
+        }
+        if( (end && (end == optarg || *end)) ||
+            val < 1 || val > INT_MAX / scale )
+        {
+          mce_log(LL_ERR, "%s: report interval must be a positive number",
+                  optarg);
+          goto cleanup;
+        }
+        report_interval = val * scale;
+      }
+      if( opt == 'l' )
+        latency_mode = true;
+      else
+        stats_mode = true;
+      f_trace = 1;
+      break;
+
+    case 'B':
+      if( run_benchmarks(optarg) == 0 )
+      {
+        result = EXIT_SUCCESS;
+      }
+      goto cleanup;
+
     case '?':
     case ':':
       goto cleanup;
@@ -1510,11 +7765,59 @@ main(int argc, char **argv)
     }
   }
 
+  if( latency_mode && stats_mode )
+  {
+    mce_log(LL_ERR, "%s", "--latency and --stats can't be used together");
+    goto cleanup;
+  }
+
+  if( replay_path )
+  {
+    if( evrec_replay(replay_path) == 0 )
+    {
+      result = EXIT_SUCCESS;
+    }
+    goto cleanup;
+  }
+
+  if( analyze_path )
+  {
+    if( analyze_file(analyze_path) == 0 )
+    {
+      result = EXIT_SUCCESS;
+    }
+    goto cleanup;
+  }
+
   if( !f_identify && !f_trace )
   {
     f_identify = 1;
   }
 
+  if( record_path && evrec_open(record_path) == -1 )
+  {
+    goto cleanup;
+  }
+
+  if( evshm_name && evshm_create(evshm_name) == -1 )
+  {
+    goto cleanup;
+  }
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = mainloop_quit_cb;
+  sigaction(SIGINT, &sa, 0);
+  sigaction(SIGTERM, &sa, 0);
+
+  if( follow_name )
+  {
+    if( evshm_follow(follow_name) == 0 )
+    {
+      result = EXIT_SUCCESS;
+    }
+    goto cleanup;
+  }
+
   if( optind < argc )
   {
     argc = 0;
@@ -1523,7 +7826,7 @@ main(int argc, char **argv)
       char *path = get_device_path(argv[i]);
       if( path ) argv[argc++] = path;
     }
-    mainloop(argv, argc, f_identify, f_trace);
+    mainloop(argv, argc, f_identify, f_trace, -1);
     while( argc > 0 )
     {
       free(argv[--argc]);
@@ -1533,19 +7836,27 @@ main(int argc, char **argv)
   {
     static const char pattern[] = "/dev/input/event*";
 
-    if( glob(pattern, 0, 0, &gb) != 0 )
+    int inotify_fd = f_trace ? hotplug_watch() : -1;
+    int rc         = glob(pattern, 0, 0, &gb);
+
+    // when tracing, devices can still show up later on
+    if( rc != 0 && !(rc == GLOB_NOMATCH && f_trace) )
     {
       printf("%s: no matching files found\n", pattern);
+      if( inotify_fd != -1 ) close(inotify_fd);
       goto cleanup;
     }
 
-    mainloop(gb.gl_pathv, gb.gl_pathc, f_identify, f_trace);
+    mainloop(gb.gl_pathv, gb.gl_pathc, f_identify, f_trace, inotify_fd);
   }
 
   result = EXIT_SUCCESS;
 
 cleanup:
 
+  evrec_close();
+  evshm_destroy();
+  evcache_save();
   globfree(&gb);
 
   return result;
@@ -0,0 +1,68 @@
+// Control protocol of fakekey --daemon
+//
+// The daemon keeps its virtual keyboard alive and listens on a Unix stream
+// socket. A client sends requests, each a FakekeyRequest header followed by
+// size bytes of payload, and gets one FakekeyReply per request, in order.
+// Requests are served one at a time, so a reply also means that the events
+// have been written to the device. All integers are in host byte order.
+//
+// Typing "hi" at 20 characters per second:
+//
+//   FakekeyRequest request = {FakekeyType, 0, 4 + 2};
+//   uint32_t rate = 20;
+//   write(sock, &request, sizeof(request));
+//   write(sock, &rate, sizeof(rate));
+//   write(sock, "hi", 2);
+//   read(sock, &reply, sizeof(reply));
+
+#ifndef FAKEKEY_CONTROL_H
+#define FAKEKEY_CONTROL_H
+
+#include <stdint.h>
+
+enum FakekeyOp {
+  // No payload, replied to right away
+  FakekeyPing = 0,
+  // Array of FakekeyEvent, written to the device as is
+  FakekeyEvents = 1,
+  // Array of FakekeyKey, clicked one after another
+  FakekeyClick = 2,
+  // uint32_t characters per second (0 for as fast as possible) followed by
+  // UTF-8 text, typed with the daemon's keymap
+  FakekeyType = 3,
+  // Array of FakekeyKey held down together, pressed in order and released
+  // in reverse, inside the modifiers of all of them: {KEY_DELETE, 0x14} is
+  // ctrl-alt-delete
+  FakekeyChord = 4,
+};
+
+enum FakekeyStatus {
+  FakekeyOk = 0,
+  FakekeyBadRequest = 1,
+};
+
+struct FakekeyRequest {
+  uint8_t op;
+  uint8_t reserved;
+  uint16_t size; // payload bytes
+};
+
+struct FakekeyEvent {
+  uint16_t type;
+  uint16_t code;
+  int32_t value;
+};
+
+struct FakekeyKey {
+  uint16_t code;
+  uint16_t modifiers; // Modifiers bits of main.cpp, e.g. 0x01 left shift
+};
+
+struct FakekeyReply {
+  uint8_t op;
+  uint8_t status;
+  uint16_t skipped; // characters not in the keymap
+  uint32_t events;  // events written
+};
+
+#endif // FAKEKEY_CONTROL_H
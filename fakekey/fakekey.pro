@@ -1,3 +1,5 @@
 TARGET = fakekey
 
 SOURCES = main.cpp
+HEADERS = control.h
+LIBS += -lpthread
@@ -1,148 +1,2854 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <linux/uinput.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "control.h"
+
 void emit(int fd, int type, int code, int val) {
   struct input_event ie;
 
-  ie.type = type;
-  ie.code = code;
-  ie.value = val;
-  /* timestamp values below are ignored */
-  ie.time.tv_sec = 0;
-  ie.time.tv_usec = 0;
+  ie.type = type;
+  ie.code = code;
+  ie.value = val;
+  /* timestamp values below are ignored */
+  ie.time.tv_sec = 0;
+  ie.time.tv_usec = 0;
+
+  int written = write(fd, &ie, sizeof(ie)) != sizeof(ie);
+  if (written != sizeof(ie)) {
+    // syslog(LOG_lERR, "partial write, %d vs %llu!", written, sizeof(ie));
+    // exit(1);
+  }
+}
+
+enum Options {
+  None = 0x0,
+  Sleep = 0x1,
+  Log = 0x2,
+  SleepAndLog = Sleep | Log,
+};
+
+enum Modifiers {
+  NoMods = 0x00,
+  LeftShift = 0x01,
+  RightShift = 0x02,
+  LeftAlt = 0x04,
+  RightAlt = 0x08,
+  LeftCtrl = 0x10,
+  RightCtrl = 0x20,
+  Meta = 0x40,
+};
+
+// Modifier keys in the order they are pressed and released
+static const struct {
+  Modifiers mask;
+  int code;
+} modifierKeys[] = {
+    {Modifiers::LeftShift, KEY_LEFTSHIFT},
+    {Modifiers::RightShift, KEY_RIGHTSHIFT},
+    {Modifiers::LeftAlt, KEY_LEFTALT},
+    {Modifiers::RightAlt, KEY_RIGHTALT},
+    {Modifiers::LeftCtrl, KEY_LEFTCTRL},
+    {Modifiers::RightCtrl, KEY_RIGHTCTRL},
+    {Modifiers::Meta, KEY_OPTION},
+};
+
+// Writes events to uinput, retrying partial writes
+void writeEvents(int fd, const struct input_event *events, size_t count) {
+  const char *buf = reinterpret_cast<const char *>(events);
+  size_t todo = count * sizeof(events[0]);
+
+  while (todo > 0) {
+    ssize_t done = write(fd, buf, todo);
+    if (done < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("write");
+      exit(1);
+    }
+    buf += done;
+    todo -= done;
+  }
+}
+
+// Size of the event buffer evdev gives each reader of a device: eight
+// packets of the most events the device reports at once, at least 64 and
+// rounded up to a power of two (see evdev_compute_buffer_size() and
+// input_estimate_events_per_packet() in the kernel). A reader that falls
+// further behind loses events to SYN_DROPPED.
+static size_t evdevClientBuffer(int axes = 0, int mtAxes = 0, int slots = 0,
+                                int rels = 0) {
+  // SYN_REPORT, plus room for key and MSC events
+  size_t packet = 1 + axes + mtAxes * slots + rels + 7;
+  size_t size = 64;
+  while (size < packet * 8) {
+    size *= 2;
+  }
+  return size;
+}
+
+// Collects input events so that a whole modifier+key+SYN_REPORT sequence
+// reaches uinput with a single write() instead of one write per event.
+// Events are only sent on submit(), or when the buffer fills up.
+class Frame {
+public:
+  explicit Frame(int fd) : fd(fd) {}
+
+  // Appends the events to sink instead of writing them anywhere
+  explicit Frame(std::vector<struct input_event> &sink) : sink(&sink) {}
+
+  void add(int type, int code, int val) {
+    if (count == MaxEvents) {
+      submit();
+    }
+
+    struct input_event &ie = events[count++];
+    /* timestamp values are ignored */
+    memset(&ie, 0, sizeof(ie));
+    ie.type = type;
+    ie.code = code;
+    ie.value = val;
+  }
+
+  // Key state change as a frame of its own
+  void key(int code, int val) {
+    add(EV_KEY, code, val);
+    add(EV_SYN, SYN_REPORT, 0);
+  }
+
+  void press(int code, Modifiers modifiers = Modifiers::NoMods) {
+    for (const auto &mod : modifierKeys) {
+      if (modifiers & mod.mask) {
+        key(mod.code, 1);
+      }
+    }
+    key(code, 1);
+  }
+
+  void release(int code, Modifiers modifiers = Modifiers::NoMods) {
+    key(code, 0);
+    for (const auto &mod : modifierKeys) {
+      if (modifiers & mod.mask) {
+        key(mod.code, 0);
+      }
+    }
+  }
+
+  void click(int code, Modifiers modifiers = Modifiers::NoMods) {
+    press(code, modifiers);
+    release(code, modifiers);
+  }
+
+  void submit() {
+    if (sink) {
+      sink->insert(sink->end(), events, events + count);
+    } else {
+      writeEvents(fd, events, count);
+    }
+    count = 0;
+  }
+
+  // Buffered events, for sending them some other way
+  const struct input_event *data() const { return events; }
+  int size() const { return count; }
+  void clear() { count = 0; }
+
+private:
+  static const int MaxEvents = 64;
+
+  int fd = -1;
+  std::vector<struct input_event> *sink = nullptr;
+  int count = 0;
+  struct input_event events[MaxEvents];
+};
+
+// Adds keystrokes to a Frame while keeping track of which modifiers are
+// down, so that consecutive keystrokes only change the modifiers that
+// differ: "HELLO" presses shift once instead of five times. Modifiers
+// stay down until a keystroke does not want them or releaseAll().
+class Injector {
+public:
+  explicit Injector(Frame &frame) : frame(frame) {}
+
+  ~Injector() { releaseAll(); }
+
+  Injector(const Injector &) = delete;
+  Injector &operator=(const Injector &) = delete;
+
+  // Brings the modifiers into exactly the given state
+  void setModifiers(Modifiers modifiers) {
+    for (const auto &mod : modifierKeys) {
+      if ((held & mod.mask) && !(modifiers & mod.mask)) {
+        frame.key(mod.code, 0);
+      }
+    }
+    for (const auto &mod : modifierKeys) {
+      if (!(held & mod.mask) && (modifiers & mod.mask)) {
+        frame.key(mod.code, 1);
+      }
+    }
+    held = modifiers;
+  }
+
+  void click(int code, Modifiers modifiers = Modifiers::NoMods) {
+    setModifiers(modifiers);
+    frame.key(code, 1);
+    frame.key(code, 0);
+  }
+
+  // Holds keys down together, pressed in order and released in reverse,
+  // e.g. chord({KEY_DELETE}, Modifiers(LeftCtrl | LeftAlt))
+  void chord(const std::vector<int> &codes,
+             Modifiers modifiers = Modifiers::NoMods) {
+    setModifiers(modifiers);
+    for (int code : codes) {
+      frame.key(code, 1);
+    }
+    for (auto it = codes.rbegin(); it != codes.rend(); ++it) {
+      frame.key(*it, 0);
+    }
+  }
+
+  void releaseAll() { setModifiers(Modifiers::NoMods); }
+
+  Modifiers modifiers() const { return held; }
+
+private:
+  Frame &frame;
+  Modifiers held = Modifiers::NoMods;
+};
+
+// Paces injection against absolute CLOCK_MONOTONIC deadlines, so that
+// time spent writing does not add up the way repeated usleep() calls
+// do. Sleeping ends spinNs before a deadline and the rest is spent
+// polling the clock, which trades CPU for precision. Lateness of every
+// wait is recorded for report().
+class Scheduler {
+public:
+  enum Clock {
+    NanoSleep,
+    TimerFd,
+  };
+
+  ~Scheduler() {
+    if (timerFd != -1) {
+      close(timerFd);
+    }
+  }
+
+  void configure(Clock clock, int64_t spinNs) {
+    this->clock = clock;
+    this->spinNs = spinNs;
+  }
+
+  // Waits the way another scheduler does, for schedulers of other threads
+  void configure(const Scheduler &other) {
+    configure(other.clock, other.spinNs);
+  }
+
+  // Makes offsets count from now
+  void start() { origin = last = now(); }
+
+  int64_t startTime() const { return origin; }
+
+  // Waits until offsetNs after start()
+  void waitFor(int64_t offsetNs) {
+    if (origin == 0) {
+      start();
+    }
+    last = origin + offsetNs;
+    sleepUntil(last - spinNs);
+    int64_t t;
+    while ((t = now()) < last) {
+    }
+    record(t - last);
+  }
+
+  // Waits until intervalNs after the previous deadline; after being idle
+  // for longer than that, the interval counts from now instead
+  void delay(int64_t intervalNs) {
+    if (origin == 0 || now() > last + intervalNs) {
+      last = now();
+    }
+    waitFor(last - origin + intervalNs);
+  }
+
+  // Number of waits, and microseconds of lateness per wait; percentiles
+  // are accurate to the bucket size
+  void report(FILE *out) const {
+    if (!waits) {
+      return;
+    }
+
+    auto percentile = [&](double p) {
+      uint64_t rank = uint64_t(p * (waits - 1)), seen = 0;
+      for (int b = 0; b < Buckets; ++b) {
+        if ((seen += buckets[b]) > rank) {
+          return std::min(bucketValue(b), worst) / 1e3;
+        }
+      }
+      return worst / 1e3;
+    };
+
+    fprintf(out,
+            "timing error over %" PRIu64 " waits (us): mean %.1f, "
+            "median %.1f, p99 %.1f, max %.1f\n",
+            waits, sum / waits / 1e3, percentile(0.5), percentile(0.99),
+            worst / 1e3);
+  }
+
+  static int64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+  }
+
+private:
+  // Lateness is counted in buckets an eighth of a power of two wide, so
+  // that the record stays the same size however long the daemon runs
+  static const int Buckets = 16 + 60 * 8;
+
+  static int bucketOf(int64_t ns) {
+    if (ns < 16) {
+      return int(std::max<int64_t>(ns, 0));
+    }
+    int log2 = 63 - __builtin_clzll(uint64_t(ns));
+    return 16 + (log2 - 4) * 8 + int(ns >> (log2 - 3) & 7);
+  }
+
+  // Middle of a bucket
+  static int64_t bucketValue(int bucket) {
+    if (bucket < 16) {
+      return bucket;
+    }
+    int log2 = (bucket - 16) / 8 + 4;
+    int64_t low = int64_t(8 + (bucket - 16) % 8) << (log2 - 3);
+    return low + (int64_t(1) << (log2 - 4));
+  }
+
+  void record(int64_t ns) {
+    ++buckets[bucketOf(ns)];
+    ++waits;
+    sum += ns;
+    worst = std::max(worst, ns);
+  }
+
+  void sleepUntil(int64_t deadline) {
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+
+    if (clock == Clock::TimerFd) {
+      if (timerFd == -1 &&
+          (timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) {
+        perror("timerfd_create");
+        exit(1);
+      }
+
+      struct itimerspec its;
+      memset(&its, 0, sizeof(its));
+      its.it_value = ts;
+      if (deadline <= now()) {
+        return;
+      }
+      if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &its, nullptr) < 0) {
+        perror("timerfd_settime");
+        exit(1);
+      }
+
+      uint64_t expirations;
+      while (read(timerFd, &expirations, sizeof(expirations)) < 0 &&
+             errno == EINTR) {
+      }
+    } else {
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) ==
+             EINTR) {
+      }
+    }
+  }
+
+  Clock clock = Clock::NanoSleep;
+  int64_t spinNs = 0;
+  int timerFd = -1;
+  int64_t origin = 0;
+  int64_t last = 0;
+  uint64_t buckets[Buckets] = {};
+  uint64_t waits = 0;
+  double sum = 0;
+  int64_t worst = 0;
+};
+
+// Used for Options::Sleep and for pacing typed text
+static Scheduler scheduler;
+
+void press(int fd, int code, Modifiers modifiers = Modifiers::NoMods,
+           Options options = Options::Log) {
+  Frame frame(fd);
+  frame.press(code, modifiers);
+  frame.submit();
+
+  if (options & Options::Log) {
+    syslog(LOG_DEBUG, "pressed %d", code);
+  }
+  if (options & Options::Sleep) {
+    scheduler.delay(200 * 1000000);
+  }
+}
+
+void release(int fd, int code, Modifiers modifiers = Modifiers::NoMods,
+             Options options = Options::Log) {
+  Frame frame(fd);
+  frame.release(code, modifiers);
+  frame.submit();
+
+  if (options & Options::Log) {
+    syslog(LOG_DEBUG, "released %d", code);
+  }
+  if (options & Options::Sleep) {
+    scheduler.delay(200 * 1000000);
+  }
+}
+
+void click(int fd, int code, Modifiers modifiers = Modifiers::NoMods,
+           Options options = Options::Log) {
+  Frame frame(fd);
+  frame.click(code, modifiers);
+  frame.submit();
+
+  syslog(LOG_DEBUG, "pressed %d", code);
+  syslog(LOG_DEBUG, "released %d", code);
+  if (options & Options::Log) {
+    syslog(LOG_DEBUG, "clicked %d", code);
+  }
+  if (options & Options::Sleep) {
+    scheduler.delay(200 * 1000000);
+  }
+}
+
+static double monotonicSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Injects shifted F24 clicks, which nothing should react to, first with
+// one write() per event as emit() does and then one write() per click.
+void benchmark(int fd, int clicks) {
+  const int code = KEY_F24;
+  const Modifiers modifiers = Modifiers::LeftShift;
+  Frame frame(fd);
+  int events = 0;
+
+  double start = monotonicSeconds();
+  for (int i = 0; i < clicks; ++i) {
+    frame.click(code, modifiers);
+    events = frame.size();
+    for (int e = 0; e < events; ++e) {
+      const struct input_event &ie = frame.data()[e];
+      emit(fd, ie.type, ie.code, ie.value);
+    }
+    frame.clear();
+  }
+  double perEvent = monotonicSeconds() - start;
+
+  start = monotonicSeconds();
+  for (int i = 0; i < clicks; ++i) {
+    frame.click(code, modifiers);
+    frame.submit();
+  }
+  double perClick = monotonicSeconds() - start;
+
+  int heldEvents = 0;
+  start = monotonicSeconds();
+  {
+    Injector injector(frame);
+    for (int i = 0; i < clicks; ++i) {
+      injector.click(code, modifiers);
+      heldEvents += frame.size();
+      frame.submit();
+    }
+  }
+  frame.submit();
+  double heldShift = monotonicSeconds() - start;
+
+  printf("%d shifted clicks, %d events each\n", clicks, events);
+  printf("write per event: %10.0f keys/s, %d writes/key\n",
+         clicks / perEvent, events);
+  printf("write per click: %10.0f keys/s, 1 write/key (%.1fx)\n",
+         clicks / perClick, perEvent / perClick);
+  printf("shift held:      %10.0f keys/s, %.1f events/key (%.1fx)\n",
+         clicks / heldShift, double(heldEvents) / clicks,
+         perEvent / heldShift);
+}
+
+void writeSentence(int fd) {
+  click(fd, KEY_F);
+  click(fd, KEY_R);
+  click(fd, KEY_O);
+  click(fd, KEY_M);
+  click(fd, KEY_SPACE);
+  click(fd, KEY_T);
+  click(fd, KEY_H);
+  click(fd, KEY_E);
+  click(fd, KEY_SPACE);
+  click(fd, KEY_G);
+  click(fd, KEY_H);
+  click(fd, KEY_O);
+  click(fd, KEY_S);
+  click(fd, KEY_T);
+}
+
+// Key that types a character, with the modifiers it needs
+struct KeyStroke {
+  int code;
+  Modifiers modifiers;
+};
+
+struct KeymapEntry {
+  char32_t ch;
+  KeyStroke stroke;
+};
+
+// US layout, used unless some other layout is loaded
+static constexpr KeymapEntry usKeymap[] = {
+    {U'a', {KEY_A, Modifiers::NoMods}}, {U'A', {KEY_A, Modifiers::LeftShift}},
+    {U'b', {KEY_B, Modifiers::NoMods}}, {U'B', {KEY_B, Modifiers::LeftShift}},
+    {U'c', {KEY_C, Modifiers::NoMods}}, {U'C', {KEY_C, Modifiers::LeftShift}},
+    {U'd', {KEY_D, Modifiers::NoMods}}, {U'D', {KEY_D, Modifiers::LeftShift}},
+    {U'e', {KEY_E, Modifiers::NoMods}}, {U'E', {KEY_E, Modifiers::LeftShift}},
+    {U'f', {KEY_F, Modifiers::NoMods}}, {U'F', {KEY_F, Modifiers::LeftShift}},
+    {U'g', {KEY_G, Modifiers::NoMods}}, {U'G', {KEY_G, Modifiers::LeftShift}},
+    {U'h', {KEY_H, Modifiers::NoMods}}, {U'H', {KEY_H, Modifiers::LeftShift}},
+    {U'i', {KEY_I, Modifiers::NoMods}}, {U'I', {KEY_I, Modifiers::LeftShift}},
+    {U'j', {KEY_J, Modifiers::NoMods}}, {U'J', {KEY_J, Modifiers::LeftShift}},
+    {U'k', {KEY_K, Modifiers::NoMods}}, {U'K', {KEY_K, Modifiers::LeftShift}},
+    {U'l', {KEY_L, Modifiers::NoMods}}, {U'L', {KEY_L, Modifiers::LeftShift}},
+    {U'm', {KEY_M, Modifiers::NoMods}}, {U'M', {KEY_M, Modifiers::LeftShift}},
+    {U'n', {KEY_N, Modifiers::NoMods}}, {U'N', {KEY_N, Modifiers::LeftShift}},
+    {U'o', {KEY_O, Modifiers::NoMods}}, {U'O', {KEY_O, Modifiers::LeftShift}},
+    {U'p', {KEY_P, Modifiers::NoMods}}, {U'P', {KEY_P, Modifiers::LeftShift}},
+    {U'q', {KEY_Q, Modifiers::NoMods}}, {U'Q', {KEY_Q, Modifiers::LeftShift}},
+    {U'r', {KEY_R, Modifiers::NoMods}}, {U'R', {KEY_R, Modifiers::LeftShift}},
+    {U's', {KEY_S, Modifiers::NoMods}}, {U'S', {KEY_S, Modifiers::LeftShift}},
+    {U't', {KEY_T, Modifiers::NoMods}}, {U'T', {KEY_T, Modifiers::LeftShift}},
+    {U'u', {KEY_U, Modifiers::NoMods}}, {U'U', {KEY_U, Modifiers::LeftShift}},
+    {U'v', {KEY_V, Modifiers::NoMods}}, {U'V', {KEY_V, Modifiers::LeftShift}},
+    {U'w', {KEY_W, Modifiers::NoMods}}, {U'W', {KEY_W, Modifiers::LeftShift}},
+    {U'x', {KEY_X, Modifiers::NoMods}}, {U'X', {KEY_X, Modifiers::LeftShift}},
+    {U'y', {KEY_Y, Modifiers::NoMods}}, {U'Y', {KEY_Y, Modifiers::LeftShift}},
+    {U'z', {KEY_Z, Modifiers::NoMods}}, {U'Z', {KEY_Z, Modifiers::LeftShift}},
+    {U'1', {KEY_1, Modifiers::NoMods}}, {U'!', {KEY_1, Modifiers::LeftShift}},
+    {U'2', {KEY_2, Modifiers::NoMods}}, {U'@', {KEY_2, Modifiers::LeftShift}},
+    {U'3', {KEY_3, Modifiers::NoMods}}, {U'#', {KEY_3, Modifiers::LeftShift}},
+    {U'4', {KEY_4, Modifiers::NoMods}}, {U'$', {KEY_4, Modifiers::LeftShift}},
+    {U'5', {KEY_5, Modifiers::NoMods}}, {U'%', {KEY_5, Modifiers::LeftShift}},
+    {U'6', {KEY_6, Modifiers::NoMods}}, {U'^', {KEY_6, Modifiers::LeftShift}},
+    {U'7', {KEY_7, Modifiers::NoMods}}, {U'&', {KEY_7, Modifiers::LeftShift}},
+    {U'8', {KEY_8, Modifiers::NoMods}}, {U'*', {KEY_8, Modifiers::LeftShift}},
+    {U'9', {KEY_9, Modifiers::NoMods}}, {U'(', {KEY_9, Modifiers::LeftShift}},
+    {U'0', {KEY_0, Modifiers::NoMods}}, {U')', {KEY_0, Modifiers::LeftShift}},
+    {U'-', {KEY_MINUS, Modifiers::NoMods}},
+    {U'_', {KEY_MINUS, Modifiers::LeftShift}},
+    {U'=', {KEY_EQUAL, Modifiers::NoMods}},
+    {U'+', {KEY_EQUAL, Modifiers::LeftShift}},
+    {U'[', {KEY_LEFTBRACE, Modifiers::NoMods}},
+    {U'{', {KEY_LEFTBRACE, Modifiers::LeftShift}},
+    {U']', {KEY_RIGHTBRACE, Modifiers::NoMods}},
+    {U'}', {KEY_RIGHTBRACE, Modifiers::LeftShift}},
+    {U'\\', {KEY_BACKSLASH, Modifiers::NoMods}},
+    {U'|', {KEY_BACKSLASH, Modifiers::LeftShift}},
+    {U';', {KEY_SEMICOLON, Modifiers::NoMods}},
+    {U':', {KEY_SEMICOLON, Modifiers::LeftShift}},
+    {U'\'', {KEY_APOSTROPHE, Modifiers::NoMods}},
+    {U'"', {KEY_APOSTROPHE, Modifiers::LeftShift}},
+    {U'`', {KEY_GRAVE, Modifiers::NoMods}},
+    {U'~', {KEY_GRAVE, Modifiers::LeftShift}},
+    {U',', {KEY_COMMA, Modifiers::NoMods}},
+    {U'<', {KEY_COMMA, Modifiers::LeftShift}},
+    {U'.', {KEY_DOT, Modifiers::NoMods}},
+    {U'>', {KEY_DOT, Modifiers::LeftShift}},
+    {U'/', {KEY_SLASH, Modifiers::NoMods}},
+    {U'?', {KEY_SLASH, Modifiers::LeftShift}},
+    {U' ', {KEY_SPACE, Modifiers::NoMods}},
+    {U'\t', {KEY_TAB, Modifiers::NoMods}},
+    {U'\n', {KEY_ENTER, Modifiers::NoMods}},
+};
+
+// Decodes one UTF-8 character at pos and advances past it. Malformed
+// sequences decode as U+FFFD, one byte at a time.
+static char32_t decodeUtf8(const std::string &text, size_t &pos) {
+  const unsigned char *s =
+      reinterpret_cast<const unsigned char *>(text.data()) + pos;
+  size_t left = text.size() - pos;
+  char32_t ch;
+  size_t len;
+
+  if (s[0] < 0x80) {
+    ch = s[0], len = 1;
+  } else if ((s[0] & 0xe0) == 0xc0) {
+    ch = s[0] & 0x1f, len = 2;
+  } else if ((s[0] & 0xf0) == 0xe0) {
+    ch = s[0] & 0x0f, len = 3;
+  } else if ((s[0] & 0xf8) == 0xf0) {
+    ch = s[0] & 0x07, len = 4;
+  } else {
+    ++pos;
+    return 0xfffd;
+  }
+
+  if (len > left) {
+    ++pos;
+    return 0xfffd;
+  }
+  for (size_t i = 1; i < len; ++i) {
+    if ((s[i] & 0xc0) != 0x80) {
+      ++pos;
+      return 0xfffd;
+    }
+    ch = ch << 6 | (s[i] & 0x3f);
+  }
+
+  // overlong forms and surrogates
+  static const char32_t minimum[] = {0, 0, 0x80, 0x800, 0x10000};
+  if (ch < minimum[len] || ch > 0x10ffff || (ch >= 0xd800 && ch <= 0xdfff)) {
+    ++pos;
+    return 0xfffd;
+  }
+
+  pos += len;
+  return ch;
+}
+
+// Character to keystroke mapping of a keyboard layout
+class Keymap {
+public:
+  Keymap() {
+    for (const auto &entry : usKeymap) {
+      set(entry.ch, entry.stroke);
+    }
+  }
+
+  // Replaces the mapping with a layout file, lines of the form
+  //   CHAR CODE [MODIFIER...]
+  // where CHAR is a character or U+XXXX, CODE a KEY_* value from
+  // linux/input-event-codes.h and MODIFIER one of the Modifiers names,
+  // Shift or AltGr. Empty lines and lines starting with # are skipped.
+  bool load(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+      perror(path);
+      return false;
+    }
+
+    clear();
+
+    char line[256];
+    int lineno = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+      ++lineno;
+      ok = parseLine(line);
+      if (!ok) {
+        fprintf(stderr, "%s:%d: invalid keymap line\n", path, lineno);
+      }
+    }
+    fclose(file);
+    return ok;
+  }
+
+  const KeyStroke *find(char32_t ch) const {
+    if (ch < 128) {
+      return ascii[ch].code ? &ascii[ch] : nullptr;
+    }
+    auto it = other.find(ch);
+    return it != other.end() ? &it->second : nullptr;
+  }
+
+  // All key codes the layout uses, for enabling them on the device
+  std::vector<int> codes() const {
+    std::vector<int> result;
+    for (const auto &stroke : ascii) {
+      if (stroke.code) {
+        result.push_back(stroke.code);
+      }
+    }
+    for (const auto &entry : other) {
+      result.push_back(entry.second.code);
+    }
+    return result;
+  }
+
+private:
+  void set(char32_t ch, KeyStroke stroke) {
+    if (ch < 128) {
+      ascii[ch] = stroke;
+    } else {
+      other[ch] = stroke;
+    }
+  }
+
+  void clear() {
+    memset(ascii, 0, sizeof(ascii));
+    other.clear();
+  }
+
+  bool parseLine(const char *line) {
+    static const struct {
+      const char *name;
+      Modifiers mask;
+    } names[] = {
+        {"Shift", Modifiers::LeftShift},
+        {"AltGr", Modifiers::RightAlt},
+        {"LeftShift", Modifiers::LeftShift},
+        {"RightShift", Modifiers::RightShift},
+        {"LeftAlt", Modifiers::LeftAlt},
+        {"RightAlt", Modifiers::RightAlt},
+        {"LeftCtrl", Modifiers::LeftCtrl},
+        {"RightCtrl", Modifiers::RightCtrl},
+        {"Meta", Modifiers::Meta},
+    };
+
+    std::string text(line + strspn(line, " \t"));
+    if (text.empty() || text[0] == '\n' || text[0] == '#') {
+      return true;
+    }
+
+    size_t pos = 0;
+    char32_t ch;
+    if (text.compare(0, 2, "U+") == 0) {
+      char *end;
+      ch = strtoul(text.c_str() + 2, &end, 16);
+      pos = end - text.c_str();
+    } else {
+      ch = decodeUtf8(text, pos);
+    }
+    if (pos == 0 || ch == 0xfffd || !isspace((unsigned char)text[pos])) {
+      return false;
+    }
+
+    char *end;
+    long code = strtol(text.c_str() + pos, &end, 0);
+    if (end == text.c_str() + pos || code <= 0 || code > KEY_MAX) {
+      return false;
+    }
+
+    int modifiers = Modifiers::NoMods;
+    char *save = nullptr;
+    for (char *tok = strtok_r(end, " \t\n", &save); tok;
+         tok = strtok_r(nullptr, " \t\n", &save)) {
+      size_t i = 0;
+      while (i < sizeof(names) / sizeof(names[0]) &&
+             strcasecmp(names[i].name, tok)) {
+        ++i;
+      }
+      if (i == sizeof(names) / sizeof(names[0])) {
+        return false;
+      }
+      modifiers |= names[i].mask;
+    }
+
+    set(ch, KeyStroke{int(code), Modifiers(modifiers)});
+    return true;
+  }
+
+  KeyStroke ascii[128] = {};
+  std::unordered_map<char32_t, KeyStroke> other;
+};
+
+// Event sequence that types a piece of text
+struct CompiledText {
+  std::vector<struct input_event> events;
+  // events for character i end at charEnd[i]
+  std::vector<size_t> charEnd;
+  // characters without a key in the keymap, left out
+  int unmapped = 0;
+};
+
+// Compiles text into event sequences, remembering the results so that
+// typing the same text again costs nothing but the writes.
+class TextCompiler {
+public:
+  explicit TextCompiler(const Keymap &keymap) : keymap(keymap) {}
+
+  const CompiledText &compile(const std::string &text) {
+    auto it = cache.find(text);
+    if (it != cache.end()) {
+      return it->second;
+    }
+    // the daemon sees an open-ended stream of texts
+    if (cachedEvents >= MaxEvents) {
+      cache.clear();
+      cachedEvents = 0;
+    }
+
+    CompiledText &out = cache[text];
+    Frame frame(out.events);
+    Injector injector(frame);
+    for (size_t pos = 0; pos < text.size();) {
+      const KeyStroke *stroke = keymap.find(decodeUtf8(text, pos));
+      if (!stroke) {
+        ++out.unmapped;
+        continue;
+      }
+      injector.click(stroke->code, stroke->modifiers);
+      frame.submit();
+      out.charEnd.push_back(out.events.size());
+    }
+
+    // the last character takes the final modifier releases along
+    injector.releaseAll();
+    frame.submit();
+    if (!out.charEnd.empty()) {
+      out.charEnd.back() = out.events.size();
+    }
+    cachedEvents += out.events.size();
+    return out;
+  }
+
+private:
+  // about 24 MiB of events, plus the text compiled last
+  static const size_t MaxEvents = 1 << 20;
+
+  const Keymap &keymap;
+  std::unordered_map<std::string, CompiledText> cache;
+  size_t cachedEvents = 0;
+};
+
+// Writes steps of a precomputed event sequence, step i ending at ends[i],
+// at rate steps per second or as fast as possible for 0. Steps that are
+// due are written together, but no write holds more than maxEvents events
+// unless a single step does, so that one write cannot overrun the readers'
+// buffers; see evdevClientBuffer().
+void paceEvents(int fd, const std::vector<struct input_event> &events,
+                const std::vector<size_t> &ends, double rate,
+                size_t maxEvents) {
+  const size_t steps = ends.size();
+  size_t done = 0;
+
+  scheduler.start();
+  while (done < steps) {
+    size_t due = steps;
+
+    if (rate > 0) {
+      scheduler.waitFor(int64_t(done * 1e9 / rate));
+      int64_t elapsed = Scheduler::now() - scheduler.startTime();
+      due = std::min(size_t(elapsed * 1e-9 * rate) + 1, steps);
+    }
+
+    while (done < due) {
+      size_t first = done ? ends[done - 1] : 0;
+      size_t last = done + 1;
+      while (last < due && ends[last] - first <= maxEvents) {
+        ++last;
+      }
+      if (ends[last - 1] > first) {
+        writeEvents(fd, events.data() + first, ends[last - 1] - first);
+      }
+      done = last;
+    }
+  }
+}
+
+// Types compiled text at rate characters per second, or as fast as
+// possible if rate is 0. Characters that are due are written together.
+void typeText(int fd, const CompiledText &text, double rate) {
+  // half the buffer, leaving readers one write of slack
+  paceEvents(fd, text.events, text.charEnd, rate, evdevClientBuffer() / 2);
+}
+
+// Path of the evdev node of a created uinput device
+std::string eventNode(int fd) {
+  char sysname[64];
+  if (ioctl(fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0) {
+    perror("UI_GET_SYSNAME");
+    exit(1);
+  }
+
+  std::string dir = std::string("/sys/devices/virtual/input/") + sysname;
+  DIR *sys = opendir(dir.c_str());
+  if (!sys) {
+    perror(dir.c_str());
+    exit(1);
+  }
+
+  std::string node;
+  while (struct dirent *entry = readdir(sys)) {
+    if (!strncmp(entry->d_name, "event", 5)) {
+      node = std::string("/dev/input/") + entry->d_name;
+      break;
+    }
+  }
+  closedir(sys);
+
+  if (node.empty()) {
+    fprintf(stderr, "%s: no event node\n", dir.c_str());
+    exit(1);
+  }
+  return node;
+}
+
+// Waits until userspace has opened the evdev nodes of newly created
+// devices, which is when it has noticed them, or until timeoutMs has passed
+// on systems where nothing listens. devtmpfs normally creates the node
+// during UI_DEV_CREATE, but a node that appears later is picked up too.
+void waitForReaders(const std::vector<int> &fds, int timeoutMs) {
+  int notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (notify < 0) {
+    perror("inotify_init1");
+    exit(1);
+  }
+  if (inotify_add_watch(notify, "/dev/input", IN_CREATE) < 0) {
+    perror("/dev/input");
+    exit(1);
+  }
+
+  // nodes nobody has opened yet, by watch, and nodes not there yet
+  std::unordered_map<int, std::string> unopened;
+  std::vector<std::string> missing;
+  auto watch = [&](const std::string &node) {
+    int wd = inotify_add_watch(notify, node.c_str(), IN_OPEN);
+    if (wd >= 0) {
+      unopened[wd] = node;
+    } else if (errno == ENOENT) {
+      missing.push_back(node);
+    } else {
+      perror(node.c_str());
+      exit(1);
+    }
+  };
+  for (int fd : fds) {
+    watch(eventNode(fd));
+  }
+
+  int64_t deadline = Scheduler::now() + timeoutMs * int64_t(1000000);
+  while (!unopened.empty() || !missing.empty()) {
+    int64_t left = deadline - Scheduler::now();
+    if (left <= 0) {
+      break;
+    }
+    struct pollfd pfd = {notify, POLLIN, 0};
+    if (poll(&pfd, 1, int((left + 999999) / 1000000)) <= 0) {
+      continue;
+    }
+
+    alignas(struct inotify_event) char buf[4096];
+    ssize_t len = read(notify, buf, sizeof(buf));
+    for (ssize_t pos = 0; pos < len;) {
+      const struct inotify_event *ev =
+          reinterpret_cast<const struct inotify_event *>(buf + pos);
+      pos += sizeof(*ev) + ev->len;
+
+      if (ev->mask & IN_OPEN) {
+        if (unopened.erase(ev->wd)) {
+          inotify_rm_watch(notify, ev->wd);
+        }
+      } else if ((ev->mask & IN_CREATE) && ev->len) {
+        std::string node = std::string("/dev/input/") + ev->name;
+        auto it = std::find(missing.begin(), missing.end(), node);
+        if (it != missing.end()) {
+          missing.erase(it);
+          watch(node);
+        }
+      }
+    }
+  }
+  close(notify);
+}
+
+// uinput device set up one capability at a time, for modes that need
+// something else than the keyboard main() creates
+class UinputDevice {
+public:
+  UinputDevice() {
+    fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    if (fd < 0) {
+      perror("open");
+      exit(1);
+    }
+  }
+
+  ~UinputDevice() {
+    if (created && ioctl(fd, UI_DEV_DESTROY) < 0) {
+      perror("UI_DEV_DESTROY");
+    }
+    close(fd);
+  }
+
+  UinputDevice(const UinputDevice &) = delete;
+  UinputDevice &operator=(const UinputDevice &) = delete;
+
+  void enableType(int type) {
+    if (ioctl(fd, UI_SET_EVBIT, type) < 0) {
+      perror("UI_SET_EVBIT");
+      exit(1);
+    }
+  }
+
+  // Enables an event code along with its type; axes get limits from
+  // enableAxis() instead
+  void enableCode(int type, int code) {
+    unsigned long request;
+    switch (type) {
+    case EV_KEY:
+      request = UI_SET_KEYBIT;
+      break;
+    case EV_REL:
+      request = UI_SET_RELBIT;
+      break;
+    case EV_ABS:
+      request = UI_SET_ABSBIT;
+      break;
+    case EV_MSC:
+      request = UI_SET_MSCBIT;
+      break;
+    case EV_SW:
+      request = UI_SET_SWBIT;
+      break;
+    case EV_LED:
+      request = UI_SET_LEDBIT;
+      break;
+    case EV_SND:
+      request = UI_SET_SNDBIT;
+      break;
+    default:
+      request = 0;
+      break;
+    }
+
+    enableType(type);
+    if (request && ioctl(fd, request, code) < 0) {
+      perror("UI_SET_*BIT");
+      exit(1);
+    }
+  }
+
+  void enableAxis(int code, int minimum, int maximum, int resolution = 0) {
+    struct uinput_abs_setup abs;
+    memset(&abs, 0, sizeof(abs));
+    abs.code = code;
+    abs.absinfo.minimum = minimum;
+    abs.absinfo.maximum = maximum;
+    abs.absinfo.resolution = resolution;
+
+    enableType(EV_ABS);
+    if (ioctl(fd, UI_ABS_SETUP, &abs) < 0) {
+      perror("UI_ABS_SETUP");
+      exit(1);
+    }
+  }
+
+  void enableProp(int prop) {
+    if (ioctl(fd, UI_SET_PROPBIT, prop) < 0) {
+      perror("UI_SET_PROPBIT");
+      exit(1);
+    }
+  }
+
+  void create(const char *name) {
+    struct uinput_setup usetup;
+    memset(&usetup, 0, sizeof(usetup));
+    usetup.id.bustype = BUS_VIRTUAL;
+    usetup.id.vendor = 0x1234;  /* sample vendor */
+    usetup.id.product = 0x5678; /* sample product */
+    snprintf(usetup.name, sizeof(usetup.name), "%s", name);
+
+    if (ioctl(fd, UI_DEV_SETUP, &usetup) < 0) {
+      perror("usetup");
+      exit(1);
+    }
+    if (ioctl(fd, UI_DEV_CREATE) < 0) {
+      perror("UI_DEV_CREATE");
+      exit(1);
+    }
+    created = true;
+  }
+
+  int fd;
+
+private:
+  bool created = false;
+};
+
+// Parses "SEC.FRACTION" into nanoseconds, advancing str past it
+static bool parseTimestamp(const char *&str, int64_t &ns) {
+  char *end;
+  long long sec = strtoll(str, &end, 10);
+  if (end == str || *end != '.') {
+    return false;
+  }
+
+  int64_t frac = 0;
+  int digits = 0;
+  for (++end; isdigit((unsigned char)*end); ++end) {
+    if (digits < 9) {
+      frac = frac * 10 + (*end - '0');
+      ++digits;
+    }
+  }
+  for (; digits < 9; ++digits) {
+    frac *= 10;
+  }
+
+  ns = sec * INT64_C(1000000000) + frac;
+  str = end;
+  return true;
+}
+
+// Event captured from some input device
+struct TraceEvent {
+  int device;     // index to Trace::devices
+  int64_t timeNs; // event time, or -1 if the trace has none
+  int type;
+  int code;
+  int value;
+};
+
+// Absolute axis names as evdev_trace shows them
+static const struct {
+  const char *name;
+  int code;
+} absNames[] = {
+    {"ABS_X", ABS_X},
+    {"ABS_Y", ABS_Y},
+    {"ABS_Z", ABS_Z},
+    {"ABS_RX", ABS_RX},
+    {"ABS_RY", ABS_RY},
+    {"ABS_RZ", ABS_RZ},
+    {"ABS_THROTTLE", ABS_THROTTLE},
+    {"ABS_RUDDER", ABS_RUDDER},
+    {"ABS_WHEEL", ABS_WHEEL},
+    {"ABS_GAS", ABS_GAS},
+    {"ABS_BRAKE", ABS_BRAKE},
+    {"ABS_HAT0X", ABS_HAT0X},
+    {"ABS_HAT0Y", ABS_HAT0Y},
+    {"ABS_HAT1X", ABS_HAT1X},
+    {"ABS_HAT1Y", ABS_HAT1Y},
+    {"ABS_HAT2X", ABS_HAT2X},
+    {"ABS_HAT2Y", ABS_HAT2Y},
+    {"ABS_HAT3X", ABS_HAT3X},
+    {"ABS_HAT3Y", ABS_HAT3Y},
+    {"ABS_PRESSURE", ABS_PRESSURE},
+    {"ABS_DISTANCE", ABS_DISTANCE},
+    {"ABS_TILT_X", ABS_TILT_X},
+    {"ABS_TILT_Y", ABS_TILT_Y},
+    {"ABS_TOOL_WIDTH", ABS_TOOL_WIDTH},
+    {"ABS_VOLUME", ABS_VOLUME},
+    {"ABS_MISC", ABS_MISC},
+    {"ABS_MT_SLOT", ABS_MT_SLOT},
+    {"ABS_MT_TOUCH_MAJOR", ABS_MT_TOUCH_MAJOR},
+    {"ABS_MT_TOUCH_MINOR", ABS_MT_TOUCH_MINOR},
+    {"ABS_MT_WIDTH_MAJOR", ABS_MT_WIDTH_MAJOR},
+    {"ABS_MT_WIDTH_MINOR", ABS_MT_WIDTH_MINOR},
+    {"ABS_MT_ORIENTATION", ABS_MT_ORIENTATION},
+    {"ABS_MT_POSITION_X", ABS_MT_POSITION_X},
+    {"ABS_MT_POSITION_Y", ABS_MT_POSITION_Y},
+    {"ABS_MT_TOOL_TYPE", ABS_MT_TOOL_TYPE},
+    {"ABS_MT_BLOB_ID", ABS_MT_BLOB_ID},
+    {"ABS_MT_TRACKING_ID", ABS_MT_TRACKING_ID},
+    {"ABS_MT_PRESSURE", ABS_MT_PRESSURE},
+    {"ABS_MT_DISTANCE", ABS_MT_DISTANCE},
+};
+
+// Events read from evdev_trace output. The text format is parsed as
+//   DEVICE: [TIME OF DAY - ][SEC.MSEC - ]0xTT/TYPE - 0xCCC/CODE - VALUE
+// and the json, csv and tsv formats by field name. Axis limits are taken
+// from the device identification blocks of the text format, where axes are
+// listed as ABS_X=VALUE [MIN,MAX] under a ----====( DEVICE )====---- line.
+// Other lines are skipped.
+class Trace {
+public:
+  bool load(const char *path) {
+    FILE *file = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if (!file) {
+      perror(path);
+      return false;
+    }
+
+    char *line = nullptr;
+    size_t size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &size, file)) > 0) {
+      while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+        line[--len] = 0;
+      }
+      if (!strncmp(line, "----====( ", 10)) {
+        const char *end = strstr(line, " )====----");
+        identified = end ? std::string(line + 10, end - line - 10) : "";
+      } else if (line[0] == '\t' && !identified.empty()) {
+        parseIdentify(line);
+      } else if (line[0] == '{') {
+        parseJson(line);
+      } else if (!strncmp(line, "device,", 7) ||
+                 !strncmp(line, "device\t", 7)) {
+        parseHeader(line);
+      } else if (!columns.empty()) {
+        parseRecord(line);
+      } else {
+        parseText(line);
+      }
+    }
+    free(line);
+
+    if (file != stdin) {
+      fclose(file);
+    }
+    return true;
+  }
+
+  // Finds the limits of an axis given in the identification of a device
+  bool axisLimits(int device, int code, int &minimum, int &maximum) const {
+    auto dev = limits.find(devices[device]);
+    if (dev == limits.end()) {
+      return false;
+    }
+    auto axis = dev->second.find(code);
+    if (axis == dev->second.end()) {
+      return false;
+    }
+    minimum = axis->second.first;
+    maximum = axis->second.second;
+    return true;
+  }
+
+  std::vector<std::string> devices;
+  std::vector<TraceEvent> events;
+
+private:
+  int deviceIndex(const std::string &path) {
+    auto it = deviceLut.find(path);
+    if (it != deviceLut.end()) {
+      return it->second;
+    }
+    devices.push_back(path);
+    return deviceLut[path] = devices.size() - 1;
+  }
+
+  void add(const std::string &device, int64_t timeNs, int type, int code,
+           int value) {
+    if (type < 0 || type >= EV_CNT || code < 0 || code > KEY_MAX) {
+      return;
+    }
+    events.push_back(
+        TraceEvent{deviceIndex(device), timeNs, type, code, value});
+  }
+
+  void parseText(const char *line) {
+    const char *colon = strstr(line, ": ");
+    if (!colon) {
+      return;
+    }
+
+    std::vector<std::string> fields;
+    for (const char *pos = colon + 2;;) {
+      const char *sep = strstr(pos, " - ");
+      fields.push_back(std::string(pos, sep ? sep - pos : strlen(pos)));
+      if (!sep) {
+        break;
+      }
+      pos = sep + 3;
+    }
+    if (fields.size() < 3) {
+      return;
+    }
+
+    // type, code and value are the last three fields
+    const char *type = fields[fields.size() - 3].c_str();
+    const char *code = fields[fields.size() - 2].c_str();
+    const char *value = fields[fields.size() - 1].c_str();
+    char *end;
+    if (strncmp(type, "0x", 2) || strncmp(code, "0x", 2)) {
+      return;
+    }
+    long v = strtol(value, &end, 10);
+    if (end == value || *end) {
+      return;
+    }
+
+    // event time if shown, otherwise time of day with msec precision
+    int64_t eventNs = -1, todNs = -1;
+    for (size_t i = 0; i + 3 < fields.size(); ++i) {
+      const char *str = fields[i].c_str();
+      struct tm tm;
+      memset(&tm, 0, sizeof(tm));
+      const char *rest = strptime(str, "%Y-%m-%d %H:%M:%S", &tm);
+      int64_t ns;
+      if (rest && *rest == '.') {
+        tm.tm_isdst = -1;
+        todNs = mktime(&tm) * INT64_C(1000000000) +
+                strtol(rest + 1, nullptr, 10) * 1000000;
+      } else if (parseTimestamp(str, ns) && !*str) {
+        eventNs = ns;
+      }
+    }
+
+    add(std::string(line, colon - line), eventNs >= 0 ? eventNs : todNs,
+        strtol(type, nullptr, 16), strtol(code, nullptr, 16), v);
+  }
+
+  // Parses a line of event codes, e.g. "\t ABS_X=12 [0,4095] ABS_Y=3 [0,767]"
+  void parseIdentify(const char *line) {
+    for (const char *pos = strstr(line, "ABS_"); pos;
+         pos = strstr(pos + 1, "ABS_")) {
+      size_t len = strspn(pos, "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_");
+      int value, minimum, maximum;
+      char close;
+      if (sscanf(pos + len, "%*[*]=%d [%d,%d%c", &value, &minimum, &maximum,
+                 &close) != 4 &&
+          sscanf(pos + len, "=%d [%d,%d%c", &value, &minimum, &maximum,
+                 &close) != 4) {
+        continue;
+      }
+      if (close != ']' || minimum > maximum) {
+        continue;
+      }
+      for (const auto &abs : absNames) {
+        if (strlen(abs.name) == len && !strncmp(abs.name, pos, len)) {
+          limits[identified][abs.code] = std::make_pair(minimum, maximum);
+          break;
+        }
+      }
+    }
+  }
+
+  // Finds "key": in a json object and returns the value after it
+  static const char *jsonValue(const char *line, const char *key) {
+    std::string pattern = std::string("\"") + key + "\":";
+    const char *pos = strstr(line, pattern.c_str());
+    return pos ? pos + pattern.size() : nullptr;
+  }
+
+  void parseJson(const char *line) {
+    const char *device = jsonValue(line, "device");
+    const char *type = jsonValue(line, "type");
+    const char *code = jsonValue(line, "code");
+    const char *value = jsonValue(line, "value");
+    const char *time = jsonValue(line, "time");
+    if (!device || *device != '"' || !type || !code || !value) {
+      return;
+    }
+
+    std::string path;
+    for (++device; *device && *device != '"'; ++device) {
+      if (*device == '\\' && device[1]) {
+        ++device;
+      }
+      path += *device;
+    }
+
+    int64_t timeNs = -1;
+    if (!time || !parseTimestamp(time, timeNs)) {
+      timeNs = -1;
+    }
+    add(path, timeNs, atoi(type), atoi(code), atoi(value));
+  }
+
+  // Splits a csv or tsv line into fields
+  std::vector<std::string> split(const char *line) const {
+    std::vector<std::string> fields(1);
+    bool quoted = false;
+
+    for (const char *pos = line; *pos; ++pos) {
+      if (separator == ',' && *pos == '"') {
+        if (quoted && pos[1] == '"') {
+          fields.back() += *++pos;
+        } else {
+          quoted = !quoted;
+        }
+      } else if (*pos == separator && !quoted) {
+        fields.emplace_back();
+      } else {
+        fields.back() += *pos;
+      }
+    }
+    return fields;
+  }
+
+  void parseHeader(const char *line) {
+    separator = line[6];
+    columns.clear();
+    std::vector<std::string> names = split(line);
+    for (size_t i = 0; i < names.size(); ++i) {
+      columns[names[i]] = i;
+    }
+  }
+
+  void parseRecord(const char *line) {
+    std::vector<std::string> fields = split(line);
+    auto field = [&](const char *name) -> const char * {
+      auto it = columns.find(name);
+      return it != columns.end() && it->second < fields.size()
+                 ? fields[it->second].c_str()
+                 : nullptr;
+    };
+
+    const char *device = field("device");
+    const char *type = field("type");
+    const char *code = field("code");
+    const char *value = field("value");
+    const char *time = field("time");
+    if (!device || !type || !code || !value) {
+      return;
+    }
+
+    int64_t timeNs = -1;
+    if (!time || !parseTimestamp(time, timeNs)) {
+      timeNs = -1;
+    }
+    add(device, timeNs, atoi(type), atoi(code), atoi(value));
+  }
+
+  std::unordered_map<std::string, int> deviceLut;
+  std::unordered_map<std::string, size_t> columns;
+  char separator = ',';
+  // device being identified, and axis limits by device and code
+  std::string identified;
+  std::unordered_map<std::string,
+                     std::unordered_map<int, std::pair<int, int>>>
+      limits;
+};
+
+// Creates a device that supports exactly the events a traced device
+// produced. Axis limits come from the identification of the device when
+// the trace has one; otherwise the range of values seen is used, which
+// makes the replayed device report a different resolution.
+static std::unique_ptr<UinputDevice> createReplayDevice(const Trace &trace,
+                                                        int device) {
+  std::unordered_map<int, std::pair<int, int>> axes;
+  bool mt = false, touch = false, toolFinger = false;
+  std::unique_ptr<UinputDevice> dev(new UinputDevice);
+
+  for (const TraceEvent &ev : trace.events) {
+    if (ev.device != device || ev.type == EV_SYN || ev.type == EV_REP) {
+      continue;
+    }
+    if (ev.type != EV_ABS) {
+      dev->enableCode(ev.type, ev.code);
+    } else if (!axes.count(ev.code)) {
+      axes[ev.code] = std::make_pair(ev.value, ev.value);
+    } else {
+      auto &range = axes[ev.code];
+      range.first = std::min(range.first, ev.value);
+      range.second = std::max(range.second, ev.value);
+    }
+
+    mt |= ev.type == EV_ABS && ev.code == ABS_MT_POSITION_X;
+    touch |= ev.type == EV_KEY && ev.code == BTN_TOUCH;
+    toolFinger |= ev.type == EV_KEY && ev.code == BTN_TOOL_FINGER;
+  }
+
+  const std::string &path = trace.devices[device];
+  int guessed = 0;
+  for (const auto &axis : axes) {
+    int minimum, maximum;
+    if (!trace.axisLimits(device, axis.first, minimum, maximum)) {
+      minimum = std::min(axis.second.first, 0);
+      maximum = std::max(axis.second.second, minimum + 1);
+      if (axis.first == ABS_MT_TRACKING_ID) {
+        minimum = 0, maximum = std::max(maximum, 65535);
+      } else {
+        ++guessed;
+      }
+    }
+    dev->enableAxis(axis.first, minimum, maximum);
+  }
+  if (guessed) {
+    fprintf(stderr,
+            "%s: no axis limits in trace, using observed ranges for %d "
+            "axes; trace with evdev_trace -i -t to include them\n",
+            path.c_str(), guessed);
+  }
+
+  // touch screens rather than touch pads, as udev would guess
+  if (mt && touch && !toolFinger) {
+    dev->enableProp(INPUT_PROP_DIRECT);
+  }
+
+  std::string name = "fakekey replay " + path.substr(path.rfind('/') + 1);
+  dev->create(name.c_str());
+  return dev;
+}
+
+// Injects trace events, grouped into writes by device and time stamp.
+// speed scales the original timing; 0 replays as fast as possible. Time
+// stamps that go backwards, e.g. between devices, add no delay.
+void replayTrace(const Trace &trace,
+                 const std::vector<std::unique_ptr<UinputDevice>> &devices,
+                 double speed) {
+  const std::vector<TraceEvent> &events = trace.events;
+  std::vector<struct input_event> batch;
+  int64_t previous = -1;
+  int64_t offset = 0;
+
+  scheduler.start();
+  for (size_t i = 0; i < events.size();) {
+    const TraceEvent &first = events[i];
+    size_t end = i;
+
+    batch.clear();
+    for (; end < events.size(); ++end) {
+      const TraceEvent &ev = events[end];
+      if (ev.device != first.device || ev.timeNs != first.timeNs) {
+        break;
+      }
+      // a dropped event marker would make readers resync needlessly
+      if (ev.type == EV_SYN && ev.code == SYN_DROPPED) {
+        continue;
+      }
+
+      struct input_event ie;
+      memset(&ie, 0, sizeof(ie));
+      ie.type = ev.type;
+      ie.code = ev.code;
+      ie.value = ev.value;
+      batch.push_back(ie);
+    }
+
+    if (speed > 0 && first.timeNs >= 0) {
+      if (previous >= 0 && first.timeNs > previous) {
+        offset += first.timeNs - previous;
+      }
+      previous = first.timeNs;
+      scheduler.waitFor(int64_t(offset / speed));
+    }
+    writeEvents(devices[first.device]->fd, batch.data(), batch.size());
+    i = end;
+  }
+}
+
+// Touch panel size and number of contacts of synthesized touch screens
+static const int touchWidth = 1920;
+static const int touchHeight = 1080;
+static const int touchSlots = 10;
+
+// Enables what a multitouch screen reports
+static void enableTouch(UinputDevice &dev) {
+  dev.enableCode(EV_KEY, BTN_TOUCH);
+  dev.enableAxis(ABS_X, 0, touchWidth - 1);
+  dev.enableAxis(ABS_Y, 0, touchHeight - 1);
+  dev.enableAxis(ABS_MT_SLOT, 0, touchSlots - 1);
+  dev.enableAxis(ABS_MT_TRACKING_ID, 0, 65535);
+  dev.enableAxis(ABS_MT_POSITION_X, 0, touchWidth - 1);
+  dev.enableAxis(ABS_MT_POSITION_Y, 0, touchHeight - 1);
+  dev.enableProp(INPUT_PROP_DIRECT);
+}
+
+// Reader buffer size of what enableTouch() sets up: ABS_X and ABS_Y, and
+// four multitouch axes counting ABS_MT_SLOT for every slot
+static size_t touchClientBuffer() {
+  return evdevClientBuffer(2, 4, touchSlots);
+}
+
+// Kinds of devices the storm generator creates
+enum class StormKind {
+  Keyboard,
+  Mouse,
+  Touch,
+};
+
+// One storm device, driven by a thread of its own
+struct StormDevice {
+  StormKind kind;
+  std::unique_ptr<UinputDevice> device;
+  std::thread thread;
+
+  // filled in by the thread
+  uint64_t frames = 0;
+  uint64_t events = 0;
+  uint64_t writes = 0;
+  uint64_t writeErrors = 0;
+  double seconds = 0;
+};
+
+static const char *stormKindName(StormKind kind) {
+  switch (kind) {
+  case StormKind::Keyboard:
+    return "keyboard";
+  case StormKind::Mouse:
+    return "mouse";
+  case StormKind::Touch:
+    return "touch";
+  }
+  return "?";
+}
+
+static void stormSetup(StormDevice &storm, int index) {
+  UinputDevice &dev = *storm.device;
+
+  switch (storm.kind) {
+  case StormKind::Keyboard:
+    // ESC to D make udev call it a keyboard, but only BTN_TRIGGER_HAPPY
+    // codes get pressed: they are above the 255 xkb keycode limit, so no
+    // keymap binds them and nothing gets typed or toggled
+    for (int code = KEY_ESC; code <= KEY_D; ++code) {
+      dev.enableCode(EV_KEY, code);
+    }
+    for (int code = BTN_TRIGGER_HAPPY1; code <= BTN_TRIGGER_HAPPY12; ++code) {
+      dev.enableCode(EV_KEY, code);
+    }
+    break;
+  case StormKind::Mouse:
+    dev.enableCode(EV_KEY, BTN_LEFT);
+    dev.enableCode(EV_REL, REL_X);
+    dev.enableCode(EV_REL, REL_Y);
+    break;
+  case StormKind::Touch:
+    enableTouch(dev);
+    break;
+  }
+
+  std::string name = std::string("fakekey storm ") +
+                     stormKindName(storm.kind) + " " + std::to_string(index);
+  dev.create(name.c_str());
+}
+
+// Appends frame number n of a storm device to events
+static void stormFrame(StormKind kind, uint64_t n,
+                       std::vector<struct input_event> &events) {
+  auto add = [&](int type, int code, int value) {
+    struct input_event ie;
+    memset(&ie, 0, sizeof(ie));
+    ie.type = type;
+    ie.code = code;
+    ie.value = value;
+    events.push_back(ie);
+  };
+
+  switch (kind) {
+  case StormKind::Keyboard:
+    // press and release BTN_TRIGGER_HAPPY1..12 in turn
+    add(EV_KEY, BTN_TRIGGER_HAPPY1 + int(n / 2 % 12), int(~n & 1));
+    break;
+  case StormKind::Mouse: {
+    // small square that ends where it started
+    static const int dx[] = {4, 0, -4, 0};
+    static const int dy[] = {0, 4, 0, -4};
+    add(EV_REL, REL_X, dx[n % 4]);
+    add(EV_REL, REL_Y, dy[n % 4]);
+    break;
+  }
+  case StormKind::Touch: {
+    // one contact at a time circling the middle, lifted every 100 frames
+    int step = int(n % 100);
+    double angle = n * 0.05;
+    int x = touchWidth / 2 + int(200 * cos(angle));
+    int y = touchHeight / 2 + int(200 * sin(angle));
+    add(EV_ABS, ABS_MT_SLOT, 0);
+    if (step == 99) {
+      add(EV_ABS, ABS_MT_TRACKING_ID, -1);
+      add(EV_KEY, BTN_TOUCH, 0);
+      break;
+    }
+    if (step == 0) {
+      add(EV_ABS, ABS_MT_TRACKING_ID, int(n / 100 % 65536));
+      add(EV_KEY, BTN_TOUCH, 1);
+    }
+    add(EV_ABS, ABS_MT_POSITION_X, x);
+    add(EV_ABS, ABS_MT_POSITION_Y, y);
+    add(EV_ABS, ABS_X, x);
+    add(EV_ABS, ABS_Y, y);
+    break;
+  }
+  }
+  add(EV_SYN, SYN_REPORT, 0);
+}
+
+// Writes frames at rate per second until duration has passed. Frames
+// that are due are written together, and write errors are counted
+// rather than fatal so that overload shows up in the statistics.
+static void stormRun(StormDevice *storm, double rate, double duration) {
+  // half the readers' buffer, leaving them one write of slack
+  size_t maxEvents = evdevClientBuffer() / 2;
+  if (storm->kind == StormKind::Mouse) {
+    maxEvents = evdevClientBuffer(0, 0, 0, 2) / 2;
+  } else if (storm->kind == StormKind::Touch) {
+    maxEvents = touchClientBuffer() / 2;
+  }
+  const int fd = storm->device->fd;
+  const uint64_t total = uint64_t(rate * duration);
+  std::vector<struct input_event> events;
+  Scheduler pacer;
+
+  pacer.configure(scheduler);
+  pacer.start();
+  while (storm->frames < total) {
+    pacer.waitFor(int64_t(storm->frames * 1e9 / rate));
+    int64_t elapsed = Scheduler::now() - pacer.startTime();
+    uint64_t due = std::min(uint64_t(elapsed * 1e-9 * rate) + 1, total);
+
+    // due frames up to maxEvents, the rest go in the next write
+    events.clear();
+    uint64_t n = storm->frames;
+    for (; n < due; ++n) {
+      size_t size = events.size();
+      stormFrame(storm->kind, n, events);
+      if (size && events.size() > maxEvents) {
+        events.resize(size);
+        break;
+      }
+    }
+
+    ssize_t done;
+    do {
+      done = write(fd, events.data(), events.size() * sizeof(events[0]));
+    } while (done < 0 && errno == EINTR);
+
+    ++storm->writes;
+    if (done < 0) {
+      ++storm->writeErrors;
+    } else {
+      storm->events += done / sizeof(events[0]);
+    }
+    storm->frames = n;
+  }
+  storm->seconds = (Scheduler::now() - pacer.startTime()) * 1e-9;
+}
+
+// Parses "keyboard:N,mouse:N,touch:N" into storm devices
+static bool parseStorm(const char *spec, std::vector<StormDevice> &storms) {
+  std::string text(spec);
+  size_t pos = 0;
+
+  while (pos < text.size()) {
+    size_t end = text.find(',', pos);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    std::string item = text.substr(pos, end - pos);
+    pos = end + 1;
+
+    size_t colon = item.find(':');
+    std::string name = item.substr(0, colon);
+    int count = colon == std::string::npos ? 1 : atoi(&item[colon + 1]);
+
+    StormKind kind;
+    if (name == "keyboard") {
+      kind = StormKind::Keyboard;
+    } else if (name == "mouse") {
+      kind = StormKind::Mouse;
+    } else if (name == "touch") {
+      kind = StormKind::Touch;
+    } else {
+      fprintf(stderr, "%s: unknown device kind\n", name.c_str());
+      return false;
+    }
+    if (count < 1) {
+      fprintf(stderr, "%s: invalid device count\n", item.c_str());
+      return false;
+    }
+
+    for (int i = 0; i < count; ++i) {
+      storms.emplace_back();
+      storms.back().kind = kind;
+    }
+  }
+  return !storms.empty();
+}
+
+void runStorm(std::vector<StormDevice> &storms, double rate,
+              double duration) {
+  for (size_t i = 0; i < storms.size(); ++i) {
+    storms[i].device.reset(new UinputDevice);
+    stormSetup(storms[i], i);
+  }
+
+  std::vector<int> fds;
+  for (StormDevice &storm : storms) {
+    fds.push_back(storm.device->fd);
+  }
+  waitForReaders(fds, 1000);
+
+  for (StormDevice &storm : storms) {
+    storm.thread = std::thread(stormRun, &storm, rate, duration);
+  }
+
+  uint64_t frames = 0, events = 0, writes = 0, writeErrors = 0;
+  printf("%-3s %-8s %10s %10s %10s %8s %10s\n", "dev", "kind", "frames",
+         "events", "writes", "errors", "frames/s");
+  for (size_t i = 0; i < storms.size(); ++i) {
+    StormDevice &storm = storms[i];
+    storm.thread.join();
+    printf("%-3zu %-8s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %8" PRIu64
+           " %10.0f\n",
+           i, stormKindName(storm.kind), storm.frames, storm.events,
+           storm.writes, storm.writeErrors,
+           storm.seconds > 0 ? storm.frames / storm.seconds : 0.0);
+    frames += storm.frames;
+    events += storm.events;
+    writes += storm.writes;
+    writeErrors += storm.writeErrors;
+  }
+  printf("all %-8s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %8" PRIu64
+         " %10.0f\n",
+         "", frames, events, writes, writeErrors, frames / duration);
+}
+
+// Gestures the touch synthesizer performs
+enum class GestureKind {
+  Swipe,
+  PinchIn,
+  PinchOut,
+  Fling,
+};
+
+struct Gesture {
+  GestureKind kind;
+  int ms;
+};
+
+// Touch frames precomputed at a fixed sample rate, frame i ending at
+// frameEnd[i]. Frames without changes have no events.
+struct TouchSamples {
+  std::vector<struct input_event> events;
+  std::vector<size_t> frameEnd;
+};
+
+// Turns contact positions into ABS_MT type B events, one frame at a time,
+// leaving out everything that has not changed since the previous frame
+class TouchRecorder {
+public:
+  explicit TouchRecorder(TouchSamples &out) : out(out) {}
+
+  // Puts a contact down at x, y, or moves it there
+  void move(int slot, int x, int y) {
+    Contact &contact = contacts[slot];
+    if (!contact.down) {
+      select(slot);
+      add(EV_ABS, ABS_MT_TRACKING_ID, nextTrackingId);
+      nextTrackingId = (nextTrackingId + 1) % 65536;
+      contact.down = true;
+      contact.x = contact.y = -1;
+    }
+    if (contact.x != x) {
+      select(slot);
+      add(EV_ABS, ABS_MT_POSITION_X, x);
+      contact.x = x;
+    }
+    if (contact.y != y) {
+      select(slot);
+      add(EV_ABS, ABS_MT_POSITION_Y, y);
+      contact.y = y;
+    }
+  }
+
+  void lift(int slot) {
+    if (contacts[slot].down) {
+      select(slot);
+      add(EV_ABS, ABS_MT_TRACKING_ID, -1);
+      contacts[slot].down = false;
+    }
+  }
+
+  // Ends the frame, with single touch emulation following the first
+  // contact that is down
+  void sync() {
+    const Contact *first = nullptr;
+    for (const Contact &contact : contacts) {
+      if (contact.down) {
+        first = &contact;
+        break;
+      }
+    }
+    if (touching != (first != nullptr)) {
+      touching = first != nullptr;
+      add(EV_KEY, BTN_TOUCH, touching);
+    }
+    if (first && first->x != x) {
+      add(EV_ABS, ABS_X, x = first->x);
+    }
+    if (first && first->y != y) {
+      add(EV_ABS, ABS_Y, y = first->y);
+    }
+
+    if (frameStart != out.events.size()) {
+      add(EV_SYN, SYN_REPORT, 0);
+    }
+    out.frameEnd.push_back(out.events.size());
+    frameStart = out.events.size();
+  }
 
-  int written = write(fd, &ie, sizeof(ie)) != sizeof(ie);
-  if (written != sizeof(ie)) {
-    // syslog(LOG_lERR, "partial write, %d vs %llu!", written, sizeof(ie));
-    // exit(1);
+private:
+  struct Contact {
+    bool down = false;
+    int x = -1;
+    int y = -1;
+  };
+
+  void select(int slot) {
+    if (slot != current) {
+      add(EV_ABS, ABS_MT_SLOT, slot);
+      current = slot;
+    }
   }
-}
 
-enum Options {
-  None = 0x0,
-  Sleep = 0x1,
-  Log = 0x2,
-  SleepAndLog = Sleep | Log,
+  void add(int type, int code, int value) {
+    struct input_event ie;
+    memset(&ie, 0, sizeof(ie));
+    ie.type = type;
+    ie.code = code;
+    ie.value = value;
+    out.events.push_back(ie);
+  }
+
+  TouchSamples &out;
+  Contact contacts[touchSlots];
+  size_t frameStart = 0;
+  int current = -1;
+  int nextTrackingId = 0;
+  bool touching = false;
+  int x = -1;
+  int y = -1;
 };
 
-enum Modifiers {
-  NoMods = 0x00,
-  LeftShift = 0x01,
-  RightShift = 0x02,
-  LeftAlt = 0x04,
-  RightAlt = 0x08,
-  LeftCtrl = 0x10,
-  RightCtrl = 0x20,
-  Meta = 0x40,
+struct Point {
+  double x;
+  double y;
 };
 
-void press(int fd, int code, Modifiers modifiers = Modifiers::NoMods,
-           Options options = Options::Log) {
-  if (modifiers & Modifiers::LeftShift) {
-    press(fd, KEY_LEFTSHIFT, Modifiers::NoMods, Options::None);
+static Point bezier(Point p0, Point p1, Point p2, Point p3, double t) {
+  double u = 1 - t;
+  double a = u * u * u, b = 3 * u * u * t, c = 3 * u * t * t, d = t * t * t;
+  return {a * p0.x + b * p1.x + c * p2.x + d * p3.x,
+          a * p0.y + b * p1.y + c * p2.y + d * p3.y};
+}
+
+// Cubic bezier timing curve through (0, 0), (0, 0), (1, 1), (1, 1): starts
+// and ends slowly like a hand does
+static double ease(double t) { return t * t * (3 - 2 * t); }
+
+// Position of one finger at u, from 0 to 1, through a gesture
+static Point gesturePoint(GestureKind kind, int finger, int fingers,
+                          double u) {
+  const double spacing = 120;
+  const double offset = (finger - (fingers - 1) / 2.0) * spacing;
+
+  switch (kind) {
+  case GestureKind::Swipe: {
+    // left to right on a slight upward arc, fingers stacked vertically
+    Point p = bezier({0.2 * touchWidth, 0.5 * touchHeight},
+                     {0.4 * touchWidth, 0.4 * touchHeight},
+                     {0.6 * touchWidth, 0.4 * touchHeight},
+                     {0.8 * touchWidth, 0.5 * touchHeight}, ease(u));
+    return {p.x, p.y + offset};
+  }
+  case GestureKind::PinchIn:
+  case GestureKind::PinchOut: {
+    // fingers evenly around the middle, moving in or out together
+    double from = 100, to = 0.4 * touchHeight;
+    if (kind == GestureKind::PinchIn) {
+      std::swap(from, to);
+    }
+    double radius = from + (to - from) * ease(u);
+    double angle = M_PI / 4 + 2 * M_PI * finger / fingers;
+    return {touchWidth / 2 + radius * cos(angle),
+            touchHeight / 2 + radius * sin(angle)};
+  }
+  case GestureKind::Fling: {
+    // upwards with exponentially decaying speed, lifting off at 60% of
+    // the initial speed so that velocity trackers see a fling
+    const double decay = 0.5;
+    double travel = (1 - exp(-decay * u)) / (1 - exp(-decay));
+    return {touchWidth / 2 + offset, (0.85 - 0.6 * travel) * touchHeight};
+  }
+  }
+  return {0, 0};
+}
+
+// Precomputes gestures one after another at hz samples per second
+static void compileGestures(const std::vector<Gesture> &gestures,
+                            double hz, int fingers, TouchSamples &out) {
+  TouchRecorder touch(out);
+
+  for (const Gesture &gesture : gestures) {
+    int n = fingers;
+    if (gesture.kind == GestureKind::PinchIn ||
+        gesture.kind == GestureKind::PinchOut) {
+      n = std::max(n, 2);
+    }
+
+    int frames = std::max(2, int(gesture.ms * hz / 1000 + 0.5));
+    for (int i = 0; i < frames; ++i) {
+      double u = double(i) / (frames - 1);
+      for (int f = 0; f < n; ++f) {
+        Point p = gesturePoint(gesture.kind, f, n, u);
+        touch.move(f, std::min(std::max(int(p.x), 0), touchWidth - 1),
+                   std::min(std::max(int(p.y), 0), touchHeight - 1));
+      }
+      touch.sync();
+    }
+    for (int f = 0; f < n; ++f) {
+      touch.lift(f);
+    }
+    touch.sync();
+
+    // pause after every gesture, including the last one since the list
+    // may be repeated, so that gestures are not taken for one
+    for (int i = 0; i < int(hz / 5); ++i) {
+      touch.sync();
+    }
+  }
+}
+
+// Parses "swipe,pinch-in:400,fling:120" into gestures, durations in ms
+static bool parseGestures(const char *spec, std::vector<Gesture> &gestures) {
+  static const struct {
+    const char *name;
+    GestureKind kind;
+    int ms;
+  } kinds[] = {
+      {"swipe", GestureKind::Swipe, 300},
+      {"pinch-in", GestureKind::PinchIn, 500},
+      {"pinch-out", GestureKind::PinchOut, 500},
+      {"fling", GestureKind::Fling, 150},
+  };
+
+  std::string text(spec);
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t end = text.find(',', pos);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    std::string item = text.substr(pos, end - pos);
+    pos = end + 1;
+
+    size_t colon = item.find(':');
+    std::string name = item.substr(0, colon);
+    int ms = -1;
+    if (colon != std::string::npos) {
+      ms = atoi(item.c_str() + colon + 1);
+      if (ms < 1) {
+        fprintf(stderr, "%s: invalid duration\n", item.c_str());
+        return false;
+      }
+    }
+
+    bool known = false;
+    for (const auto &kind : kinds) {
+      if (name == kind.name) {
+        gestures.push_back({kind.kind, ms > 0 ? ms : kind.ms});
+        known = true;
+      }
+    }
+    if (!known) {
+      fprintf(stderr, "%s: unknown gesture\n", name.c_str());
+      return false;
+    }
+  }
+  return !gestures.empty();
+}
+
+// Performs gestures on a touch screen of its own, repeat times over
+void runGestures(const std::vector<Gesture> &gestures, double hz,
+                 int fingers, int repeat) {
+  UinputDevice dev;
+  enableTouch(dev);
+  dev.create("fakekey touch");
+  waitForReaders({dev.fd}, 1000);
+
+  TouchSamples samples;
+  compileGestures(gestures, hz, fingers, samples);
+
+  double start = monotonicSeconds();
+  for (int i = 0; i < repeat; ++i) {
+    paceEvents(dev.fd, samples.events, samples.frameEnd, hz,
+               touchClientBuffer() / 2);
+  }
+  double elapsed = monotonicSeconds() - start;
+
+  printf("%zu gestures, %zu frames, %zu events in %.3f s at %.0f Hz\n",
+         gestures.size() * repeat, samples.frameEnd.size() * repeat,
+         samples.events.size() * repeat, elapsed, hz);
+  scheduler.report(stdout);
+
+  // give userspace time to read the events before the device goes away
+  sleep(2);
+}
+
+// Latency samples with a log2 histogram
+class LatencyHistogram {
+public:
+  void add(int64_t ns) { samples.push_back(ns); }
+
+  size_t count() const { return samples.size(); }
+
+  // One line summary in microseconds
+  void summary(FILE *out, const char *title) {
+    if (samples.empty()) {
+      fprintf(out, "  %-16s no samples\n", title);
+      return;
+    }
+
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (int64_t ns : samples) {
+      sum += ns;
+    }
+    fprintf(out,
+            "  %-16s us: mean %.1f, median %.1f, p99 %.1f, max %.1f\n",
+            title, sum / samples.size() / 1e3, percentile(0.5),
+            percentile(0.99), samples.back() / 1e3);
   }
-  if (modifiers & Modifiers::RightShift) {
-    press(fd, KEY_RIGHTSHIFT, Modifiers::NoMods, Options::None);
+
+  // Buckets from 1 us up, doubling, with a bar of # per bucket
+  void print(FILE *out) const {
+    const int buckets = 22;
+    size_t counts[buckets] = {};
+    size_t peak = 0;
+
+    for (int64_t ns : samples) {
+      int bucket = 0;
+      for (int64_t us = ns / 1000; us > 0 && bucket < buckets - 1; us >>= 1) {
+        ++bucket;
+      }
+      peak = std::max(peak, ++counts[bucket]);
+    }
+
+    for (int i = 0; i < buckets; ++i) {
+      if (!counts[i]) {
+        continue;
+      }
+      char range[32];
+      if (i == 0) {
+        snprintf(range, sizeof(range), "< 1 us");
+      } else if (i == buckets - 1) {
+        snprintf(range, sizeof(range), ">= %ld us", 1L << (i - 1));
+      } else {
+        snprintf(range, sizeof(range), "%ld-%ld us", 1L << (i - 1), 1L << i);
+      }
+      int bar = int(40 * counts[i] / peak);
+      fprintf(out, "  %16s %10zu%s%.*s\n", range, counts[i], bar ? " " : "",
+              bar, "########################################");
+    }
   }
-  if (modifiers & Modifiers::LeftAlt) {
-    press(fd, KEY_LEFTALT, Modifiers::NoMods, Options::None);
+
+private:
+  double percentile(double p) const {
+    return samples[size_t(p * (samples.size() - 1))] / 1e3;
   }
-  if (modifiers & Modifiers::RightAlt) {
-    press(fd, KEY_RIGHTALT, Modifiers::NoMods, Options::None);
+
+  std::vector<int64_t> samples;
+};
+
+static int64_t timevalNs(const struct timeval &tv) {
+  return tv.tv_sec * INT64_C(1000000000) + tv.tv_usec * INT64_C(1000);
+}
+
+// One loopback rate, shared by the writing and the reading thread.
+// Sequence numbers continue from one rate to the next, so that stragglers
+// of an earlier rate are told apart by being below first.
+struct LoopbackRun {
+  LoopbackRun(size_t first, size_t total)
+      : first(first), total(total), sent(new std::atomic<int64_t>[total]()) {
   }
-  if (modifiers & Modifiers::LeftCtrl) {
-    press(fd, KEY_LEFTCTRL, Modifiers::NoMods, Options::None);
+
+  const size_t first;
+  const size_t total;
+  // write times by sequence number - first, published before the write
+  std::unique_ptr<std::atomic<int64_t>[]> sent;
+  std::atomic<bool> stop{false};
+  std::atomic<size_t> received{0};
+
+  // reader thread only until it is joined
+  LatencyHistogram writeToRead, writeToStamp, stampToRead;
+  uint64_t dropped = 0;
+};
+
+// Reads loopback events back and matches them to the write times
+// through the sequence number carried in MSC_SCAN values
+static void loopbackRead(int fd, LoopbackRun *run) {
+  struct input_event events[64];
+
+  while (!run->stop.load()) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 100) <= 0) {
+      continue;
+    }
+
+    ssize_t done = read(fd, events, sizeof(events));
+    int64_t now = Scheduler::now();
+    if (done <= 0) {
+      continue;
+    }
+
+    for (size_t i = 0; i < done / sizeof(events[0]); ++i) {
+      const struct input_event &ev = events[i];
+      if (ev.type == EV_SYN && ev.code == SYN_DROPPED) {
+        ++run->dropped;
+      }
+      size_t seq = size_t(uint32_t(ev.value)) - run->first;
+      if (ev.type != EV_MSC || ev.code != MSC_SCAN || seq >= run->total) {
+        continue;
+      }
+
+      int64_t written = run->sent[seq].load(std::memory_order_acquire);
+      int64_t stamped = timevalNs(ev.time);
+      run->writeToRead.add(now - written);
+      run->writeToStamp.add(stamped - written);
+      run->stampToRead.add(now - stamped);
+      run->received.fetch_add(1, std::memory_order_relaxed);
+    }
   }
-  if (modifiers & Modifiers::RightCtrl) {
-    press(fd, KEY_RIGHTCTRL, Modifiers::NoMods, Options::None);
+}
+
+// Injects sequence numbered events at each rate in turn and measures how
+// long they take to come out of the device's own evdev node
+void loopback(const std::vector<double> &rates, double duration) {
+  UinputDevice dev;
+  dev.enableCode(EV_KEY, KEY_F24);
+  dev.enableCode(EV_MSC, MSC_SCAN);
+  dev.create("fakekey loopback");
+
+  std::string node = eventNode(dev.fd);
+  int fd = -1;
+  for (int tries = 0; tries < 500 && fd < 0; ++tries) {
+    if ((fd = open(node.c_str(), O_RDONLY | O_NONBLOCK)) < 0) {
+      usleep(10 * 1000);
+    }
   }
-  if (modifiers & Modifiers::Meta) {
-    press(fd, KEY_OPTION, Modifiers::NoMods, Options::None);
+  if (fd < 0) {
+    perror(node.c_str());
+    exit(1);
   }
 
-  emit(fd, EV_KEY, code, 1);
-  emit(fd, EV_SYN, SYN_REPORT, 0);
-  if (options & Options::Log) {
-    syslog(LOG_DEBUG, "pressed %d", code);
+  // event times from the same clock as write times
+  int clockId = CLOCK_MONOTONIC;
+  if (ioctl(fd, EVIOCSCLOCKID, &clockId) < 0) {
+    perror("EVIOCSCLOCKID");
+    exit(1);
   }
-  if (options & Options::Sleep) {
-    usleep(200 * 1000);
+  printf("loopback through %s\n", node.c_str());
+
+  size_t first = 0;
+  for (double rate : rates) {
+    const size_t total = std::max(size_t(rate * duration), size_t(1));
+    LoopbackRun run(first, total);
+    Scheduler pacer;
+    first += total;
+
+    std::thread reader(loopbackRead, fd, &run);
+
+    struct input_event frame[2];
+    memset(frame, 0, sizeof(frame));
+    frame[0].type = EV_MSC;
+    frame[0].code = MSC_SCAN;
+    frame[1].type = EV_SYN;
+    frame[1].code = SYN_REPORT;
+
+    pacer.configure(scheduler);
+    pacer.start();
+    for (size_t seq = 0; seq < total; ++seq) {
+      pacer.waitFor(int64_t(seq * 1e9 / rate));
+      frame[0].value = int(uint32_t(run.first + seq));
+      run.sent[seq].store(Scheduler::now(), std::memory_order_release);
+      writeEvents(dev.fd, frame, 2);
+    }
+
+    // let the reader catch up
+    for (int tries = 0; tries < 100 && run.received.load() < total; ++tries) {
+      usleep(10 * 1000);
+    }
+    run.stop = true;
+    reader.join();
+
+    printf("rate %.0f/s: %zu sent, %zu received, %" PRIu64 " overruns\n", rate,
+           total, run.writeToRead.count(), run.dropped);
+    run.writeToRead.summary(stdout, "write to read");
+    run.writeToStamp.summary(stdout, "write to stamp");
+    run.stampToRead.summary(stdout, "stamp to read");
+    run.writeToRead.print(stdout);
   }
+
+  close(fd);
 }
 
-void release(int fd, int code, Modifiers modifiers = Modifiers::NoMods,
-             Options options = Options::Log) {
-  emit(fd, EV_KEY, code, 0);
-  emit(fd, EV_SYN, SYN_REPORT, 0);
+// Set by SIGINT and SIGTERM to shut the daemon down
+static volatile sig_atomic_t daemonStop = 0;
+
+static void stopDaemon(int) { daemonStop = 1; }
+
+// Carries out one control request on the keyboard in fd
+static FakekeyReply daemonRequest(int fd, TextCompiler &compiler,
+                                  const FakekeyRequest &request,
+                                  const char *payload) {
+  FakekeyReply reply;
+  memset(&reply, 0, sizeof(reply));
+  reply.op = request.op;
+  reply.status = FakekeyBadRequest;
+
+  std::vector<struct input_event> events;
+  switch (request.op) {
+  case FakekeyPing:
+    if (request.size) {
+      return reply;
+    }
+    break;
+
+  case FakekeyEvents:
+    if (request.size % sizeof(FakekeyEvent)) {
+      return reply;
+    }
+    events.resize(request.size / sizeof(FakekeyEvent));
+    for (size_t i = 0; i < events.size(); ++i) {
+      FakekeyEvent in;
+      memcpy(&in, payload + i * sizeof(in), sizeof(in));
+      memset(&events[i], 0, sizeof(events[i]));
+      events[i].type = in.type;
+      events[i].code = in.code;
+      events[i].value = in.value;
+    }
+    break;
+
+  case FakekeyClick:
+  case FakekeyChord:
+    if (request.size % sizeof(FakekeyKey)) {
+      return reply;
+    }
+    {
+      Frame frame(events);
+      Injector injector(frame);
+      std::vector<size_t> ends;
+      std::vector<int> codes;
+      int modifiers = 0;
+      for (size_t i = 0; i < request.size / sizeof(FakekeyKey); ++i) {
+        FakekeyKey in;
+        memcpy(&in, payload + i * sizeof(in), sizeof(in));
+        if (in.code > KEY_MAX || in.modifiers >= Modifiers::Meta << 1) {
+          return reply;
+        }
+        if (request.op == FakekeyChord) {
+          codes.push_back(in.code);
+          modifiers |= in.modifiers;
+        } else {
+          injector.click(in.code, Modifiers(in.modifiers));
+          frame.submit();
+          ends.push_back(events.size());
+        }
+      }
+      if (request.op == FakekeyChord) {
+        injector.chord(codes, Modifiers(modifiers));
+      }
+      injector.releaseAll();
+      frame.submit();
+      ends.push_back(events.size());
+      paceEvents(fd, events, ends, 0, evdevClientBuffer() / 2);
+    }
+    reply.status = FakekeyOk;
+    reply.events = events.size();
+    return reply;
+
+  case FakekeyType: {
+    uint32_t rate;
+    if (request.size < sizeof(rate)) {
+      return reply;
+    }
+    memcpy(&rate, payload, sizeof(rate));
+    const CompiledText &text = compiler.compile(
+        std::string(payload + sizeof(rate), request.size - sizeof(rate)));
+    typeText(fd, text, rate);
+    reply.status = FakekeyOk;
+    reply.skipped = text.unmapped;
+    reply.events = text.events.size();
+    return reply;
+  }
 
-  if (modifiers & Modifiers::LeftShift) {
-    release(fd, KEY_LEFTSHIFT, Modifiers::NoMods, Options::None);
+  default:
+    return reply;
   }
-  if (modifiers & Modifiers::RightShift) {
-    release(fd, KEY_RIGHTSHIFT, Modifiers::NoMods, Options::None);
+
+  writeEvents(fd, events.data(), events.size());
+  reply.status = FakekeyOk;
+  reply.events = events.size();
+  return reply;
+}
+
+// A control connection and the bytes received from it that do not make up
+// a whole request yet
+struct DaemonClient {
+  int fd;
+  std::string input;
+};
+
+// Reads from a control connection and answers the requests in it, returning
+// false once the connection should be closed
+static bool daemonServe(int fd, TextCompiler &compiler, DaemonClient &client) {
+  char buf[65536];
+  ssize_t n = read(client.fd, buf, sizeof(buf));
+  if (n < 0 && errno == EINTR) {
+    return true;
   }
-  if (modifiers & Modifiers::LeftAlt) {
-    release(fd, KEY_LEFTALT, Modifiers::NoMods, Options::None);
+  if (n <= 0) {
+    return false;
   }
-  if (modifiers & Modifiers::RightAlt) {
-    release(fd, KEY_RIGHTALT, Modifiers::NoMods, Options::None);
+  client.input.append(buf, n);
+
+  size_t pos = 0;
+  FakekeyRequest request;
+  while (client.input.size() - pos >= sizeof(request)) {
+    memcpy(&request, client.input.data() + pos, sizeof(request));
+    if (client.input.size() - pos < sizeof(request) + request.size) {
+      break;
+    }
+    FakekeyReply reply = daemonRequest(
+        fd, compiler, request, client.input.data() + pos + sizeof(request));
+    pos += sizeof(request) + request.size;
+
+    if (send(client.fd, &reply, sizeof(reply), MSG_NOSIGNAL) !=
+        sizeof(reply)) {
+      return false;
+    }
   }
-  if (modifiers & Modifiers::LeftCtrl) {
-    release(fd, KEY_LEFTCTRL, Modifiers::NoMods, Options::None);
+  client.input.erase(0, pos);
+  return true;
+}
+
+// Keeps the keyboard in fd alive and injects what clients of the control
+// socket at path ask for, until SIGINT or SIGTERM. The socket only appears
+// once the device is ready, so clients can simply wait for it.
+void serveDaemon(int fd, const Keymap &keymap, const char *path) {
+  std::string temp = std::string(path) + ".new";
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (temp.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    exit(1);
   }
-  if (modifiers & Modifiers::RightCtrl) {
-    release(fd, KEY_RIGHTCTRL, Modifiers::NoMods, Options::None);
+  strcpy(addr.sun_path, temp.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0) {
+    perror("socket");
+    exit(1);
   }
-  if (modifiers & Modifiers::Meta) {
-    release(fd, KEY_OPTION, Modifiers::NoMods, Options::None);
+  unlink(temp.c_str());
+  if (bind(listener, reinterpret_cast<struct sockaddr *>(&addr),
+           sizeof(addr)) < 0 ||
+      listen(listener, 16) < 0 || rename(temp.c_str(), path) < 0) {
+    perror(path);
+    exit(1);
   }
 
-  if (options & Options::Log) {
-    syslog(LOG_DEBUG, "released %d", code);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stopDaemon;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  TextCompiler compiler(keymap);
+  std::vector<DaemonClient> clients;
+  std::vector<struct pollfd> pfds;
+  while (!daemonStop) {
+    pfds.assign(1, {listener, POLLIN, 0});
+    for (const DaemonClient &client : clients) {
+      pfds.push_back({client.fd, POLLIN, 0});
+    }
+    if (poll(pfds.data(), pfds.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      exit(1);
+    }
+
+    // backwards, so that dropping a client does not move the ones to go
+    for (size_t i = clients.size(); i-- > 0;) {
+      if (pfds[i + 1].revents && !daemonServe(fd, compiler, clients[i])) {
+        close(clients[i].fd);
+        clients.erase(clients.begin() + i);
+      }
+    }
+    if (pfds[0].revents & POLLIN) {
+      int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client >= 0) {
+        clients.push_back({client, std::string()});
+      }
+    }
   }
-  if (options & Options::Sleep) {
-    usleep(200 * 1000);
+
+  for (const DaemonClient &client : clients) {
+    close(client.fd);
   }
+  close(listener);
+  unlink(path);
 }
 
-void click(int fd, int code, Modifiers modifiers = Modifiers::NoMods,
-           Options options = Options::Log) {
-  press(fd, code, modifiers);
-  release(fd, code, modifiers);
+// Sends one request to a daemon and waits for the reply
+static FakekeyReply daemonCall(int sock, uint8_t op,
+                               const std::string &payload) {
+  FakekeyRequest request;
+  memset(&request, 0, sizeof(request));
+  request.op = op;
+  request.size = payload.size();
 
-  if (options & Options::Log) {
-    syslog(LOG_DEBUG, "clicked %d", code);
+  std::string message(reinterpret_cast<const char *>(&request),
+                      sizeof(request));
+  message += payload;
+  for (size_t done = 0; done < message.size();) {
+    ssize_t n = send(sock, message.data() + done, message.size() - done,
+                     MSG_NOSIGNAL);
+    if (n < 0 && errno != EINTR) {
+      perror("send");
+      exit(1);
+    }
+    done += std::max<ssize_t>(n, 0);
   }
-  if (options & Options::Sleep) {
-    usleep(200 * 1000);
+
+  FakekeyReply reply;
+  char *buf = reinterpret_cast<char *>(&reply);
+  for (size_t done = 0; done < sizeof(reply);) {
+    ssize_t n = recv(sock, buf + done, sizeof(reply) - done, 0);
+    if (n == 0) {
+      fprintf(stderr, "daemon closed the connection\n");
+      exit(1);
+    }
+    if (n < 0 && errno != EINTR) {
+      perror("recv");
+      exit(1);
+    }
+    done += std::max<ssize_t>(n, 0);
   }
+  if (reply.status != FakekeyOk) {
+    fprintf(stderr, "daemon rejected request %d\n", op);
+    exit(1);
+  }
+  return reply;
 }
 
-void writeSentence(int fd) {
-  click(fd, KEY_F);
-  click(fd, KEY_R);
-  click(fd, KEY_O);
-  click(fd, KEY_M);
-  click(fd, KEY_SPACE);
-  click(fd, KEY_T);
-  click(fd, KEY_H);
-  click(fd, KEY_E);
-  click(fd, KEY_SPACE);
-  click(fd, KEY_G);
-  click(fd, KEY_H);
-  click(fd, KEY_O);
-  click(fd, KEY_S);
-  click(fd, KEY_T);
+// Types text, or without text measures a round trip, through a daemon
+void runClient(const char *path, const std::string *text, double rate,
+               int repeat) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    exit(1);
+  }
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0 || connect(sock, reinterpret_cast<struct sockaddr *>(&addr),
+                          sizeof(addr)) < 0) {
+    perror(path);
+    exit(1);
+  }
+
+  double start = monotonicSeconds();
+  if (!text) {
+    daemonCall(sock, FakekeyPing, std::string());
+    printf("round trip %.0f us\n", (monotonicSeconds() - start) * 1e6);
+    close(sock);
+    return;
+  }
+
+  // requests carry at most 64 KiB, so long texts go in pieces that end on
+  // character boundaries
+  const size_t maxText = UINT16_MAX - sizeof(uint32_t);
+  uint32_t cps = uint32_t(rate);
+  std::string prefix(reinterpret_cast<const char *>(&cps), sizeof(cps));
+  size_t chars = 0, events = 0, skipped = 0;
+  for (int i = 0; i < repeat; ++i) {
+    for (size_t pos = 0; pos < text->size();) {
+      size_t end = std::min(pos + maxText, text->size());
+      while (end < text->size() && ((*text)[end] & 0xc0) == 0x80) {
+        --end;
+      }
+      FakekeyReply reply =
+          daemonCall(sock, FakekeyType, prefix + text->substr(pos, end - pos));
+      for (; pos < end; ++pos) {
+        chars += ((*text)[pos] & 0xc0) != 0x80;
+      }
+      events += reply.events;
+      skipped += reply.skipped;
+    }
+  }
+  double elapsed = monotonicSeconds() - start;
+  close(sock);
+
+  printf("typed %zu characters, %zu events in %.3f s, %.0f chars/s\n",
+         chars - skipped, events, elapsed,
+         elapsed > 0 ? (chars - skipped) / elapsed : 0.0);
+  if (skipped) {
+    fprintf(stderr, "%zu characters not in keymap were skipped\n", skipped);
+  }
+}
+
+// Reads all of stdin, for --type=-
+static std::string readStdin() {
+  std::string text;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0) {
+    text.append(buf, n);
+  }
+  return text;
 }
 
-int main(void) {
+static void usage(const char *progname) {
+  fprintf(stderr,
+          "usage: %s [OPTION]...\n"
+          "  -b, --benchmark[=CLICKS] compare batched and unbatched writes\n"
+          "  -t, --type=TEXT          type UTF-8 text, - reads stdin\n"
+          "  -k, --keymap=FILE        layout for --type instead of US\n"
+          "  -r, --rate=CPS           characters per second, 0 for as\n"
+          "                           fast as possible (default 0)\n"
+          "  -n, --repeat=COUNT       type the text COUNT times\n"
+          "  -p, --replay=FILE        replay evdev_trace output, - reads\n"
+          "                           stdin\n"
+          "  -x, --speed=FACTOR       replay speed, 0 for as fast as\n"
+          "                           possible (default 1)\n"
+          "  -S, --storm=DEVICES      create devices and flood them with\n"
+          "                           events, e.g. keyboard:4,touch:2;\n"
+          "                           kinds are keyboard, mouse and touch\n"
+          "  -R, --storm-rate=HZ      frames per second per device (1000)\n"
+          "  -g, --gesture=LIST       swipe, pinch-in, pinch-out and fling\n"
+          "                           on a touch screen, e.g. swipe:300,\n"
+          "                           fling; durations in ms\n"
+          "  -H, --hz=HZ              gesture sample rate (default 120)\n"
+          "  -f, --fingers=N          fingers per swipe or fling (1)\n"
+          "  -l, --loopback=RATES     measure injection to delivery latency\n"
+          "                           at each rate, e.g. 100,1000,10000\n"
+          "  -d, --duration=SEC       how long to storm or to run each\n"
+          "                           loopback rate (10)\n"
+          "  -T, --timer=TIMER        wait with nanosleep (default) or\n"
+          "                           timerfd\n"
+          "  -s, --spin=USEC          poll the clock for the last USEC\n"
+          "                           microseconds of every wait\n"
+          "  -D, --daemon=SOCKET      keep the keyboard and take requests\n"
+          "                           on a Unix socket until SIGTERM\n"
+          "  -c, --connect=SOCKET     type --type through a daemon, or\n"
+          "                           without it time a round trip\n"
+          "  -h, --help               this help text\n",
+          progname);
+}
+
+int main(int argc, char **argv) {
   struct uinput_setup usetup;
+  int benchmarkClicks = 0;
+  const char *typeArg = nullptr;
+  const char *keymapPath = nullptr;
+  double rate = 0;
+  int repeat = 1;
+  Scheduler::Clock timer = Scheduler::Clock::NanoSleep;
+  long spinUs = 0;
+  const char *replayPath = nullptr;
+  double speed = 1;
+  std::vector<StormDevice> storms;
+  double stormRate = 1000;
+  double duration = 10;
+  std::vector<double> loopbackRates;
+  std::vector<Gesture> gestures;
+  double hz = 120;
+  int fingers = 1;
+  const char *daemonPath = nullptr;
+  const char *connectPath = nullptr;
+
+  static const struct option longOptions[] = {
+      {"benchmark", optional_argument, nullptr, 'b'},
+      {"type", required_argument, nullptr, 't'},
+      {"keymap", required_argument, nullptr, 'k'},
+      {"rate", required_argument, nullptr, 'r'},
+      {"repeat", required_argument, nullptr, 'n'},
+      {"replay", required_argument, nullptr, 'p'},
+      {"speed", required_argument, nullptr, 'x'},
+      {"storm", required_argument, nullptr, 'S'},
+      {"storm-rate", required_argument, nullptr, 'R'},
+      {"gesture", required_argument, nullptr, 'g'},
+      {"hz", required_argument, nullptr, 'H'},
+      {"fingers", required_argument, nullptr, 'f'},
+      {"loopback", required_argument, nullptr, 'l'},
+      {"duration", required_argument, nullptr, 'd'},
+      {"timer", required_argument, nullptr, 'T'},
+      {"spin", required_argument, nullptr, 's'},
+      {"daemon", required_argument, nullptr, 'D'},
+      {"connect", required_argument, nullptr, 'c'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  static const char shortOptions[] = "b::t:k:r:n:p:x:S:R:g:H:f:l:d:T:s:D:c:h";
+
+  for (int opt; (opt = getopt_long(argc, argv, shortOptions, longOptions,
+                                   nullptr)) != -1;) {
+    switch (opt) {
+    case 'b':
+      benchmarkClicks = optarg ? atoi(optarg) : 100000;
+      break;
+    case 't':
+      typeArg = optarg;
+      break;
+    case 'k':
+      keymapPath = optarg;
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 'n':
+      repeat = atoi(optarg);
+      break;
+    case 'p':
+      replayPath = optarg;
+      break;
+    case 'x':
+      speed = atof(optarg);
+      break;
+    case 'S':
+      if (!parseStorm(optarg, storms)) {
+        exit(1);
+      }
+      break;
+    case 'R':
+      stormRate = atof(optarg);
+      break;
+    case 'g':
+      if (!parseGestures(optarg, gestures)) {
+        exit(1);
+      }
+      break;
+    case 'H':
+      hz = atof(optarg);
+      break;
+    case 'f':
+      fingers = atoi(optarg);
+      break;
+    case 'l':
+      for (char *rest = optarg; *rest;) {
+        double rate = strtod(rest, &rest);
+        if (rate <= 0 || (*rest && *rest++ != ',')) {
+          usage(argv[0]);
+          exit(1);
+        }
+        loopbackRates.push_back(rate);
+      }
+      break;
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 'T':
+      if (!strcmp(optarg, "timerfd")) {
+        timer = Scheduler::Clock::TimerFd;
+      } else if (strcmp(optarg, "nanosleep")) {
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 's':
+      spinUs = atol(optarg);
+      break;
+    case 'D':
+      daemonPath = optarg;
+      break;
+    case 'c':
+      connectPath = optarg;
+      break;
+    case 'h':
+      usage(argv[0]);
+      exit(0);
+    default:
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+  if (optind < argc || benchmarkClicks < 0 || rate < 0 || repeat < 1 ||
+      spinUs < 0 || speed < 0 || stormRate <= 0 || duration <= 0 ||
+      hz <= 0 || fingers < 1 || fingers > touchSlots) {
+    usage(argv[0]);
+    exit(1);
+  }
+  scheduler.configure(timer, spinUs * 1000);
+
+  if (connectPath) {
+    std::string text;
+    if (typeArg) {
+      text = strcmp(typeArg, "-") ? typeArg : readStdin();
+    }
+    runClient(connectPath, typeArg ? &text : nullptr, rate, repeat);
+    return 0;
+  }
+
+  if (!loopbackRates.empty()) {
+    loopback(loopbackRates, duration);
+    return 0;
+  }
+
+  if (!storms.empty()) {
+    runStorm(storms, stormRate, duration);
+    sleep(2);
+    return 0;
+  }
+
+  if (replayPath) {
+    Trace trace;
+    if (!trace.load(replayPath)) {
+      exit(1);
+    }
+    if (trace.events.empty()) {
+      fprintf(stderr, "%s: no events found\n", replayPath);
+      exit(1);
+    }
+
+    std::vector<std::unique_ptr<UinputDevice>> devices;
+    for (size_t i = 0; i < trace.devices.size(); ++i) {
+      devices.push_back(createReplayDevice(trace, i));
+    }
+
+    std::vector<int> fds;
+    for (const auto &device : devices) {
+      fds.push_back(device->fd);
+    }
+    waitForReaders(fds, 1000);
+
+    double start = monotonicSeconds();
+    replayTrace(trace, devices, speed);
+    printf("replayed %zu events from %zu devices in %.3f s\n",
+           trace.events.size(), devices.size(), monotonicSeconds() - start);
+    scheduler.report(stdout);
+
+    sleep(2);
+    return 0;
+  }
+
+  if (!gestures.empty()) {
+    runGestures(gestures, hz, fingers, repeat);
+    return 0;
+  }
+
+  Keymap keymap;
+  if (keymapPath && !keymap.load(keymapPath)) {
+    exit(1);
+  }
+  std::string text;
+  if (typeArg) {
+    text = strcmp(typeArg, "-") ? typeArg : readStdin();
+  }
 
   int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
   if (fd < 0) {
@@ -221,6 +2927,16 @@ int main(void) {
   supportKey(fd, KEY_8);
   supportKey(fd, KEY_9);
   supportKey(fd, KEY_0);
+  supportKey(fd, KEY_F24);
+  for (int code : keymap.codes()) {
+    supportKey(fd, code);
+  }
+  if (daemonPath) {
+    // clients may send any keyboard key
+    for (int code = KEY_ESC; code < BTN_MISC; ++code) {
+      supportKey(fd, code);
+    }
+  }
 
   memset(&usetup, 0, sizeof(usetup));
   usetup.id.bustype = BUS_USB;
@@ -239,13 +2955,14 @@ int main(void) {
 
   /*
    * On UI_DEV_CREATE the kernel will create the device node for this
-   * device. We are inserting a pause here so that userspace has time
-   * to detect, initialize the new device, and can start listening to
-   * the event, otherwise it will not notice the event we are about
-   * to send. This pause is only needed in our example code!
+   * device. We are waiting here so that userspace has time to detect,
+   * initialize the new device, and can start listening to the event,
+   * otherwise it will not notice the event we are about to send. Once
+   * something opens the node it is listening; give up after a second,
+   * which was the fixed pause this used to be.
    */
-  syslog(LOG_DEBUG, "created, sleeping...");
-  sleep(1);
+  syslog(LOG_DEBUG, "created, waiting for readers...");
+  waitForReaders({fd}, 1000);
   syslog(LOG_DEBUG, "awake...");
 
   // +?``
@@ -254,9 +2971,33 @@ int main(void) {
   // click(fd, KEY_EQUAL, Modifiers::LeftAlt);
   // click(fd, KEY_EQUAL, Modifiers(Modifiers::LeftAlt | Modifiers::LeftShift));
   // usleep(200 * 1000);
-  press(fd, KEY_GRAVE, Modifiers(Modifiers::LeftAlt | Modifiers::LeftShift));
-  click(fd, KEY_U);
-  release(fd, KEY_GRAVE, Modifiers(Modifiers::LeftAlt | Modifiers::LeftShift));
+  if (daemonPath) {
+    serveDaemon(fd, keymap, daemonPath);
+  } else if (benchmarkClicks > 0) {
+    benchmark(fd, benchmarkClicks);
+  } else if (typeArg) {
+    TextCompiler compiler(keymap);
+    double start = monotonicSeconds();
+    for (int i = 0; i < repeat; ++i) {
+      typeText(fd, compiler.compile(text), rate);
+    }
+    double elapsed = monotonicSeconds() - start;
+
+    const CompiledText &compiled = compiler.compile(text);
+    size_t chars = compiled.charEnd.size() * repeat;
+    printf("typed %zu characters, %zu events in %.3f s, %.0f chars/s\n",
+           chars, compiled.events.size() * repeat, elapsed,
+           elapsed > 0 ? chars / elapsed : 0.0);
+    if (compiled.unmapped) {
+      fprintf(stderr, "%d characters not in keymap were skipped\n",
+              compiled.unmapped);
+    }
+  } else {
+    press(fd, KEY_GRAVE, Modifiers(Modifiers::LeftAlt | Modifiers::LeftShift));
+    click(fd, KEY_U);
+    release(fd, KEY_GRAVE,
+            Modifiers(Modifiers::LeftAlt | Modifiers::LeftShift));
+  }
 
   // // 1!!''
   // click(fd, KEY_1, Modifiers::NoMods);
@@ -346,13 +3087,17 @@ int main(void) {
   // release(fd, KEY_OPTION);
   // release(fd, KEY_A, Options::SleepAndLog);
 
-  /*
-   * Give userspace some time to read the events before we destroy the
-   * device with UI_DEV_DESTROY.
-   */
-  syslog(LOG_DEBUG, "all written, sleeping...");
-  sleep(2);
-  syslog(LOG_DEBUG, "awake, destroying...");
+  scheduler.report(stdout);
+
+  if (!daemonPath) {
+    /*
+     * Give userspace some time to read the events before we destroy the
+     * device with UI_DEV_DESTROY.
+     */
+    syslog(LOG_DEBUG, "all written, sleeping...");
+    sleep(2);
+    syslog(LOG_DEBUG, "awake, destroying...");
+  }
 
   if (ioctl(fd, UI_DEV_DESTROY) < 0) {
     perror("UI_DEV_DESTROY");